@@ -0,0 +1,120 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <thrust/device_vector.h>
+#include <thrust/copy.h>
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+
+// Neighbor aggregates (-ag): the radius search reduces the attributes of each
+// query's neighbors while traversing instead of storing the neighbors; see
+// Params. The result is one value per attribute per query, plus the number
+// of neighbors.
+
+// one row per point, in point file order, with up to MAX_AGG_ATTRS
+// comma-separated attributes; all rows must have as many as the first.
+static std::vector<float> readAttributes( RTNNState& state ) {
+  std::ifstream in(state.aggFile);
+  if (!in.good()) {
+    std::cerr << "Could not read " << state.aggFile << "\n";
+    exit(1);
+  }
+
+  std::vector<float> attrs;
+  unsigned int numAttrs = 0, rows = 0;
+  std::string line, tok;
+  while (std::getline(in, line)) {
+    if (line.empty()) continue;
+    std::stringstream ss(line);
+    unsigned int n = 0;
+    while (std::getline(ss, tok, ',')) {
+      attrs.push_back(std::stof(tok));
+      n++;
+    }
+    if (rows++ == 0) numAttrs = n;
+    if (n != numAttrs || n == 0 || n > MAX_AGG_ATTRS) {
+      std::cerr << state.aggFile << ":" << rows << ": expected " << (numAttrs ? numAttrs : 1)
+                << " to " << MAX_AGG_ATTRS << " attributes\n";
+      exit(1);
+    }
+  }
+  if (rows != state.numPoints) {
+    std::cerr << state.aggFile << " has " << rows << " rows for " << state.numPoints << " points\n";
+    exit(1);
+  }
+  state.params.aggAttrs = numAttrs;
+  return attrs;
+}
+
+// call after the points and queries are uploaded.
+void setupAggregates( RTNNState& state ) {
+  Timing::startTiming("setup aggregates");
+    std::vector<float> attrs = readAttributes(state);
+    thrust::device_ptr<float> d_attrs_ptr;
+    state.params.pointAttrs = allocThrustDevicePtr(&d_attrs_ptr, attrs.size(), &state.d_pointers);
+    thrust::copy(attrs.begin(), attrs.end(), d_attrs_ptr);
+    state.params.pointIds = state.d_pointIds;
+
+    // what a query without neighbors gets, which filtered queries keep
+    AggOp op = state.params.aggOp;
+    float init = (op == AGG_MIN) ? INFINITY : (op == AGG_MAX) ? -INFINITY : 0.0f;
+    unsigned int numOut = state.numOrigQueries * state.params.aggAttrs;
+    thrust::device_ptr<float> d_out_ptr;
+    state.params.aggOut = allocThrustDevicePtr(&d_out_ptr, numOut, &state.d_pointers);
+    fillByValue(d_out_ptr, numOut, init);
+    thrust::device_ptr<unsigned int> d_counts_ptr;
+    state.params.aggCounts = allocThrustDevicePtr(&d_counts_ptr, state.numOrigQueries, &state.d_pointers);
+    fillByValue(d_counts_ptr, state.numOrigQueries, 0);
+
+    if (state.params.aggKernel == AGG_GAUSS && state.params.aggSigma <= 0)
+      state.params.aggSigma = state.radius / 2;
+  Timing::stopTiming(true);
+}
+
+// print the average of each aggregate over the queries with neighbors, and
+// write one line per query (in input order) to the output file, if any: the
+// aggregates followed by the neighbor count, comma-separated.
+void reportAggregates( RTNNState& state ) {
+  unsigned int numAttrs = state.params.aggAttrs;
+  unsigned int numQueries = state.numOrigQueries;
+  std::vector<float> out((size_t)numQueries * numAttrs);
+  std::vector<unsigned int> counts(numQueries);
+  thrust::copy(thrust::device_pointer_cast(state.params.aggOut),
+      thrust::device_pointer_cast(state.params.aggOut) + out.size(), out.begin());
+  thrust::copy(thrust::device_pointer_cast(state.params.aggCounts),
+      thrust::device_pointer_cast(state.params.aggCounts) + numQueries, counts.begin());
+
+  std::vector<double> totals(numAttrs, 0);
+  unsigned int numNonEmpty = 0;
+  unsigned long long numNeighbors = 0;
+  for (unsigned int q = 0; q < numQueries; q++) {
+    numNeighbors += counts[q];
+    if (counts[q] == 0) continue;
+    numNonEmpty++;
+    for (unsigned int a = 0; a < numAttrs; a++) totals[a] += out[(size_t)q * numAttrs + a];
+  }
+  fprintf(stdout, "\tAggregated %llu neighbors; %u queries have none\n", numNeighbors, numQueries - numNonEmpty);
+  for (unsigned int a = 0; a < numAttrs; a++)
+    fprintf(stdout, "\tAttribute %u: %f on average\n", a, numNonEmpty ? totals[a] / numNonEmpty : 0.0);
+
+  if (!state.outfile.empty()) {
+    FILE* fp = fopen(state.outfile.c_str(), "w");
+    if (fp == nullptr) {
+      perror(state.outfile.c_str());
+      exit(1);
+    }
+    for (unsigned int q = 0; q < numQueries; q++) {
+      for (unsigned int a = 0; a < numAttrs; a++) fprintf(fp, "%g,", out[(size_t)q * numAttrs + a]);
+      fprintf(fp, "%u\n", counts[q]);
+    }
+    fclose(fp);
+  }
+}
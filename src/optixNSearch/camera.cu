@@ -31,6 +31,7 @@
 
 #include "optixNSearch.h"
 #include "helpers.h"
+#include "metric.h"
 
 extern "C" {
 __constant__ Params params;
@@ -62,6 +63,79 @@ extern "C" __global__ void __raygen__knn()
     const float tmin = 0.f;
     const float tmax = 1.e-16f;
 
+#if K == 1
+    // 1-NN: the best key so far and its point are all the state there is, so
+    // they travel in payloads rather than in a queue in memory. the key
+    // starts as the radius's and only shrinks; see __intersection__sphere_knn.
+    unsigned int best_key = __float_as_uint(metricKey(params.radius));
+    unsigned int best_idx = 0xffffffff;
+
+    optixTrace(
+        params.handle,
+        ray_origin,
+        ray_direction,
+        tmin,
+        tmax,
+        0.0f,
+        OptixVisibilityMask( 1 ),
+        OPTIX_RAY_FLAG_NONE,
+        RAY_TYPE_RADIANCE,
+        1,
+        RAY_TYPE_RADIANCE,
+        reinterpret_cast<unsigned int&>(queryIdx),
+        best_key,
+        best_idx
+    );
+
+    if (params.mode == PRECISE && best_idx != 0xffffffff) {
+      params.frame_buffer[queryIdx] = best_idx;
+      if (params.nnDists) params.nnDists[params.queryIds[queryIdx]] = metricDist(__uint_as_float(best_key));
+    }
+#elif K > LARGE_K
+    // large-K KNN: the candidates go to the thread's scratch row (see
+    // __intersection__sphere_knn), of which the K nearest are selected once
+    // more at the end. the launch may have fewer threads than rays (see
+    // |numRays|), so each thread traces every launch-width-th ray.
+    float* keys = params.rowKeys + (size_t)idx.x * KNN_SCRATCH;
+    unsigned int* ids = params.knnIds + (size_t)idx.x * KNN_SCRATCH;
+    const unsigned int width = optixGetLaunchDimensions().x;
+    while (true) {
+      unsigned int count = 0;
+      unsigned int bound = __float_as_uint(metricKey(params.radius));
+
+      optixTrace(
+          params.handle,
+          ray_origin,
+          ray_direction,
+          tmin,
+          tmax,
+          0.0f,
+          OptixVisibilityMask( 1 ),
+          OPTIX_RAY_FLAG_NONE,
+          RAY_TYPE_RADIANCE,
+          1,
+          RAY_TYPE_RADIANCE,
+          reinterpret_cast<unsigned int&>(queryIdx),
+          count,
+          bound
+      );
+
+      if (params.mode == PRECISE) {
+        if (count > K) {
+          selectK(keys, ids, count, K);
+          count = K;
+        }
+        for (unsigned int i = 0; i < count; i++) {
+          params.frame_buffer[(size_t)queryIdx * K + i] = ids[i];
+        }
+      }
+
+      rayIdx += width;
+      if (rayIdx >= params.numRays) break;
+      queryIdx = (params.d_r2q_map == nullptr) ? rayIdx : params.d_r2q_map[rayIdx];
+      ray_origin = params.queries[queryIdx];
+    }
+#else
     // pointers are 64 bits, so need two 32-bit integers. optixPathTracing has an example for this.
     float min_dists[K];
     unsigned int u0, u1;
@@ -99,9 +173,10 @@ extern "C" __global__ void __raygen__knn()
     if (params.mode == PRECISE) { // implies this is an actual search
       // the bound should be |size| rather than K (size <= K) so that we don't have to initialize min_idxs!
       for (unsigned int i = 0; i < size; i++) {
-        params.frame_buffer[queryIdx * K + i] = min_idxs[i];
+        params.frame_buffer[(size_t)queryIdx * K + i] = min_idxs[i];
       }
     }
+#endif
 }
 
 extern "C" __global__ void __raygen__radius()
@@ -126,6 +201,133 @@ extern "C" __global__ void __raygen__radius()
     const float tmin = 0.f;
     const float tmax = 1.e-16f;
 
+    if (params.histBins && params.mode != NOTEST) {
+      // a private histogram per ray, merged into the global one once the ray
+      // is done; only the non-empty bins cost an atomic.
+      float hist[MAX_HIST_BINS];
+      for (unsigned int b = 0; b < params.histBins; b++) hist[b] = 0;
+      unsigned int u0, u1;
+      packPointer( hist, u0, u1 );
+
+      optixTrace(
+          params.handle,
+          ray_origin,
+          ray_direction,
+          tmin,
+          tmax,
+          0.0f,
+          OptixVisibilityMask( 1 ),
+          OPTIX_RAY_FLAG_NONE,
+          RAY_TYPE_RADIANCE,
+          1,
+          RAY_TYPE_RADIANCE,
+          reinterpret_cast<unsigned int&>(queryIdx),
+          reinterpret_cast<unsigned int&>(id),
+          u0, u1
+      );
+
+      float w = params.queryWeights ? params.queryWeights[params.queryIds[queryIdx]] : 1.0f;
+      for (unsigned int b = 0; b < params.histBins; b++)
+        if (hist[b] != 0) atomicAdd(&params.hist[b], (double)(w * hist[b]));
+      return;
+    }
+
+    if (params.aggAttrs && params.mode != NOTEST) {
+      // running reductions in payloads; see |write_res_agg|.
+      float init = (params.aggOp == AGG_MIN) ? INFINITY : (params.aggOp == AGG_MAX) ? -INFINITY : 0.0f;
+      unsigned int a[MAX_AGG_ATTRS];
+      for (unsigned int i = 0; i < MAX_AGG_ATTRS; i++) a[i] = __float_as_uint(init);
+      unsigned int wsum = __float_as_uint(0.0f);
+
+      optixTrace(
+          params.handle,
+          ray_origin,
+          ray_direction,
+          tmin,
+          tmax,
+          0.0f,
+          OptixVisibilityMask( 1 ),
+          OPTIX_RAY_FLAG_NONE,
+          RAY_TYPE_RADIANCE,
+          1,
+          RAY_TYPE_RADIANCE,
+          reinterpret_cast<unsigned int&>(queryIdx),
+          reinterpret_cast<unsigned int&>(id),
+          a[0], a[1], a[2], a[3],
+          wsum
+      );
+
+      unsigned int qId = params.queryIds[queryIdx];
+      float w = __uint_as_float(wsum);
+      for (unsigned int i = 0; i < params.aggAttrs; i++) {
+        float v = __uint_as_float(a[i]);
+        if (params.aggOp == AGG_MEAN) v = (w > 0) ? v / w : 0.0f;
+        params.aggOut[qId * params.aggAttrs + i] = v;
+      }
+      params.aggCounts[qId] = id;
+      return;
+    }
+
+    if (params.sphPass && params.mode != NOTEST) {
+      // the density, or the acceleration, in payloads 2-4; see
+      // |write_res_sph_density| and |write_res_sph_force|.
+      unsigned int s0 = __float_as_uint(0.0f), s1 = s0, s2 = s0;
+
+      optixTrace(
+          params.handle,
+          ray_origin,
+          ray_direction,
+          tmin,
+          tmax,
+          0.0f,
+          OptixVisibilityMask( 1 ),
+          OPTIX_RAY_FLAG_NONE,
+          RAY_TYPE_RADIANCE,
+          1,
+          RAY_TYPE_RADIANCE,
+          reinterpret_cast<unsigned int&>(queryIdx),
+          reinterpret_cast<unsigned int&>(id),
+          s0, s1, s2
+      );
+
+      unsigned int qId = params.queryIds[queryIdx];
+      if (params.sphPass == SPH_DENSITY)
+        params.sphDensity[qId] = __uint_as_float(s0);
+      else
+        params.sphForce[qId] = params.sphMass * make_float3(__uint_as_float(s0), __uint_as_float(s1), __uint_as_float(s2));
+      return;
+    }
+
+    if (params.numShells && params.mode != NOTEST) {
+      // one count per shell; see |write_res_shell|.
+      unsigned int c[MAX_SHELLS] = {0};
+      optixTrace(
+          params.handle,
+          ray_origin,
+          ray_direction,
+          tmin,
+          tmax,
+          0.0f,
+          OptixVisibilityMask( 1 ),
+          OPTIX_RAY_FLAG_NONE,
+          RAY_TYPE_RADIANCE,
+          1,
+          RAY_TYPE_RADIANCE,
+          reinterpret_cast<unsigned int&>(queryIdx),
+          reinterpret_cast<unsigned int&>(id),
+          c[0], c[1], c[2], c[3], c[4], c[5]
+      );
+
+      if (params.shellCounts) {
+        for (unsigned int s = 0; s < params.numShells; s++)
+          params.frame_buffer[(size_t)queryIdx * params.limit + s] = c[s];
+      }
+      return;
+    }
+
+    // the state of the generator of TRUNC_RANDOM; never 0.
+    unsigned int rng = tea4(queryIdx, params.truncSeed) | 1;
+
     optixTrace(
         params.handle,
         ray_origin,
@@ -141,6 +343,7 @@ extern "C" __global__ void __raygen__radius()
         1,
         RAY_TYPE_RADIANCE,
         reinterpret_cast<unsigned int&>(queryIdx),
-        reinterpret_cast<unsigned int&>(id)
+        reinterpret_cast<unsigned int&>(id),
+        rng
     );
 }
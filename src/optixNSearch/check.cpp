@@ -5,6 +5,7 @@
 #include <iterator>
 
 #include "state.h"
+#include "metric.h"
 
 typedef std::pair<float, unsigned int> knn_res_t;
 class Compare
@@ -34,8 +35,8 @@ void sanityCheckKNN( RTNNState& state, int batch_id ) {
     for (unsigned int p = 0; p < state.numPoints; p++) {
       float3 point = state.h_points[p];
       float3 diff = query - point;
-      float dists = dot(diff, diff);
-      if ((dists > 0) && (dists < state.gRadius * state.gRadius)) {
+      float dists = metricKey(diff);
+      if ((dists > 0) && (dists < metricKey(state.gRadius))) {
         knn_res_t res = std::make_pair(dists, p);
         if (size < state.knn) {
           topKQ.push(res);
@@ -51,9 +52,9 @@ void sanityCheckKNN( RTNNState& state, int batch_id ) {
     std::unordered_set<unsigned int> gt_idxs;
     std::unordered_set<float> gt_dists;
     for (unsigned int i = 0; i < size; i++) {
-      if (printRes) std::cout << "[" << sqrt(topKQ.top().first) << ", " << topKQ.top().second << "] ";
+      if (printRes) std::cout << "[" << metricDist(topKQ.top().first) << ", " << topKQ.top().second << "] ";
       gt_idxs.insert(topKQ.top().second);
-      gt_dists.insert(sqrt(topKQ.top().first));
+      gt_dists.insert(metricDist(topKQ.top().first));
       topKQ.pop();
     }
     if (printRes) std::cout << std::endl;
@@ -67,11 +68,11 @@ void sanityCheckKNN( RTNNState& state, int batch_id ) {
       if (p == UINT_MAX) break;
       else {
         float3 diff = state.h_points[p] - query;
-        float dists = dot(diff, diff);
+        float dists = metricKey(diff);
         gpu_idxs.insert(p);
-        gpu_dists.insert(sqrt(dists));
+        gpu_dists.insert(metricDist(dists));
         if (printRes) {
-          std::cout << "[" << sqrt(dists) << ", " << p << "] ";
+          std::cout << "[" << metricDist(dists) << ", " << p << "] ";
         }
       }
     }
@@ -82,7 +83,15 @@ void sanityCheckKNN( RTNNState& state, int batch_id ) {
     // different, although both CPU and GPU should both have implemented the
     // same FP standard. need to revisit this.
     // https://www.techiedelight.com/print-set-unordered_set-cpp/
-    if (gt_dists != gpu_dists) {
+    // an eps-approximate search only promises as many neighbors and a Kth
+    // distance within 1+eps of the exact one.
+    bool correct = (gt_dists == gpu_dists);
+    if (state.knnEps > 0) {
+      float gtKth = gt_dists.empty() ? 0 : *std::max_element(gt_dists.begin(), gt_dists.end());
+      float gpuKth = gpu_dists.empty() ? 0 : *std::max_element(gpu_dists.begin(), gpu_dists.end());
+      correct = (gpu_idxs.size() == size) && (gpuKth <= gtKth * (1 + state.knnEps) * (1 + 1e-6f));
+    }
+    if (!correct) {
       fprintf(stdout, "Incorrect query [%u] %f, %f, %f\n", q, query.x, query.y, query.z);
       std::cout << "GT:\n";
       std::copy(gt_dists.begin(),
@@ -115,17 +124,17 @@ void sanityCheckRadius( RTNNState& state, int batch_id ) {
       else {
         totalNeighbors++;
         float3 diff = state.h_points[p] - state.h_queries[q];
-        float dists = dot(diff, diff);
-        if (dists > state.gRadius * state.gRadius) {
+        float dists = metricKey(diff);
+        if (dists > metricKey(state.gRadius)) {
           fprintf(stdout, "Point %u [%f, %f, %f] is not a neighbor of query %u [%f, %f, %f]. Dist is %lf.\n",
             p, state.h_points[p].x, state.h_points[p].y, state.h_points[p].z,
             q, state.h_queries[q].x, state.h_queries[q].y, state.h_queries[q].z,
-            sqrt(dists));
+            metricDist(dists));
           totalWrongNeighbors++;
-          totalWrongDist += sqrt(dists);
+          totalWrongDist += metricDist(dists);
           exit(1);
         }
-        //std::cout << sqrt(dists) << " ";
+        //std::cout << metricDist(dists) << " ";
       }
       //std::cout << p << " ";
     }
@@ -143,12 +152,12 @@ void checkFilteredQueries(RTNNState& state) {
   for (unsigned int q = 0; q < state.numFltQs; q++) {
     for (unsigned int p = 0; p < state.numPoints; p++) {
       float3 diff = state.h_points[p] - state.h_fltQs[q];
-      float dists = dot(diff, diff);
-      if (dists < state.gRadius * state.gRadius) {
+      float dists = metricKey(diff);
+      if (dists < metricKey(state.gRadius)) {
         fprintf(stdout, "Query %u [%f, %f, %f] shouldn't be filtered; conflicting query %u [%f, %f, %f]. Dist is %lf.\n",
           q, state.h_queries[q].x, state.h_queries[q].y, state.h_queries[q].z,
           p, state.h_points[p].x, state.h_points[p].y, state.h_points[p].z,
-          sqrt(dists));
+          metricDist(dists));
       }
     }
   }
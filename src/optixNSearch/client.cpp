@@ -0,0 +1,329 @@
+// Load-testing client for the search server (optixNSearch --server). Each
+// thread opens its own connection and sends requests back to back, each with
+// the next |batch| queries of the query file (wrapping around); the latency of
+// each request (send to last byte of response) is recorded. With --shm 1,
+// requests go through a shared-memory ring instead (see protocol.h) and up to
+// --window requests are kept in flight per connection.
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "protocol.h"
+
+struct ClientArgs
+{
+  std::string sock;
+  std::string qfile;
+  std::string searchMode = "radius";
+  float       radius     = 2;
+  unsigned int knn       = 50;
+  unsigned int batch     = 1024;
+  unsigned int numReqs   = 1000; // per connection
+  unsigned int conns     = 1;
+  bool        dists      = false;
+  bool        shm        = false;
+  unsigned int window    = 4;
+};
+
+static void printUsageAndExit( const char* argv0 )
+{
+  std::cerr << "\e[1mUsage:\e[0m " << argv0 << " [options]\n\n";
+  std::cerr << "  --socket          | -s      Unix domain socket of the server. Required.\n";
+  std::cerr << "  --qfile           | -q      File for queries (x,y,z per line). Required.\n";
+  std::cerr << "  --searchmode      | -sm     Search mode; can only be \"knn\" or \"radius\". Default is \"radius\".\n";
+  std::cerr << "  --radius          | -r      Search radius. Default is 2.\n";
+  std::cerr << "  --knn             | -k      Max K returned. Default is 50.\n";
+  std::cerr << "  --batch           | -b      Queries per request. Default is 1024.\n";
+  std::cerr << "  --requests        | -n      Requests per connection. Default is 1000.\n";
+  std::cerr << "  --connections     | -c      Concurrent connections. Default is 1.\n";
+  std::cerr << "  --dists           | -dist   Request distances too? Default is false.\n";
+  std::cerr << "  --shm             | -shm    Exchange queries and results through shared memory? Default is false.\n";
+  std::cerr << "  --window          | -w      Requests in flight per connection with --shm. Default is 4.\n";
+  std::cerr << "  --help            | -h      Print this usage message\n";
+  exit( 0 );
+}
+
+static void parseArgs( ClientArgs& args, int argc, char* argv[] )
+{
+  for( int i = 1; i < argc; ++i )
+  {
+    const std::string arg = argv[i];
+    if( arg == "--help" || arg == "-h" ) printUsageAndExit( argv[0] );
+    if( i >= argc - 1 ) printUsageAndExit( argv[0] );
+
+    if( arg == "--socket" || arg == "-s" ) args.sock = argv[++i];
+    else if( arg == "--qfile" || arg == "-q" ) args.qfile = argv[++i];
+    else if( arg == "--searchmode" || arg == "-sm" ) args.searchMode = argv[++i];
+    else if( arg == "--radius" || arg == "-r" ) args.radius = std::stof(argv[++i]);
+    else if( arg == "--knn" || arg == "-k" ) args.knn = atoi(argv[++i]);
+    else if( arg == "--batch" || arg == "-b" ) args.batch = atoi(argv[++i]);
+    else if( arg == "--requests" || arg == "-n" ) args.numReqs = atoi(argv[++i]);
+    else if( arg == "--connections" || arg == "-c" ) args.conns = atoi(argv[++i]);
+    else if( arg == "--dists" || arg == "-dist" ) args.dists = (bool)(atoi(argv[++i]));
+    else if( arg == "--shm" || arg == "-shm" ) args.shm = (bool)(atoi(argv[++i]));
+    else if( arg == "--window" || arg == "-w" ) args.window = atoi(argv[++i]);
+    else
+    {
+      std::cerr << "Unknown option '" << argv[i] << "'\n";
+      printUsageAndExit( argv[0] );
+    }
+  }
+
+  if (args.sock.empty() || args.qfile.empty() || args.batch == 0 || args.conns == 0 || args.window == 0 ||
+      ((args.searchMode != "knn") && (args.searchMode != "radius")))
+    printUsageAndExit( argv[0] );
+}
+
+static std::vector<float> readQueries( const std::string& qfile )
+{
+  std::ifstream file(qfile);
+  if (!file.good()) {
+    std::cerr << "Could not read " << qfile << "\n";
+    exit(1);
+  }
+
+  std::vector<float> coords;
+  std::string line;
+  while (std::getline(file, line)) {
+    double x, y, z;
+    if (sscanf(line.c_str(), "%lf,%lf,%lf", &x, &y, &z) != 3) continue;
+    coords.push_back(x);
+    coords.push_back(y);
+    coords.push_back(z);
+  }
+  return coords;
+}
+
+static int connectTo( const std::string& path )
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    exit(1);
+  }
+  return fd;
+}
+
+struct ConnStats
+{
+  std::vector<double> latencies; // ms
+  unsigned long long  neighbors = 0;
+  unsigned long long  queries   = 0;
+  unsigned int        errors    = 0;
+};
+
+static RTNNReqHeader makeRequest( const ClientArgs* args, unsigned int batch )
+{
+  RTNNReqHeader hdr;
+  hdr.magic = RTNN_REQ_MAGIC;
+  hdr.mode = (args->searchMode == "knn") ? RTNN_REQ_KNN : RTNN_REQ_RADIUS;
+  hdr.flags = args->dists ? RTNN_FLAG_DISTS : 0;
+  hdr.numQueries = batch;
+  hdr.knn = args->knn;
+  hdr.radius = args->radius;
+  return hdr;
+}
+
+static void runShmConnection( const ClientArgs* args, const std::vector<float>* coords, unsigned int connId, ConnStats* stats )
+{
+  unsigned int numQueries = coords->size() / 3;
+  unsigned int batch = std::min(args->batch, numQueries);
+
+  RTNNShmHeader geom;
+  memset(&geom, 0, sizeof(geom));
+  geom.magic = RTNN_SHM_MAGIC;
+  geom.numSlots = args->window;
+  geom.slotQueries = batch;
+  geom.slotNeighbors = batch * args->knn; // the most a request can get back
+  size_t size = rtnnShmSize(geom);
+
+  std::string name = "/rtnn-client-" + std::to_string(getpid()) + "-" + std::to_string(connId);
+  int shmFd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (shmFd < 0 || ftruncate(shmFd, size) < 0) {
+    perror("shm");
+    exit(1);
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+  close(shmFd);
+  if (base == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  *static_cast<RTNNShmHeader*>(base) = geom;
+  RTNNShmHeader* shm = static_cast<RTNNShmHeader*>(base);
+
+  int fd = connectTo(args->sock);
+  RTNNReqHeader attach = makeRequest(args, name.size());
+  attach.mode = RTNN_REQ_ATTACH;
+  RTNNResHeader ack;
+  bool ok = writeFull(fd, &attach, sizeof(attach)) && writeFull(fd, name.data(), name.size()) &&
+            readFull(fd, &ack, sizeof(ack)) && ack.status == RTNN_OK;
+  // the server has it mapped by now (or failed to); the name isn't needed anymore.
+  shm_unlink(name.c_str());
+  if (!ok) {
+    std::cerr << "connection " << connId << ": can't attach shm\n";
+    exit(1);
+  }
+
+  std::vector<std::chrono::steady_clock::time_point> sent(geom.numSlots);
+  unsigned long long next = (unsigned long long)connId * batch;
+  uint32_t posted = 0, completed = 0;
+
+  while (completed < args->numReqs) {
+    // fill the window
+    while (posted < args->numReqs && posted - completed < geom.numSlots) {
+      uint32_t s = posted % geom.numSlots;
+      float* q = rtnnShmQueries(base, s);
+      for (unsigned int i = 0; i < batch; i++) {
+        unsigned int id = (next + i) % numQueries;
+        std::copy(coords->begin() + id * 3, coords->begin() + id * 3 + 3, q + i * 3);
+      }
+      next += batch;
+      rtnnShmSlot(base, s)->req = makeRequest(args, batch);
+      sent[s] = std::chrono::steady_clock::now();
+      posted++;
+      __atomic_store_n(&shm->posted, posted, __ATOMIC_RELEASE);
+      futexWake(&shm->posted);
+    }
+
+    // wait for the oldest request
+    uint32_t s = completed % geom.numSlots;
+    RTNNShmSlot* slot = rtnnShmSlot(base, s);
+    uint32_t done;
+    while ((done = __atomic_load_n(&slot->done, __ATOMIC_ACQUIRE)) != completed + 1)
+      futexWait(&slot->done, done, 100);
+
+    if (slot->res.status == RTNN_OK) {
+      stats->neighbors += slot->res.numNeighbors;
+      stats->queries += slot->res.numQueries;
+    } else stats->errors++;
+    stats->latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent[s]).count());
+    completed++;
+  }
+
+  close(fd);
+  munmap(base, size);
+}
+
+static void runConnection( const ClientArgs* args, const std::vector<float>* coords, unsigned int connId, ConnStats* stats )
+{
+  if (args->shm) {
+    runShmConnection(args, coords, connId, stats);
+    return;
+  }
+
+  int fd = connectTo(args->sock);
+  unsigned int numQueries = coords->size() / 3;
+  unsigned int batch = std::min(args->batch, numQueries);
+
+  std::vector<float> req(batch * 3);
+  std::vector<char> payload;
+  // stagger connections over the query set
+  unsigned long long next = (unsigned long long)connId * batch;
+
+  for (unsigned int r = 0; r < args->numReqs; r++) {
+    for (unsigned int i = 0; i < batch; i++) {
+      unsigned int q = (next + i) % numQueries;
+      std::copy(coords->begin() + q * 3, coords->begin() + q * 3 + 3, req.begin() + i * 3);
+    }
+    next += batch;
+
+    RTNNReqHeader hdr = makeRequest(args, batch);
+
+    auto start = std::chrono::steady_clock::now();
+    RTNNResHeader res;
+    if (!writeFull(fd, &hdr, sizeof(hdr)) ||
+        !writeFull(fd, req.data(), req.size() * sizeof(float)) ||
+        !readFull(fd, &res, sizeof(res))) {
+      std::cerr << "connection " << connId << " lost\n";
+      break;
+    }
+    if (res.magic != RTNN_RES_MAGIC) {
+      std::cerr << "connection " << connId << ": bad response\n";
+      break;
+    }
+    if (res.status == RTNN_OK) {
+      size_t len = (size_t)(res.numQueries + 1) * sizeof(uint32_t) + res.numNeighbors * sizeof(uint32_t);
+      if (res.flags & RTNN_FLAG_DISTS) len += res.numNeighbors * sizeof(float);
+      payload.resize(len);
+      if (!readFull(fd, payload.data(), len)) {
+        std::cerr << "connection " << connId << " lost\n";
+        break;
+      }
+      stats->neighbors += res.numNeighbors;
+      stats->queries += res.numQueries;
+    } else stats->errors++;
+    auto stop = std::chrono::steady_clock::now();
+
+    stats->latencies.push_back(std::chrono::duration<double, std::milli>(stop - start).count());
+  }
+
+  close(fd);
+}
+
+static double percentile( const std::vector<double>& sorted, double p )
+{
+  if (sorted.empty()) return 0;
+  size_t i = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+int main( int argc, char* argv[] )
+{
+  ClientArgs args;
+  parseArgs(args, argc, argv);
+
+  std::vector<float> coords = readQueries(args.qfile);
+  if (coords.empty()) {
+    fprintf(stdout, "empty queries\n");
+    exit(0);
+  }
+
+  std::vector<ConnStats> stats(args.conns);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int i = 0; i < args.conns; i++)
+    threads.push_back(std::thread(runConnection, &args, &coords, i, &stats[i]));
+  for (auto& t : threads) t.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> latencies;
+  unsigned long long neighbors = 0, queries = 0;
+  unsigned int errors = 0;
+  for (auto& s : stats) {
+    latencies.insert(latencies.end(), s.latencies.begin(), s.latencies.end());
+    neighbors += s.neighbors;
+    queries += s.queries;
+    errors += s.errors;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  fprintf(stdout, "requests: %zu (%u errors), connections: %u, queries/request: %u\n",
+      latencies.size(), errors, args.conns, std::min(args.batch, (unsigned int)(coords.size() / 3)));
+  fprintf(stdout, "latency (ms): p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n",
+      percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99),
+      percentile(latencies, 99.9), latencies.empty() ? 0 : latencies.back());
+  fprintf(stdout, "throughput: %.1f requests/s, %.1f queries/s\n",
+      latencies.size() / elapsed, queries / elapsed);
+  if (queries) fprintf(stdout, "neighbors/query: %.2f\n", (double)neighbors / queries);
+
+  return 0;
+}
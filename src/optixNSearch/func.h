@@ -5,11 +5,14 @@
 #include <thrust/sequence.h>
 #include <thrust/gather.h>
 
+#include <cstdio>
+
 #include <vector_types.h>
 #include <optix_types.h>
 
 #include "state.h"
 #include "grid.h"
+#include "result.h"
 
 void sortByKey( thrust::device_ptr<float>, thrust::device_ptr<unsigned int>, unsigned int, cudaStream_t );
 void sortByKey( thrust::device_ptr<float>, thrust::device_ptr<unsigned int>, unsigned int );
@@ -26,16 +29,26 @@ void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_ptr<float3>,
 void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_vector<float>*, thrust::device_ptr<float>, unsigned int, cudaStream_t );
 void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_vector<float>*, thrust::device_ptr<float>, unsigned int );
 void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_ptr<float>, thrust::device_ptr<float>, unsigned int );
+void gatherByKey ( thrust::device_ptr<unsigned int>, thrust::device_ptr<unsigned int>, thrust::device_ptr<unsigned int>, unsigned int, cudaStream_t );
 void genSeqDevice(thrust::device_ptr<unsigned int>, unsigned int);
 void genSeqDevice(thrust::device_ptr<unsigned int>, unsigned int, cudaStream_t);
 void exclusiveScan(thrust::device_ptr<unsigned int>, unsigned int, thrust::device_ptr<unsigned int>, cudaStream_t);
 void exclusiveScan(thrust::device_ptr<unsigned int>, unsigned int, thrust::device_ptr<unsigned int>);
-void fillByValue(thrust::device_ptr<unsigned int>, unsigned int, int, cudaStream_t);
-void fillByValue(thrust::device_ptr<unsigned int>, unsigned int, int);
+void fillByValue(thrust::device_ptr<unsigned int>, size_t, int, cudaStream_t);
+void fillByValue(thrust::device_ptr<unsigned int>, size_t, int);
+void fillByValue(thrust::device_ptr<float>, size_t, float);
+void fillByValue(thrust::device_ptr<double>, size_t, double);
+double sumByValue(thrust::device_ptr<float>, size_t);
+size_t countEdges(const unsigned int*, unsigned int, unsigned int, const unsigned int*, const unsigned int*);
+void genEdges(const unsigned int*, unsigned int, unsigned int, const unsigned int*, const unsigned int*, const float3*, const float3*, unsigned long long*, float*);
+size_t mergeEdges(thrust::device_ptr<unsigned long long>, thrust::device_ptr<float>, size_t, bool);
+void edgesToCSR(thrust::device_ptr<unsigned long long>, size_t, unsigned int, thrust::device_ptr<unsigned int>, thrust::device_ptr<unsigned int>);
 void copyIfIdMatch(float3*, unsigned int, thrust::device_ptr<int>, thrust::device_ptr<float3>, int);
 void copyIfInRange(float3*, unsigned int, thrust::device_ptr<float3>, thrust::device_ptr<float3>, float3, float3);
 void copyIfNotInRange(float3*, unsigned int, float3*, float3*, float3, float3);
 void copyIfIdInRange(float3*, unsigned int, thrust::device_ptr<int>, thrust::device_ptr<float3>, int, int);
+void copyIfIdInRange(unsigned int*, unsigned int, thrust::device_ptr<int>, thrust::device_ptr<unsigned int>, int, int);
+void copyIfInRange(unsigned int*, unsigned int, thrust::device_ptr<float3>, thrust::device_ptr<unsigned int>, float3, float3);
 void copyIfNonZero(float3*, unsigned int, thrust::device_ptr<bool>, thrust::device_ptr<float3>);
 unsigned int countById(thrust::device_ptr<int>, unsigned int, int);
 unsigned int countIfInRange(thrust::device_ptr<float3>, unsigned int, float3, float3);
@@ -50,7 +63,7 @@ bool operator>=(float3, float3);
 // https://stackoverflow.com/questions/353180/how-do-i-find-the-name-of-the-calling-function/378165
 // https://gcc.gnu.org/onlinedocs/gcc/Other-Builtins.html
 // const char* str = __builtin_FUNCTION()
-template <typename T> T* allocThrustDevicePtr(thrust::device_ptr<T>* d_memory, unsigned int N, std::unordered_set<void*>* pSet=nullptr) {
+template <typename T> T* allocThrustDevicePtr(thrust::device_ptr<T>* d_memory, size_t N, std::unordered_set<void*>* pSet=nullptr) {
   T* d_memory_raw;
   CUDA_CHECK( cudaMalloc(reinterpret_cast<void**>(&d_memory_raw),
              N * sizeof(T) ) );
@@ -62,6 +75,11 @@ template <typename T> T* allocThrustDevicePtr(thrust::device_ptr<T>* d_memory, u
   return d_memory_raw;
 }
 
+// a double-precision coordinate relative to |origin|, as the search sees it.
+inline float3 rebase(const double3& p, const double3& origin) {
+  return make_float3((float)(p.x - origin.x), (float)(p.y - origin.y), (float)(p.z - origin.z));
+}
+
 void kComputeMinMax (unsigned int, unsigned int, float3*, unsigned int, int3*, int3*);
 void kInsertParticles(unsigned int, unsigned int, GridInfo, float3*, unsigned int*, unsigned int*, unsigned int*, bool);
 void kCountingSortIndices(unsigned int, unsigned int, GridInfo, unsigned int*, unsigned int*, unsigned int*, unsigned int*);
@@ -87,12 +105,40 @@ void calcSearchSize(int3,
                     unsigned int,
                     int*
                    );
+void kRegionColumns(unsigned int,
+                    unsigned int,
+                    GridInfo,
+                    float3*,
+                    float3*,
+                    float*,
+                    unsigned int,
+                    unsigned int*
+                   );
+void kRegionQuery(unsigned int,
+                  unsigned int,
+                  GridInfo,
+                  unsigned int*,
+                  unsigned int*,
+                  float3*,
+                  unsigned int*,
+                  float3*,
+                  float3*,
+                  float*,
+                  unsigned int,
+                  unsigned int*,
+                  unsigned int,
+                  unsigned int*,
+                  unsigned int*,
+                  unsigned int*,
+                  unsigned int*
+                 );
 float kGetWidthFromIter(int, float);
 
 void sanityCheck(RTNNState&);
 
 void computeMinMax(unsigned, float3*, float3&, float3&);
 unsigned int genGridInfo(RTNNState&, unsigned int, GridInfo&);
+unsigned int genGridInfo(RTNNState&, unsigned int, GridInfo&, float);
 void gridSort(RTNNState&, unsigned int, float3*, float3*, bool, ParticleType);
 void sortParticles(RTNNState&, ParticleType, int);
 thrust::device_ptr<unsigned int> sortQueriesByFHCoord(RTNNState&, thrust::device_ptr<unsigned int>, int);
@@ -101,11 +147,16 @@ void gatherQueries(RTNNState&, thrust::device_ptr<unsigned int>, int);
 
 void kGenAABB(float3*, float, unsigned int, OptixAabb*, cudaStream_t);
 void uploadData(RTNNState&);
+void detectDim(RTNNState&);
+void uploadPoints(RTNNState&);
+void uploadQueries(RTNNState&);
 void createGeometry(RTNNState&, int, float);
 void launchSubframe(unsigned int*, RTNNState&, int);
 void initLaunchParams(RTNNState&);
 void setupOptiX(RTNNState&);
 void cleanupState(RTNNState&);
+void resetBatches(RTNNState&);
+void rebuildPipeline(RTNNState&);
 float maxInscribedWidth(float, int);
 float minCircumscribedRadius(float, int);
 float radiusEquiVolume(float, int);
@@ -113,10 +164,54 @@ float radiusEquiVolume(float, int);
 int tokenize(std::string, std::string, float3**, unsigned int);
 void parseArgs(RTNNState&, int, char**);
 void readData(RTNNState&);
+bool parseTruncPolicy(const std::string&, TruncPolicy*);
 void initBatches(RTNNState&);
 bool isClose(float3, float3);
 void freeGridPointers(RTNNState&);
 
+void setupSearch(RTNNState&);
 void search(RTNNState&, int);
 void gasSortSearch(RTNNState&, int);
+void searchBatches(RTNNState&);
+unsigned int launchWidth(const RTNNState&, unsigned int);
+void repairBatches(RTNNState&);
+
+bool packResults(RTNNState&, unsigned int*, const ResultReserve&, const float3*, unsigned int, bool);
+void takeRows(RTNNState&, SearchRows&);
+bool packRows(const RTNNState&, const SearchRows&, unsigned int*, const ResultReserve&, const float3*, unsigned int, bool);
+void freeRows(SearchRows&);
+void packResults(RTNNState&, SearchResult&, const float3*, unsigned int, bool);
+ResultReserve reserveIn(SearchResult&);
+void writeResult(FILE*, const SearchResult&, bool);
+void packShells(RTNNState&, ShellResult&);
+void packGraph(RTNNState&, SearchResult&, bool);
+void setupHistogram(RTNNState&);
+void reportHistogram(RTNNState&);
+void setupAggregates(RTNNState&);
+void reportAggregates(RTNNState&);
+void setupSph(RTNNState&);
+void finishSphDensity(RTNNState&);
+void reportSph(RTNNState&);
+void runRegionQueries(RTNNState&);
+void writeShells(FILE*, const ShellResult&);
+void mapIndex(RTNNState&);
+void restoreIndex(RTNNState&);
+void saveIndex(RTNNState&);
+void loadIndex(RTNNState&);
+void sortIndex(RTNNState&);
+bool searchQueries(RTNNState&, float3*, unsigned int, unsigned int, bool, unsigned int*, const ResultReserve&);
+void searchQueries(RTNNState&, float3*, unsigned int, unsigned int, bool, SearchResult&);
+void prepareQueries(const RTNNState&, RTNNState&, float3*, unsigned int, std::vector<float3>&);
+void adoptQueries(RTNNState&, RTNNState&);
+void runServer(RTNNState&);
+void runShardedServer(RTNNState&);
+void setDevice(RTNNState&);
+void runPipeline(RTNNState&);
+void runJobs(RTNNState&);
+float3* read_pc_data(const char*, unsigned int*);
+double3* read_pc_data_double(const char*, unsigned int*);
+void recheckDouble(RTNNState&);
+double3 geoToUnit(double, double);
+float geoChord(const RTNNState&, double);
+float geoDist(const RTNNState&, float);
 thrust::device_ptr<unsigned int> initialTraversal(RTNNState&);
@@ -30,11 +30,25 @@
 
 #include "optixNSearch.h"
 #include "helpers.h"
+#include "metric.h"
 
 extern "C" {
 __constant__ Params params;
 }
 
+// fold the coordinates beyond the first three into |key|, the metric key of
+// the first three (see metric.h), stopping once it reaches |bound| since the
+// pair can't qualify anymore. the tail is read and accumulated a float4 (one
+// 128-bit load) at a time.
+static __forceinline__ __device__ float ndKey(unsigned int primIdx, unsigned int queryIdx, float key, float bound)
+{
+  const float4* p = params.ndPoints + (size_t)params.pointIds[primIdx] * params.ndChunks;
+  const float4* q = params.ndQueries + (size_t)params.queryIds[queryIdx] * params.ndChunks;
+  for (unsigned int c = 0; c < params.ndChunks && key < bound; c++)
+    key = metricKey(key, p[c] - q[c]);
+  return key;
+}
+
 extern "C" __device__ bool check_intersect(SearchType mode)
 {
   unsigned int primIdx = optixGetPrimitiveIndex();
@@ -58,30 +72,250 @@ extern "C" __device__ bool check_intersect(SearchType mode)
     //}
 
   } else {
-    float3 O = ray_orig - center;
-    float sqdist = dot(O, O);
+    float key = metricKey(ray_orig - center);
 
     // first check excludes the query itself; same as (ray_orig != center)
-    if (sqdist < params.radius * params.radius)
+    float bound = metricKey(params.radius);
+    if (params.ndChunks && key < bound)
+      key = ndKey(primIdx, optixGetPayload_0(), key, bound);
+    if (key < bound)
       intersect = true;
   }
 
   return intersect;
 }
 
+// keep the |limit| closest neighbors in the row as a max-heap on the keys
+// in |rowKeys|: the root is the farthest kept neighbor, which a closer one
+// replaces.
+extern "C" __device__ void write_res_closest()
+{
+  unsigned int queryIdx = optixGetPayload_0();
+  unsigned int primIdx = optixGetPrimitiveIndex();
+  unsigned int* row = params.frame_buffer + (size_t)queryIdx * params.limit;
+  float* keys = params.rowKeys + (size_t)queryIdx * params.limit;
+  float key = metricKey(optixGetWorldRayOrigin() - params.points[primIdx]);
+
+  unsigned int size = optixGetPayload_1();
+  unsigned int i;
+  if (size < params.limit) {
+    // sift up from the new leaf
+    i = size;
+    while (i > 0 && keys[(i - 1) / 2] < key) {
+      keys[i] = keys[(i - 1) / 2];
+      row[i] = row[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    optixSetPayload_1(size + 1);
+  } else {
+    if (key >= keys[0]) return;
+    // sift down from the root
+    i = 0;
+    while (true) {
+      unsigned int c = 2 * i + 1;
+      if (c >= size) break;
+      if (c + 1 < size && keys[c + 1] > keys[c]) c++;
+      if (keys[c] <= key) break;
+      keys[i] = keys[c];
+      row[i] = row[c];
+      i = c;
+    }
+  }
+  keys[i] = key;
+  row[i] = primIdx;
+}
+
+// reservoir sampling: the n-th neighbor (from 0) replaces a random slot with
+// probability limit / (n + 1), so the row is a uniform sample of all of
+// them. payload 2 holds the generator state.
+extern "C" __device__ void write_res_random()
+{
+  unsigned int queryIdx = optixGetPayload_0();
+  unsigned int n = optixGetPayload_1();
+  unsigned int slot = n;
+  if (n >= params.limit) {
+    unsigned int rng = xorshift32(optixGetPayload_2());
+    optixSetPayload_2(rng);
+    slot = (unsigned int)(((unsigned long long)rng * (n + 1)) >> 32);
+  }
+  if (slot < params.limit)
+    params.frame_buffer[(size_t)queryIdx * params.limit + slot] = optixGetPrimitiveIndex();
+  optixSetPayload_1(n + 1);
+}
+
 extern "C" __device__ void write_res_radius()
 {
+  // the initial traversal only records the first hit
+  if (params.truncPolicy == TRUNC_CLOSEST && params.mode != NOTEST) {
+    write_res_closest();
+    return;
+  }
+  if (params.truncPolicy == TRUNC_RANDOM && params.mode != NOTEST) {
+    write_res_random();
+    return;
+  }
+
   unsigned int id = optixGetPayload_1();
   if (id < params.limit) {
     unsigned int queryIdx = optixGetPayload_0();
     unsigned int primIdx = optixGetPrimitiveIndex();
-    params.frame_buffer[queryIdx * params.limit + id] = primIdx;
+    params.frame_buffer[(size_t)queryIdx * params.limit + id] = primIdx;
     if (id + 1 == params.limit)
       optixReportIntersection( 0, 0 );
     else optixSetPayload_1( id+1 );
   }
 }
 
+// payloads 2-7 by number, for the programs that keep several running values.
+static __forceinline__ __device__ unsigned int getExtraPayload(unsigned int s)
+{
+  switch (s) {
+    case 0: return optixGetPayload_2();
+    case 1: return optixGetPayload_3();
+    case 2: return optixGetPayload_4();
+    case 3: return optixGetPayload_5();
+    case 4: return optixGetPayload_6();
+    default: return optixGetPayload_7();
+  }
+}
+
+static __forceinline__ __device__ void setExtraPayload(unsigned int s, unsigned int v)
+{
+  switch (s) {
+    case 0: optixSetPayload_2(v); break;
+    case 1: optixSetPayload_3(v); break;
+    case 2: optixSetPayload_4(v); break;
+    case 3: optixSetPayload_5(v); break;
+    case 4: optixSetPayload_6(v); break;
+    default: optixSetPayload_7(v); break;
+  }
+}
+
+// bucket a neighbor (already known to be within the largest radius) into its
+// shell. payload 1 holds the number of stored neighbors across shells; once
+// every shell is full the ray is done.
+extern "C" __device__ void write_res_shell()
+{
+  unsigned int primIdx = optixGetPrimitiveIndex();
+  float key = metricKey(optixGetWorldRayOrigin() - params.points[primIdx]);
+
+  unsigned int s = 0;
+  while (s < params.numShells && key >= params.shellRadii2[s]) s++;
+  if (s == params.numShells) return;
+
+  unsigned int count = getExtraPayload(s);
+  if (params.shellCounts) {
+    setExtraPayload(s, count + 1);
+    return;
+  }
+  if (count >= params.shellLimit[s]) return;
+
+  unsigned int queryIdx = optixGetPayload_0();
+  params.frame_buffer[(size_t)queryIdx * params.limit + params.shellBase[s] + count] = primIdx;
+  setExtraPayload(s, count + 1);
+
+  unsigned int total = optixGetPayload_1() + 1;
+  if (total == params.limit)
+    optixReportIntersection( 0, 0 );
+  else optixSetPayload_1( total );
+}
+
+// add a pair to the ray's histogram, whose pointer is in payloads 2 and 3.
+extern "C" __device__ void write_res_hist()
+{
+  unsigned int primIdx = optixGetPrimitiveIndex();
+  float key = metricKey(optixGetWorldRayOrigin() - params.points[primIdx]);
+  if (key == 0 || key >= metricKey(params.histRadius)) return;
+
+  unsigned int bin = min((unsigned int)(metricDist(key) / params.histRadius * params.histBins), params.histBins - 1);
+  float* hist = reinterpret_cast<float*>( unpackPointer( optixGetPayload_2(), optixGetPayload_3() ) );
+  hist[bin] += params.pointWeights ? params.pointWeights[params.pointIds[primIdx]] : 1.0f;
+}
+
+// fold a neighbor's attributes into the ray's reductions (payloads 2-5, and
+// 6 for the weight sum); payload 1 counts the neighbors.
+extern "C" __device__ void write_res_agg()
+{
+  unsigned int primIdx = optixGetPrimitiveIndex();
+  float w = 1.0f;
+  if (params.aggKernel != AGG_FLAT) {
+    float d = metricDist(metricKey(optixGetWorldRayOrigin() - params.points[primIdx]));
+    float t = d / params.aggRadius;
+    if (params.aggKernel == AGG_GAUSS) w = expf(-d * d / (2 * params.aggSigma * params.aggSigma));
+    else if (params.aggKernel == AGG_TRIANGLE) w = fmaxf(1.0f - t, 0.0f);
+    else w = fmaxf(1.0f - t * t, 0.0f);
+  }
+
+  const float* attrs = params.pointAttrs + (size_t)params.pointIds[primIdx] * params.aggAttrs;
+  for (unsigned int i = 0; i < params.aggAttrs; i++) {
+    float acc = uint_as_float(getExtraPayload(i));
+    if (params.aggOp == AGG_MIN) acc = fminf(acc, attrs[i]);
+    else if (params.aggOp == AGG_MAX) acc = fmaxf(acc, attrs[i]);
+    else acc += w * attrs[i];
+    setExtraPayload(i, float_as_uint(acc));
+  }
+  optixSetPayload_6(float_as_uint(uint_as_float(optixGetPayload_6()) + w));
+  optixSetPayload_1(optixGetPayload_1() + 1);
+}
+
+// the cubic spline kernel (Monaghan) in 3D and its derivative at distance d,
+// for smoothing length h; both vanish from d = 2h on.
+static __forceinline__ __device__ float sphW(float d, float h)
+{
+  float q = d / h;
+  float sigma = 1.0f / (M_PIf * h * h * h);
+  if (q < 1.0f) return sigma * (1.0f - 1.5f * q * q + 0.75f * q * q * q);
+  if (q < 2.0f) return sigma * 0.25f * (2.0f - q) * (2.0f - q) * (2.0f - q);
+  return 0.0f;
+}
+
+static __forceinline__ __device__ float sphDW(float d, float h)
+{
+  float q = d / h;
+  float sigma = 1.0f / (M_PIf * h * h * h * h);
+  if (q < 1.0f) return sigma * (-3.0f * q + 2.25f * q * q);
+  if (q < 2.0f) return sigma * -0.75f * (2.0f - q) * (2.0f - q);
+  return 0.0f;
+}
+
+// add a neighbor's share of the particle's density to payload 2.
+extern "C" __device__ void write_res_sph_density()
+{
+  float d = length(optixGetWorldRayOrigin() - params.points[optixGetPrimitiveIndex()]);
+  float rho = uint_as_float(optixGetPayload_2()) + params.sphMass * sphW(d, params.sphH);
+  optixSetPayload_2(float_as_uint(rho));
+}
+
+// add the acceleration a neighbor causes to payloads 2-4: the symmetric
+// pressure term, with p = stiffness * (rho - rho0), and the viscosity of
+// Morris et al.
+extern "C" __device__ void write_res_sph_force()
+{
+  unsigned int primIdx = optixGetPrimitiveIndex();
+  float3 r = optixGetWorldRayOrigin() - params.points[primIdx];
+  float d = length(r);
+  if (d == 0) return; // the particle itself, which exerts no force
+
+  float h = params.sphH;
+  float dW = sphDW(d, h);
+  unsigned int i = params.queryIds[optixGetPayload_0()];
+  unsigned int j = params.pointIds[primIdx];
+  float rhoI = params.sphDensity[i];
+  float rhoJ = params.sphDensity[j];
+  float pI = params.sphStiffness * (rhoI - params.sphRestDensity);
+  float pJ = params.sphStiffness * (rhoJ - params.sphRestDensity);
+
+  float3 a = r * (-params.sphMass * (pI / (rhoI * rhoI) + pJ / (rhoJ * rhoJ)) * dW / d);
+  if (params.sphVel) {
+    float3 v = params.sphVel[i] - params.sphVel[j];
+    a += v * (params.sphMass * 2.0f * params.sphViscosity / (rhoI * rhoJ) * d * dW / (d * d + 0.01f * h * h));
+  }
+
+  optixSetPayload_2(float_as_uint(uint_as_float(optixGetPayload_2()) + a.x));
+  optixSetPayload_3(float_as_uint(uint_as_float(optixGetPayload_3()) + a.y));
+  optixSetPayload_4(float_as_uint(uint_as_float(optixGetPayload_4()) + a.z));
+}
+
 extern "C" __global__ void __intersection__sphere_radius()
 {
   // The IS program will be called if the ray origin is within a primitive's
@@ -89,7 +323,28 @@ extern "C" __global__ void __intersection__sphere_radius()
 
   SearchType mode = params.mode;
 
-  if (mode == NOTEST) {
+  if (params.histBins && mode != NOTEST) {
+    if (check_intersect(mode)) write_res_hist();
+    return;
+  }
+
+  if (params.aggAttrs && mode != NOTEST) {
+    if (check_intersect(mode)) write_res_agg();
+    return;
+  }
+
+  if (params.sphPass && mode != NOTEST) {
+    if (check_intersect(mode)) {
+      if (params.sphPass == SPH_DENSITY) write_res_sph_density();
+      else write_res_sph_force();
+    }
+    return;
+  }
+
+  // the initial traversal (NOTEST) only records the first hit, shells or not.
+  if (params.numShells && mode != NOTEST) {
+    if (check_intersect(mode)) write_res_shell();
+  } else if (mode == NOTEST) {
     write_res_radius();
   } else {
     // This is called when a ray-bbox intersection is found, but we still can't
@@ -105,6 +360,77 @@ extern "C" __global__ void __intersection__sphere_radius()
   }
 }
 
+#if K == 1
+// 1-NN: payload 1 holds the best key so far (initially the radius's) and
+// payload 2 its point (0xffffffff, an empty slot, until there is one), so a
+// candidate costs a compare against a register instead of a scan of the
+// queue. the bound shrinks to the best key as closer points turn up, which
+// also cuts the N-D tail short sooner.
+extern "C" __global__ void __intersection__sphere_knn()
+{
+  unsigned int queryIdx = optixGetPayload_0();
+  unsigned int primIdx = optixGetPrimitiveIndex();
+
+  if (params.mode == NOTEST) { // this implies that this is an initial traversal
+    params.frame_buffer[(size_t)queryIdx * params.limit] = primIdx;
+    optixReportIntersection( 0, 0 );
+    return;
+  }
+
+  float key = metricKey(optixGetWorldRayOrigin() - params.points[primIdx]);
+  float bound = uint_as_float(optixGetPayload_1());
+  if (optixGetPayload_2() != 0xffffffff) bound /= params.knnEpsScale;
+  if (key >= bound) return;
+  if (params.ndChunks) {
+    key = ndKey(primIdx, queryIdx, key, bound);
+    if (key >= bound) return;
+  }
+
+  // excludes the query itself
+  if (key > 0) {
+    optixSetPayload_1( float_as_uint(key) );
+    optixSetPayload_2( primIdx );
+  }
+}
+#elif K > LARGE_K
+// large-K KNN: payload 1 is the number of candidates in the ray's scratch row
+// and payload 2 the key bound (initially the radius's), which tightens to the
+// Kth nearest (by 1+eps) each time the row is cut back to K.
+extern "C" __global__ void __intersection__sphere_knn()
+{
+  unsigned int queryIdx = optixGetPayload_0();
+  unsigned int primIdx = optixGetPrimitiveIndex();
+
+  if (params.mode == NOTEST) { // this implies that this is an initial traversal
+    params.frame_buffer[(size_t)queryIdx * params.limit] = primIdx;
+    optixReportIntersection( 0, 0 );
+    return;
+  }
+
+  float key = metricKey(optixGetWorldRayOrigin() - params.points[primIdx]);
+  float bound = uint_as_float(optixGetPayload_2());
+  if (key >= bound) return;
+  if (params.ndChunks) {
+    key = ndKey(primIdx, queryIdx, key, bound);
+    if (key >= bound) return;
+  }
+  // excludes the query itself
+  if (key <= 0) return;
+
+  // the row of the launch thread; see |knnIds|
+  float* keys = params.rowKeys + (size_t)optixGetLaunchIndex().x * KNN_SCRATCH;
+  unsigned int* ids = params.knnIds + (size_t)optixGetLaunchIndex().x * KNN_SCRATCH;
+  unsigned int count = optixGetPayload_1();
+  keys[count] = key;
+  ids[count] = primIdx;
+  count++;
+  if (count == KNN_SCRATCH) {
+    optixSetPayload_2( float_as_uint(selectK(keys, ids, count, K) / params.knnEpsScale) );
+    count = K;
+  }
+  optixSetPayload_1( count );
+}
+#else
 extern "C" __device__ void insertTopKQ(float key, unsigned int val)
 {
   const unsigned int u0 = optixGetPayload_1();
@@ -129,7 +455,7 @@ extern "C" __device__ void insertTopKQ(float key, unsigned int val)
     }
     optixSetPayload_7( _size + 1 ); // _size++;
   }
-  else if (key < max_key) {
+  else if (key * params.knnEpsScale < max_key) {
     keys[max_idx] = key;
     vals[max_idx] = val;
   
@@ -165,30 +491,40 @@ extern "C" __global__ void __intersection__sphere_knn()
   unsigned int primIdx = optixGetPrimitiveIndex();
 
   if (mode == NOTEST) { // this implies that this is an initial traversal
-    params.frame_buffer[queryIdx * params.limit] = primIdx;
+    params.frame_buffer[(size_t)queryIdx * params.limit] = primIdx;
     optixReportIntersection( 0, 0 );
   } else {
     const float3 center = params.points[primIdx];
     const float3 ray_orig = optixGetWorldRayOrigin();
-    float3 O = ray_orig - center;
-    float sqdist = dot(O, O);
+    float key = metricKey(ray_orig - center);
 
     //if (queryIdx == 163455) {
     //  printf("ray: %f, %f, %f\n", ray_orig.x, ray_orig.y, ray_orig.z);
     //  printf("point: %f, %f, %f\n", center.x, center.y, center.z);
-    //  printf("primIdx: %u, sqdist: %f\n\n", primIdx, sqrt(sqdist));
+    //  printf("primIdx: %u, key: %f\n\n", primIdx, key);
     //}
 
+    // in N-D the rest of the distance is only worth adding while the pair
+    // could still make it into the queue, i.e., beat the current Kth
+    // distance (by 1+eps) once the queue is full.
+    if (params.ndChunks) {
+      float bound = metricKey(params.radius);
+      if (optixGetPayload_7() == K) bound = fminf(bound, uint_as_float(optixGetPayload_5()) / params.knnEpsScale);
+      if (key >= bound) return;
+      key = ndKey(primIdx, queryIdx, key, bound);
+    }
+
     // the first check excludes the query itself.
     // even for optimized search the second check is necessary since a point
     // being in the optimized AABB doesn't mean it's in target sphere. this
     // checking against the optimized sphere is to make sure a point is also in
     // the target sphere.
-    if ((sqdist > 0) && (sqdist < params.radius * params.radius)) {
-      insertTopKQ(sqdist, primIdx);
+    if ((key > 0) && (key < metricKey(params.radius))) {
+      insertTopKQ(key, primIdx);
     }
   }
 }
+#endif
 
 extern "C" __global__ void __anyhit__terminateRay()
 {
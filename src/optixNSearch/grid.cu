@@ -6,6 +6,7 @@
 #include "helper_mortonCode.h"
 #include "helper_linearIndex.h"
 #include "grid.h"
+#include "metric.h"
 
 #include <stdio.h>
 
@@ -27,6 +28,8 @@ inline __host__ __device__ uint ToCellIndex_MortonMetaGrid(const GridInfo &GridI
   //if (temp.x == 283 && temp.y == 10 && temp.z == 418)
   //  printf("(%d, %d, %d), (%d, %d, %d), %u, %u, %u\n", metaGridCell.x, metaGridCell.y, metaGridCell.z, gridCell.x, gridCell.y, gridCell.z, metaGridIndex, metaGridIndex * GridInfo.meta_grid_size, MortonCode3(gridCell.x, gridCell.y, gridCell.z));
 
+  if (GridInfo.dim == 2)
+    return metaGridIndex * GridInfo.meta_grid_size + MortonCode2(gridCell.x, gridCell.y);
   return metaGridIndex * GridInfo.meta_grid_size + MortonCode3(gridCell.x, gridCell.y, gridCell.z);
 }
 
@@ -149,18 +152,23 @@ void calcSearchSize(int3 gridCell,
     }
  
     int ix, iy, iz;
+    // in 2D there is only one layer of cells (zmin == zmax == z == 0), so a
+    // ring has no z faces and only 4 corners.
+    bool is3D = (gridInfo.dim != 2);
  
-    iz = zmin - 1;
-    for (ix = xmin; ix <= xmax; ix++) {
-      for (iy = ymin; iy <= ymax; iy++) {
-        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+    if (is3D) {
+      iz = zmin - 1;
+      for (ix = xmin; ix <= xmax; ix++) {
+        for (iy = ymin; iy <= ymax; iy++) {
+          addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+        }
       }
-    }
  
-    iz = zmax + 1;
-    for (ix = xmin; ix <= xmax; ix++) {
-      for (iy = ymin; iy <= ymax; iy++) {
-        addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+      iz = zmax + 1;
+      for (ix = xmin; ix <= xmax; ix++) {
+        for (iy = ymin; iy <= ymax; iy++) {
+          addCount(count, CellParticleCounts, gridInfo, ix, iy, iz, morton);
+        }
       }
     }
 
@@ -196,6 +204,15 @@ void calcSearchSize(int3 gridCell,
     xmax++;
     ymin--;
     ymax++;
+
+    if (!is3D) {
+      addCount(count, CellParticleCounts, gridInfo, xmin, ymin, z, morton);
+      addCount(count, CellParticleCounts, gridInfo, xmin, ymax, z, morton);
+      addCount(count, CellParticleCounts, gridInfo, xmax, ymin, z, morton);
+      addCount(count, CellParticleCounts, gridInfo, xmax, ymax, z, morton);
+      continue;
+    }
+
     zmin--;
     zmax++;
  
@@ -383,6 +400,242 @@ __global__ void kGenCellMask(GridInfo gridInfo,
 
 
 
+// the cells of axis |a| a box [g0, g1] (in grid coordinates, i.e., (p -
+// GridMin) * GridDelta) touches are [lo, hi], of which [full0, full1] lie
+// entirely inside it. a point in cell c has a grid coordinate g with c <= g <
+// c+1 computed the same way, and the rounding is monotonic, so g0 < c and g1
+// >= c+1 guarantee that the point is in the box along this axis without
+// looking at it. returns false if the box misses the grid on this axis.
+__device__ bool boxCellRange(float g0, float g1, unsigned int dim, int& lo, int& hi, int& full0, int& full1) {
+  if (g1 < 0 || g0 >= (float)dim) return false;
+  lo = (int)floorf(fmaxf(g0, 0.0f));
+  hi = min((int)floorf(fminf(g1, (float)dim)), (int)dim - 1);
+  full0 = (g0 < (float)lo) ? lo : lo + 1;
+  full1 = (g1 >= (float)(hi + 1)) ? hi : hi - 1;
+  return true;
+}
+
+// the regions of |columnQuery|. |contains| tests a point, and |fullRun| gives
+// the cells [f0, f1] of the touched cells [z0, z1] of column (x, y) that lie
+// entirely inside the region, or returns false if there are none. the
+// regions are convex, so these cells are consecutive. [full0, full1] are the
+// cells entirely inside the bounding box.
+struct BoxRegion
+{
+  float3 bmin, bmax;
+
+  __device__ bool contains(float3 p) const {
+    return p.x >= bmin.x && p.x <= bmax.x && p.y >= bmin.y && p.y <= bmax.y && p.z >= bmin.z && p.z <= bmax.z;
+  }
+  __device__ bool fullRun(const GridInfo& gridInfo, int x, int y, int z0, int z1,
+                          const int3& full0, const int3& full1, int& f0, int& f1) const {
+    f0 = full0.z;
+    f1 = full1.z;
+    return x >= full0.x && x <= full1.x && y >= full0.y && y <= full1.y && f0 <= f1;
+  }
+};
+
+// the points within (Euclidean) distance sqrt(r2) of the segment [a, b].
+struct CapsuleRegion
+{
+  float3 a, b;
+  float r2;
+
+  __device__ bool contains(float3 p) const {
+    return segmentDist2(p, a, b) <= r2;
+  }
+  // a cell is inside if its corners are. the cells are widened a little so
+  // that points rounded into a cell from just outside it are covered too.
+  __device__ bool cellInside(const GridInfo& gridInfo, int x, int y, int z) const {
+    float3 cellSize = make_float3(1.0f / gridInfo.GridDelta.x, 1.0f / gridInfo.GridDelta.y, 0.0f);
+    if (gridInfo.dim == 3) cellSize.z = 1.0f / gridInfo.GridDelta.z;
+    float3 slack = cellSize * 1e-3f;
+    float3 lo = gridInfo.GridMin + make_float3(x, y, z) * cellSize - slack;
+    float3 hi = lo + cellSize + 2.0f * slack;
+    for (int c = 0; c < 8; c++) {
+      float3 corner = make_float3((c & 1) ? hi.x : lo.x, (c & 2) ? hi.y : lo.y, (c & 4) ? hi.z : lo.z);
+      if (!contains(corner)) return false;
+    }
+    return true;
+  }
+  __device__ bool fullRun(const GridInfo& gridInfo, int x, int y, int z0, int z1,
+                          const int3& full0, const int3& full1, int& f0, int& f1) const {
+    f0 = z0;
+    while (f0 <= z1 && !cellInside(gridInfo, x, y, f0)) f0++;
+    if (f0 > z1) return false;
+    f1 = f0;
+    while (f1 < z1 && cellInside(gridInfo, x, y, f1 + 1)) f1++;
+    return true;
+  }
+};
+
+// the points of sorted positions [begin, end) inside |region|, tested one by
+// one.
+template <typename Region>
+__device__ unsigned int regionTestRun(const Region& region, const float3* points, const unsigned int* ids,
+                                      unsigned int begin, unsigned int end, unsigned int* out) {
+  unsigned int count = 0;
+  for (unsigned int i = begin; i < end; i++) {
+    if (!region.contains(points[i])) continue;
+    if (out) out[count] = ids[i];
+    count++;
+  }
+  return count;
+}
+
+// the cells of a raster-ordered grid that the bounding box of a region
+// touches: the (x, y) columns [x0, x1] x [y0, y1], and the cells [z0, z1] of
+// each, of which [full0, full1] lie entirely inside the bounding box.
+struct RegionCells
+{
+  int x0, x1, y0, y1, z0, z1;
+  int3 full0, full1;
+
+  __device__ unsigned int numColumns() const { return (x1 - x0 + 1) * (y1 - y0 + 1); }
+};
+
+// the cells of the bounding box [bmin, bmax]; false if it misses the grid.
+__device__ bool regionCells(const GridInfo& gridInfo, float3 bmin, float3 bmax, RegionCells& c) {
+  float3 g0 = (bmin - gridInfo.GridMin) * gridInfo.GridDelta;
+  float3 g1 = (bmax - gridInfo.GridMin) * gridInfo.GridDelta;
+  c.z0 = c.z1 = 0;
+  c.full0 = make_int3(0, 0, 0);
+  c.full1 = make_int3(0, 0, 0);
+  if (!boxCellRange(g0.x, g1.x, gridInfo.GridDimension.x, c.x0, c.x1, c.full0.x, c.full1.x)) return false;
+  if (!boxCellRange(g0.y, g1.y, gridInfo.GridDimension.y, c.y0, c.y1, c.full0.y, c.full1.y)) return false;
+  if (gridInfo.dim == 2) {
+    // planar data all lie in the single layer of cells at GridMin.z.
+    return bmin.z <= gridInfo.GridMin.z && bmax.z >= gridInfo.GridMin.z;
+  }
+  return boxCellRange(g0.z, g1.z, gridInfo.GridDimension.z, c.z0, c.z1, c.full0.z, c.full1.z);
+}
+
+// the box [regionA[i], regionB[i]], or with |radii| the capsule of radius
+// radii[i] around the segment [regionA[i], regionB[i]], and its bounding box.
+__device__ void regionBounds(const float3* regionA, const float3* regionB, const float* radii, unsigned int i,
+                             float3& bmin, float3& bmax) {
+  if (radii) {
+    float r = radii[i];
+    bmin = fminf(regionA[i], regionB[i]) - make_float3(r);
+    bmax = fmaxf(regionA[i], regionB[i]) + make_float3(r);
+  } else {
+    bmin = regionA[i];
+    bmax = regionB[i];
+  }
+}
+
+// the points inside |region| of column (x, y) of |cells|: the cells of a
+// column are consecutive in a raster-ordered grid, so this is one run of
+// sorted points, visited once, whose middle (the cells entirely inside the
+// region) is taken in bulk and whose ends are tested point by point. with
+// |out| the ids are written there too. returns the number of points.
+template <typename Region>
+__device__ unsigned int columnQuery(const GridInfo& gridInfo,
+                                    const unsigned int* cellOffsets,
+                                    const unsigned int* cellCounts,
+                                    const float3* points,
+                                    const unsigned int* ids,
+                                    const Region& region,
+                                    const RegionCells& cells,
+                                    int x,
+                                    int y,
+                                    unsigned int* out
+                                   ) {
+  unsigned int col = (x * gridInfo.GridDimension.y + y) * gridInfo.GridDimension.z;
+  unsigned int begin = cellOffsets[col + cells.z0];
+  unsigned int end = cellOffsets[col + cells.z1] + cellCounts[col + cells.z1];
+  // the bulk part of the run, if any
+  unsigned int bulkBegin = end, bulkEnd = end;
+  int f0, f1;
+  if (region.fullRun(gridInfo, x, y, cells.z0, cells.z1, cells.full0, cells.full1, f0, f1)) {
+    bulkBegin = cellOffsets[col + f0];
+    bulkEnd = cellOffsets[col + f1] + cellCounts[col + f1];
+  }
+  unsigned int count = regionTestRun(region, points, ids, begin, bulkBegin, out);
+  if (out) for (unsigned int i = bulkBegin; i < bulkEnd; i++) out[count++] = ids[i];
+  else count += bulkEnd - bulkBegin;
+  count += regionTestRun(region, points, ids, bulkEnd, end, out ? out + count : nullptr);
+  return count;
+}
+
+// one region per thread: the number of grid columns its bounding box touches,
+// each of which is a (region, column) pair of |kRegionQuery|.
+__global__ void kRegionColumns(const GridInfo gridInfo,
+                               const float3* regionA,
+                               const float3* regionB,
+                               const float* radii,
+                               unsigned int numRegions,
+                               unsigned int* numColumns
+                              )
+{
+  unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= numRegions) return;
+
+  float3 bmin, bmax;
+  regionBounds(regionA, regionB, radii, i, bmin, bmax);
+  RegionCells cells;
+  numColumns[i] = regionCells(gridInfo, bmin, bmax, cells) ? cells.numColumns() : 0;
+}
+
+// one (region, column) pair per thread, so that a large region is spread over
+// many threads. pairs are numbered by region and then by column in (x, y)
+// order; colOffsets[i] is the first pair of region i (see |kRegionColumns|).
+// without |out| this counts the points of each pair into |pairCounts| and
+// adds them up per region into |rowCounts|; with it, the points of pair p go
+// to out[pairOffsets[p], ...), which keeps each region's points in column
+// order.
+__global__ void kRegionQuery(const GridInfo gridInfo,
+                             const unsigned int* cellOffsets,
+                             const unsigned int* cellCounts,
+                             const float3* points,
+                             const unsigned int* ids,
+                             const float3* regionA,
+                             const float3* regionB,
+                             const float* radii,
+                             unsigned int numRegions,
+                             const unsigned int* colOffsets,
+                             unsigned int numPairs,
+                             unsigned int* pairCounts,
+                             unsigned int* rowCounts,
+                             const unsigned int* pairOffsets,
+                             unsigned int* out
+                            )
+{
+  unsigned int p = blockIdx.x * blockDim.x + threadIdx.x;
+  if (p >= numPairs) return;
+
+  // the region of the pair: the last one whose first pair is at most p.
+  // regions without columns share their offset with the next one.
+  unsigned int lo = 0, hi = numRegions;
+  while (hi - lo > 1) {
+    unsigned int mid = (lo + hi) / 2;
+    if (colOffsets[mid] <= p) lo = mid;
+    else hi = mid;
+  }
+  unsigned int i = lo;
+
+  float3 bmin, bmax;
+  regionBounds(regionA, regionB, radii, i, bmin, bmax);
+  RegionCells cells;
+  regionCells(gridInfo, bmin, bmax, cells);
+  unsigned int c = p - colOffsets[i];
+  int x = cells.x0 + c / (cells.y1 - cells.y0 + 1);
+  int y = cells.y0 + c % (cells.y1 - cells.y0 + 1);
+
+  unsigned int* row = out ? out + pairOffsets[p] : nullptr;
+  unsigned int count;
+  if (radii) {
+    CapsuleRegion capsule = {regionA[i], regionB[i], radii[i] * radii[i]};
+    count = columnQuery(gridInfo, cellOffsets, cellCounts, points, ids, capsule, cells, x, y, row);
+  } else {
+    BoxRegion box = {regionA[i], regionB[i]};
+    count = columnQuery(gridInfo, cellOffsets, cellCounts, points, ids, box, cells, x, y, row);
+  }
+  if (!out) {
+    pairCounts[p] = count;
+    if (count) atomicAdd(&rowCounts[i], count);
+  }
+}
 
 
 
@@ -478,6 +731,62 @@ void kCalcSearchSize(unsigned int numOfBlocks,
             );
 }
 
+void kRegionColumns(unsigned int numOfBlocks,
+                    unsigned int threadsPerBlock,
+                    GridInfo gridInfo,
+                    float3* regionA,
+                    float3* regionB,
+                    float* radii,
+                    unsigned int numRegions,
+                    unsigned int* numColumns
+                   ) {
+  kRegionColumns <<<numOfBlocks, threadsPerBlock>>> (
+                  gridInfo,
+                  regionA,
+                  regionB,
+                  radii,
+                  numRegions,
+                  numColumns
+                 );
+}
+
+void kRegionQuery(unsigned int numOfBlocks,
+                  unsigned int threadsPerBlock,
+                  GridInfo gridInfo,
+                  unsigned int* cellOffsets,
+                  unsigned int* cellCounts,
+                  float3* points,
+                  unsigned int* ids,
+                  float3* regionA,
+                  float3* regionB,
+                  float* radii,
+                  unsigned int numRegions,
+                  unsigned int* colOffsets,
+                  unsigned int numPairs,
+                  unsigned int* pairCounts,
+                  unsigned int* rowCounts,
+                  unsigned int* pairOffsets,
+                  unsigned int* out
+                 ) {
+  kRegionQuery <<<numOfBlocks, threadsPerBlock>>> (
+                gridInfo,
+                cellOffsets,
+                cellCounts,
+                points,
+                ids,
+                regionA,
+                regionB,
+                radii,
+                numRegions,
+                colOffsets,
+                numPairs,
+                pairCounts,
+                rowCounts,
+                pairOffsets,
+                out
+               );
+}
+
 float kGetWidthFromIter(int iter, float cellSize) {
   return getWidthFromIter(iter, cellSize);
 }
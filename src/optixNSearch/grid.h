@@ -9,4 +9,5 @@ struct GridInfo
   uint3 MetaGridDimension;
   unsigned int meta_grid_dim;
   unsigned int meta_grid_size;
+  unsigned int dim; // 2 for planar data: a single layer of cells, 2D Morton codes
 };
@@ -30,6 +30,11 @@ __host__ __device__ inline uint Part1By2(uint x)
 	return x;
 }
 
+__host__ __device__ inline uint MortonCode2(uint x, uint y)
+{
+	return (Part1By1(y) << 1) + Part1By1(x);
+}
+
 __host__ __device__ inline uint MortonCode3(uint x, uint y, uint z)
 {
   //if (x == 11 && y == 10 && z == 2)
@@ -138,3 +138,96 @@ __forceinline__ __device__ float3 exp( const float3& x )
     reinterpret_cast<unsigned int&>((u).y), \
     reinterpret_cast<unsigned int&>((u).z)
 
+// a seed per (query, run): TEA with a few rounds mixes well enough to start
+// independent streams from consecutive indices.
+__forceinline__ __device__ unsigned int tea4( unsigned int v0, unsigned int v1 )
+{
+  unsigned int s0 = 0;
+  for (unsigned int n = 0; n < 4; n++) {
+    s0 += 0x9e3779b9;
+    v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+    v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+  }
+  return v0;
+}
+
+// the next state of a 32-bit xorshift generator; never 0 if |x| isn't.
+__forceinline__ __device__ unsigned int xorshift32( unsigned int x )
+{
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+__forceinline__ __device__ void swapEntry( float* keys, unsigned int* vals, unsigned int i, unsigned int j )
+{
+  float k = keys[i]; keys[i] = keys[j]; keys[j] = k;
+  unsigned int v = vals[i]; vals[i] = vals[j]; vals[j] = v;
+}
+
+// leave the |k| smallest of the |n| keys (and their values) in the first |k|
+// slots, by making them a max-heap and letting each smaller key replace its
+// root. O(n log k); the fallback of |selectK|.
+__forceinline__ __device__ void heapSelect( float* keys, unsigned int* vals, unsigned int n, unsigned int k )
+{
+  for (unsigned int j = 0; j < n; j++) {
+    unsigned int i;
+    if (j < k) {
+      // sift up the new leaf
+      i = j;
+      while (i > 0 && keys[(i - 1) / 2] < keys[i]) {
+        swapEntry(keys, vals, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+      }
+      continue;
+    }
+    if (keys[j] >= keys[0]) continue;
+    // sift down the new root
+    swapEntry(keys, vals, 0, j);
+    i = 0;
+    while (true) {
+      unsigned int c = 2 * i + 1;
+      if (c >= k) break;
+      if (c + 1 < k && keys[c + 1] > keys[c]) c++;
+      if (keys[c] <= keys[i]) break;
+      swapEntry(keys, vals, i, c);
+      i = c;
+    }
+  }
+}
+
+// introselect: leave the |k| (<= n) smallest of the |n| keys (and their
+// values) in the first |k| slots, unordered, and return the largest of them.
+// quickselect with median-of-three pivots, falling back to |heapSelect| if
+// the partitions keep coming out lopsided, e.g., with many equal keys.
+__forceinline__ __device__ float selectK( float* keys, unsigned int* vals, unsigned int n, unsigned int k )
+{
+  unsigned int lo = 0, hi = n - 1, target = k - 1;
+  int budget = 2 * (32 - __clz(n));
+  while (lo < hi) {
+    if (budget-- == 0) {
+      heapSelect(keys + lo, vals + lo, hi - lo + 1, target - lo + 1);
+      break;
+    }
+    // move the median of keys[lo], keys[mid] and keys[hi] to hi
+    unsigned int mid = lo + (hi - lo) / 2;
+    if (keys[mid] < keys[lo]) swapEntry(keys, vals, lo, mid);
+    if (keys[hi] < keys[lo]) swapEntry(keys, vals, lo, hi);
+    if (keys[mid] < keys[hi]) swapEntry(keys, vals, mid, hi);
+
+    float pivot = keys[hi];
+    unsigned int store = lo;
+    for (unsigned int i = lo; i < hi; i++)
+      if (keys[i] < pivot) swapEntry(keys, vals, i, store++);
+    swapEntry(keys, vals, store, hi);
+
+    if (store == target) break;
+    if (store < target) lo = store + 1;
+    else hi = store - 1;
+  }
+
+  float kth = keys[0];
+  for (unsigned int i = 1; i < k; i++) kth = fmaxf(kth, keys[i]);
+  return kth;
+}
@@ -0,0 +1,109 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <thrust/device_vector.h>
+#include <thrust/copy.h>
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <numeric>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "metric.h"
+
+// Pair-distance histograms (-hb): the radius search bins the distance of every
+// (query, point) pair within the radius instead of storing neighbors; see
+// Params. The result is the weighted pair count per bin and the radial
+// distribution function g(r) estimated from it.
+
+static std::vector<float> readWeights( const std::string& file, unsigned int n ) {
+  std::ifstream in(file);
+  if (!in.good()) {
+    std::cerr << "Could not read " << file << "\n";
+    exit(1);
+  }
+  std::vector<float> weights;
+  float w;
+  while (in >> w) weights.push_back(w);
+  if (weights.size() != n) {
+    std::cerr << file << " has " << weights.size() << " weights for " << n << " particles\n";
+    exit(1);
+  }
+  return weights;
+}
+
+static float* uploadWeights( RTNNState& state, const std::vector<float>& weights ) {
+  thrust::device_ptr<float> d_weights_ptr;
+  float* d_weights = allocThrustDevicePtr(&d_weights_ptr, weights.size(), &state.d_pointers);
+  thrust::copy(weights.begin(), weights.end(), d_weights_ptr);
+  return d_weights;
+}
+
+// call after the points and queries are uploaded.
+void setupHistogram( RTNNState& state ) {
+  Timing::startTiming("setup histogram");
+    thrust::device_ptr<double> d_hist_ptr;
+    state.params.hist = allocThrustDevicePtr(&d_hist_ptr, state.params.histBins, &state.d_pointers);
+    fillByValue(d_hist_ptr, state.params.histBins, 0.0);
+
+    state.params.pointWeights = nullptr;
+    state.params.queryWeights = nullptr;
+    state.params.pointIds = state.d_pointIds;
+
+    if (!state.histWeightFile.empty()) {
+      state.h_pointWeights = readWeights(state.histWeightFile, state.numPoints);
+      state.params.pointWeights = uploadWeights(state, state.h_pointWeights);
+    }
+    if (!state.histQWeightFile.empty()) {
+      state.h_queryWeights = readWeights(state.histQWeightFile, state.numOrigQueries);
+      state.params.queryWeights = uploadWeights(state, state.h_queryWeights);
+    } else if (state.sameData && state.params.pointWeights) {
+      // auto-correlation: the queries are the points
+      state.h_queryWeights = state.h_pointWeights;
+      state.params.queryWeights = state.params.pointWeights;
+    }
+  Timing::stopTiming(true);
+}
+
+// print the histogram and g(r), and write them to the output file if any.
+// g(r) compares each bin with what uniformly distributed points (at the
+// average density over the points' bounding box) would give.
+void reportHistogram( RTNNState& state ) {
+  unsigned int numBins = state.params.histBins;
+  std::vector<double> hist(numBins);
+  thrust::copy(thrust::device_pointer_cast(state.params.hist),
+      thrust::device_pointer_cast(state.params.hist) + numBins, hist.begin());
+
+  double sumPW = state.h_pointWeights.empty() ? state.numPoints :
+      std::accumulate(state.h_pointWeights.begin(), state.h_pointWeights.end(), 0.0);
+  double sumQW = state.h_queryWeights.empty() ? state.numOrigQueries :
+      std::accumulate(state.h_queryWeights.begin(), state.h_queryWeights.end(), 0.0);
+  float3 extent = state.pMax - state.pMin;
+  double volume = (double)extent.x * extent.y * extent.z;
+  double density = volume > 0 ? sumPW / volume : 0;
+
+  FILE* fp = nullptr;
+  if (!state.outfile.empty()) {
+    fp = fopen(state.outfile.c_str(), "w");
+    if (fp == nullptr) {
+      perror(state.outfile.c_str());
+      exit(1);
+    }
+  }
+
+  double width = state.params.histRadius / numBins;
+  for (unsigned int b = 0; b < numBins; b++) {
+    double lo = b * width, hi = (b + 1) * width;
+    double shellVolume = metricBallVolume(hi) - metricBallVolume(lo);
+    double expected = sumQW * density * shellVolume;
+    double g = expected > 0 ? hist[b] / expected : 0;
+    fprintf(stdout, "\tBin [%f, %f): %.6g pairs, g(r) %.6f\n", lo, hi, hist[b], g);
+    if (fp) fprintf(fp, "%f,%f,%.17g,%f\n", lo, hi, hist[b], g);
+  }
+
+  if (fp) fclose(fp);
+}
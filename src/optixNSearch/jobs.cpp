@@ -0,0 +1,225 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "result.h"
+
+// Job mode (-j): run many search configurations back to back against points
+// that are loaded and sorted once. Every line of the job file is one job,
+// given as whitespace-separated key=value pairs; keys that are left out take
+// the value given on the command line:
+//
+//   q   query file (default: the point file)
+//   sm  search mode, radius or knn
+//   r   radius
+//   k   K (in knn mode at most the compiled-in KNN)
+//   ps  point sort mode; the resident points are re-sorted only if it changes
+//   qs  query sort mode
+//   p   query partitioning, 0 or 1
+//   a   approximation mode
+//   tp  truncation policy of a radius search: first, closest or random
+//   nb  number of batches
+//   o   output file, written like -o in pipelined mode (default: none)
+//   od  1 to write distances
+//
+// Empty lines and lines starting with # are skipped. Query files are parsed
+// once and kept for later jobs; the OptiX pipeline is rebuilt only when the
+// search mode changes.
+
+struct Job
+{
+  std::string qfile;
+  std::string searchMode;
+  float       radius;
+  unsigned int knn;
+  int         pointSortMode;
+  int         querySortMode;
+  bool        partition;
+  int         approxMode;
+  TruncPolicy truncPolicy;
+  int         numOfBatches;
+  std::string outfile;
+  bool        outDists;
+};
+
+struct JobStats
+{
+  unsigned int       numQueries;
+  unsigned long long numNeighbors;
+  double             time; // s
+};
+
+static bool parseJob( const std::string& line, Job& job ) {
+  std::istringstream ss(line);
+  std::string tok;
+  while (ss >> tok) {
+    size_t eq = tok.find('=');
+    if (eq == std::string::npos) return false;
+    std::string key = tok.substr(0, eq), val = tok.substr(eq + 1);
+
+    if (key == "q") job.qfile = val;
+    else if (key == "sm") job.searchMode = val;
+    else if (key == "r") job.radius = std::stof(val);
+    else if (key == "k") job.knn = std::stoi(val);
+    else if (key == "ps") job.pointSortMode = std::stoi(val);
+    else if (key == "qs") job.querySortMode = std::stoi(val);
+    else if (key == "p") job.partition = (bool)std::stoi(val);
+    else if (key == "a") job.approxMode = std::stoi(val);
+    else if (key == "tp") { if (!parseTruncPolicy(val, &job.truncPolicy)) return false; }
+    else if (key == "nb") job.numOfBatches = std::stoi(val);
+    else if (key == "o") job.outfile = val;
+    else if (key == "od") job.outDists = (bool)std::stoi(val);
+    else return false;
+  }
+
+  if (job.searchMode != "radius" && job.searchMode != "knn") return false;
+  if (!(job.radius > 0) || job.knn == 0) return false;
+  if (job.searchMode == "knn" && job.knn > K) return false;
+  return true;
+}
+
+static std::vector<Job> readJobs( RTNNState& state ) {
+  std::ifstream file(state.jobFile);
+  if (!file.good()) {
+    std::cerr << "Could not read " << state.jobFile << "\n";
+    exit(1);
+  }
+
+  // the command line provides the defaults
+  Job defaults;
+  defaults.qfile = state.pfile;
+  defaults.searchMode = state.searchMode;
+  defaults.radius = (state.geoRadius > 0) ? state.geoSearchRadius : state.radius;
+  defaults.knn = state.knn;
+  defaults.pointSortMode = state.pointSortMode;
+  defaults.querySortMode = state.querySortMode;
+  defaults.partition = state.partition;
+  defaults.approxMode = state.approxMode;
+  defaults.truncPolicy = state.params.truncPolicy;
+  defaults.numOfBatches = state.numOfBatches;
+  defaults.outfile = state.outfile;
+  defaults.outDists = state.outDists;
+
+  std::vector<Job> jobs;
+  std::string line;
+  for (unsigned int n = 1; std::getline(file, line); n++) {
+    size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos || line[start] == '#') continue;
+
+    Job job = defaults;
+    bool ok;
+    try { ok = parseJob(line, job); } catch (std::exception&) { ok = false; }
+    if (!ok) {
+      std::cerr << state.jobFile << ":" << n << ": invalid job: " << line << "\n";
+      exit(1);
+    }
+    jobs.push_back(job);
+  }
+  return jobs;
+}
+
+void runJobs( RTNNState& state ) {
+  std::vector<Job> jobs = readJobs(state);
+
+  loadIndex(state);
+
+  // parsed query sets, by file name
+  std::map<std::string, std::vector<float3>> querySets;
+  std::vector<JobStats> stats(jobs.size());
+
+  for (unsigned int j = 0; j < jobs.size(); j++) {
+    const Job& job = jobs[j];
+    fprintf(stdout, "Job %u: q=%s sm=%s r=%f k=%u ps=%d qs=%d p=%d a=%d\n", j, job.qfile.c_str(),
+        job.searchMode.c_str(), job.radius, job.knn, job.pointSortMode, job.querySortMode, job.partition, job.approxMode);
+
+    auto start = std::chrono::steady_clock::now();
+    Timing::startTiming("job");
+      auto qs = querySets.find(job.qfile);
+      if (qs == querySets.end()) {
+        if (!std::ifstream(job.qfile).good()) {
+          std::cerr << "Could not read " << job.qfile << "\n";
+          exit(1);
+        }
+        Timing::startTiming("read queries");
+          unsigned int numQueries;
+          if (state.geoRadius > 0) {
+            double3* h_queries = read_pc_data_double(job.qfile.c_str(), &numQueries);
+            std::vector<float3> queries(numQueries);
+            for (unsigned int i = 0; i < numQueries; i++) {
+              double3 u = geoToUnit(h_queries[i].x, h_queries[i].y);
+              queries[i] = make_float3(u.x, u.y, u.z);
+            }
+            qs = querySets.emplace(job.qfile, std::move(queries)).first;
+            delete[] h_queries;
+          } else {
+            float3* h_queries = read_pc_data(job.qfile.c_str(), &numQueries);
+            qs = querySets.emplace(job.qfile, std::vector<float3>(h_queries, h_queries + numQueries)).first;
+            delete[] h_queries;
+          }
+        Timing::stopTiming(true);
+      }
+      std::vector<float3>& queries = qs->second;
+
+      if (job.searchMode != state.searchMode) {
+        state.searchMode = job.searchMode;
+        rebuildPipeline(state);
+      }
+      if (job.pointSortMode != state.pointSortMode) {
+        state.pointSortMode = job.pointSortMode;
+        sortIndex(state);
+      }
+
+      state.knn = (job.searchMode == "knn") ? K : job.knn;
+      state.radius = (state.geoRadius > 0) ? geoChord(state, job.radius) : job.radius;
+      state.params.radius = state.radius;
+      state.querySortMode = job.querySortMode;
+      state.params.truncPolicy = (job.searchMode == "radius") ? job.truncPolicy : TRUNC_FIRST;
+      // closest and random choose among all the neighbors within the radius,
+      // which a partitioned batch doesn't search; see parseArgs.
+      state.partition = job.partition && state.params.truncPolicy == TRUNC_FIRST;
+      state.approxMode = (state.knnEps > 0) ? 0 : job.approxMode;
+      state.numOfBatches = job.numOfBatches;
+
+      SearchResult res;
+      if (!queries.empty())
+        searchQueries(state, queries.data(), queries.size(),
+            (job.searchMode == "knn") ? job.knn : UINT_MAX, job.outDists, res);
+      else res.offsets.assign(1, 0);
+
+      if (!job.outfile.empty()) {
+        Timing::startTiming("write results");
+          FILE* fp = fopen(job.outfile.c_str(), "w");
+          if (fp == nullptr) {
+            perror(job.outfile.c_str());
+            exit(1);
+          }
+          writeResult(fp, res, job.outDists);
+          fclose(fp);
+        Timing::stopTiming(true);
+      }
+    Timing::stopTiming(true);
+
+    stats[j].numQueries = queries.size();
+    stats[j].numNeighbors = res.ids.size();
+    stats[j].time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  fprintf(stdout, "Jobs:\n");
+  for (unsigned int j = 0; j < jobs.size(); j++) {
+    fprintf(stdout, "\tjob %u: %u queries, %llu neighbors, %.3f s\n",
+        j, stats[j].numQueries, stats[j].numNeighbors, stats[j].time);
+  }
+
+  cleanupState(state);
+}
@@ -1,10 +1,15 @@
 #include <sutil/Exception.h>
 #include <sutil/Timing.h>
 
+#include <thrust/copy.h>
+
+#include <algorithm>
+
 #include "optixNSearch.h"
 #include "state.h"
 #include "func.h"
 #include "grid.h"
+#include "metric.h"
 
 void setDevice ( RTNNState& state ) {
   int32_t device_count = 0;
@@ -21,6 +26,7 @@ void setDevice ( RTNNState& state ) {
   // be that much smaller than what is reported, presumably to store data
   // structures that are hidden from us.
   state.totDRAMSize -= 0.25;
+  state.residentThreads = prop.multiProcessorCount * prop.maxThreadsPerMultiProcessor;
 }
 
 void freeGridPointers( RTNNState& state ) {
@@ -40,16 +46,119 @@ void setupSearch( RTNNState& state ) {
 
   state.numActQueries[0] = state.numQueries;
   state.d_actQs[0] = state.params.queries;
+  state.d_actQIds[0] = state.d_queryIds;
   state.h_actQs[0] = state.h_queries;
   state.launchRadius[0] = state.radius;
 }
 
+// pack the shells of a multi-radius search, print the average neighbor count
+// per shell and write them to the output file, if any.
+void reportShells( RTNNState& state ) {
+  ShellResult res;
+  packShells(state, res);
+
+  unsigned int numShells = res.numShells;
+  std::vector<unsigned long long> totals(numShells, 0);
+  for (unsigned int q = 0; q < state.numOrigQueries; q++) {
+    for (unsigned int s = 0; s < numShells; s++) {
+      size_t c = (size_t)q * numShells + s;
+      totals[s] += res.counts.empty() ? res.offsets[c + 1] - res.offsets[c] : res.counts[c];
+    }
+  }
+  float inner = 0;
+  for (unsigned int s = 0; s < numShells; s++) {
+    fprintf(stdout, "\tShell [%f, %f): %.3f neighbors per query\n",
+        inner, state.shellRadii[s], (double)totals[s] / state.numOrigQueries);
+    inner = state.shellRadii[s];
+  }
+
+  if (!state.outfile.empty()) {
+    FILE* fp = fopen(state.outfile.c_str(), "w");
+    if (fp == nullptr) {
+      perror(state.outfile.c_str());
+      exit(1);
+    }
+    writeShells(fp, res);
+    fclose(fp);
+  }
+}
+
+// merge the self search into an undirected graph, print its size and write
+// its adjacency lists to the output file, if any.
+void reportGraph( RTNNState& state ) {
+  SearchResult res;
+  packGraph(state, res, state.outDists);
+
+  unsigned int numNodes = res.offsets.size() - 1;
+  unsigned int numIsolated = 0;
+  for (unsigned int i = 0; i < numNodes; i++)
+    if (res.offsets[i + 1] == res.offsets[i]) numIsolated++;
+  fprintf(stdout, "\t%s graph: %zu edges, %.3f average degree, %u isolated points\n",
+      state.graphMode.c_str(), res.ids.size() / 2, (double)res.ids.size() / numNodes, numIsolated);
+
+  if (!state.outfile.empty()) {
+    FILE* fp = fopen(state.outfile.c_str(), "w");
+    if (fp == nullptr) {
+      perror(state.outfile.c_str());
+      exit(1);
+    }
+    writeResult(fp, res, state.outDists);
+    fclose(fp);
+  }
+}
+
+// 1-NN (K = 1 builds): the ray writes the distance of its nearest neighbor,
+// by original query id, along with the neighbor.
+void setupNearest( RTNNState& state ) {
+  thrust::device_ptr<float> d_dists_ptr;
+  state.params.nnDists = allocThrustDevicePtr(&d_dists_ptr, state.numOrigQueries, &state.d_pointers);
+  fillByValue(d_dists_ptr, state.numOrigQueries, 0.0f);
+}
+
+// print the mean and max nearest-neighbor distance and write one id:distance
+// line per query (empty if it has no neighbor within the radius) to the
+// output file, if any.
+void reportNearest( RTNNState& state ) {
+  SearchResult res;
+  packResults(state, res, nullptr, 1, false);
+
+  std::vector<float> dists(state.numOrigQueries);
+  thrust::copy(thrust::device_pointer_cast(state.params.nnDists),
+      thrust::device_pointer_cast(state.params.nnDists) + dists.size(), dists.begin());
+
+  res.dists.resize(res.ids.size());
+  double sum = 0;
+  float max = 0;
+  for (unsigned int q = 0; q < state.numOrigQueries; q++) {
+    if (res.offsets[q + 1] == res.offsets[q]) continue;
+    float d = (state.geoRadius > 0) ? geoDist(state, dists[q]) : dists[q];
+    res.dists[res.offsets[q]] = d;
+    sum += d;
+    max = std::max(max, d);
+  }
+  unsigned int numFound = res.ids.size();
+  fprintf(stdout, "	1-NN distance: %f on average, %f at most; %u queries have no neighbor\n",
+      numFound ? sum / numFound : 0.0, max, state.numOrigQueries - numFound);
+
+  if (!state.outfile.empty()) {
+    FILE* fp = fopen(state.outfile.c_str(), "w");
+    if (fp == nullptr) {
+      perror(state.outfile.c_str());
+      exit(1);
+    }
+    writeResult(fp, res, true);
+    fclose(fp);
+  }
+}
+
 int main( int argc, char* argv[] )
 {
   RTNNState state;
 
   parseArgs( state, argc, argv );
 
+  if (state.perfCounters) Timing::enablePerfCounters();
+
   readData(state);
 
   std::cout << "========================================" << std::endl;
@@ -57,12 +166,25 @@ int main( int argc, char* argv[] )
   std::cout << "numQueries: " << state.numQueries << std::endl;
   std::cout << "searchMode: " << state.searchMode << std::endl;
   std::cout << "radius: " << state.radius << std::endl;
+  std::cout << "Data dimension: " << state.dim << std::endl;
+  std::cout << "Metric: " << metricName() << std::endl;
+  std::cout << "Great-circle sphere radius: " << state.geoRadius << std::endl;
+  std::cout << "Double precision? " << std::boolalpha << state.doublePrec << std::endl;
+  std::cout << "Aggregate file: " << (state.aggFile.empty() ? "none" : state.aggFile) << std::endl;
+  std::cout << "SPH? " << std::boolalpha << state.sph << std::endl;
+  std::cout << "Graph: " << (state.graphMode.empty() ? "none" : state.graphMode) << std::endl;
+  std::cout << "Box file: " << (state.boxFile.empty() ? "none" : state.boxFile) << std::endl;
+  std::cout << "Capsule file: " << (state.capsuleFile.empty() ? "none" : state.capsuleFile) << std::endl;
+  std::cout << "Search dimension: " << (state.searchDim ? std::to_string(state.searchDim) : "auto") << std::endl;
   std::cout << "Deferred free? " << std::boolalpha << state.deferFree << std::endl;
   std::cout << "E2E Measure? " << std::boolalpha << state.msr << std::endl;
   std::cout << "K: " << state.knn << std::endl;
   std::cout << "Same P and Q? " << std::boolalpha << state.samepq << std::endl;
   std::cout << "Query partition? " << std::boolalpha << state.partition << std::endl;
   std::cout << "Approx query partition mode: " << state.approxMode << std::endl;
+  std::cout << "KNN epsilon: " << state.knnEps << std::endl;
+  std::cout << "Certify and repair? " << std::boolalpha << state.repair << std::endl;
+  std::cout << "Truncation policy: " << state.params.truncPolicy << std::endl;
   std::cout << "Auto batching? " << std::boolalpha << state.autoNB << std::endl;
   std::cout << "Auto crRatio? " << std::boolalpha << state.autoCR << std::endl;
   std::cout << "cellRadiusRatio: " << std::boolalpha << state.crRatio << std::endl; // only useful when preSort == 1/2 and autoCR is false
@@ -74,15 +196,50 @@ int main( int argc, char* argv[] )
   std::cout << "querySortMode: " << state.querySortMode << std::endl;
   std::cout << "gsrRatio: " << state.gsrRatio << std::endl; // only useful when qGasSortMode != 0
   std::cout << "Gather after gas sort? " << std::boolalpha << state.toGather << std::endl;
+  std::cout << "Perf counters? " << std::boolalpha << state.perfCounters << std::endl;
+  std::cout << "Server socket: " << (state.serverSock.empty() ? "none" : state.serverSock) << std::endl;
+  std::cout << "Shards: " << state.numShards << std::endl;
+  std::cout << "Pipeline chunk: " << state.pipelineChunk << std::endl;
+  std::cout << "Job file: " << (state.jobFile.empty() ? "none" : state.jobFile) << std::endl;
   std::cout << "========================================" << std::endl << std::endl;
 
+  // workers are forked, so this has to happen before CUDA is initialized.
+  if (!state.serverSock.empty() && state.numShards > 1) {
+    runShardedServer(state);
+    exit(0);
+  }
+
   try
   {
     setDevice(state);
 
     Timing::reset();
+    if (!state.serverSock.empty()) {
+      runServer(state);
+      exit(0);
+    }
+    if (state.pipelineChunk) {
+      runPipeline(state);
+      exit(0);
+    }
+    if (!state.jobFile.empty()) {
+      runJobs(state);
+      exit(0);
+    }
+
     uploadData(state);
 
+    if (!state.boxFile.empty() || !state.capsuleFile.empty()) {
+      runRegionQueries(state);
+      exit(0);
+    }
+
+    if (state.params.histBins) setupHistogram(state);
+    if (!state.aggFile.empty()) setupAggregates(state);
+    if (state.sph) setupSph(state);
+    // a graph has its own output
+    if (K == 1 && state.searchMode == "knn" && state.graphMode.empty()) setupNearest(state);
+
     // call this after set device.
     initBatches(state);
 
@@ -97,56 +254,24 @@ int main( int argc, char* argv[] )
     // queries have been sorted so no need to sort them again.
     if (!state.samepq) sortParticles(state, POINT_TYPE, state.pointSortMode);
 
-    // early free done here too
-    setupSearch(state);
-
-    if (state.interleave) {
-      for (int i = 0; i < state.numOfBatches; i++) {
-        // it's possible that certain batches have 0 query (e.g., state.partThd too low).
-        if (state.numActQueries[i] == 0) continue;
-	    // TODO: group buildGas together to allow overlapping; this would allow
-	    // us to batch-free temp storages and non-compacted gas storages. right
-	    // now free storage serializes gas building.
-        createGeometry (state, i, state.launchRadius[i]/state.gsrRatio); // batch_id ignored if not partition.
-      }
-
-      for (int i = 0; i < state.numOfBatches; i++) {
-        if (state.numActQueries[i] == 0) continue;
-        if (state.qGasSortMode) gasSortSearch(state, i);
-      }
-
-      for (int i = 0; i < state.numOfBatches; i++) {
-        if (state.numActQueries[i] == 0) continue;
-        if (state.qGasSortMode && state.gsrRatio != 1)
-          createGeometry (state, i, state.launchRadius[i]);
-      }
-
-      for (int i = 0; i < state.numOfBatches; i++) {
-        if (state.numActQueries[i] == 0) continue;
-        // TODO: when K is too big, we can't launch all rays together. split rays.
-        search(state, i);
-      }
-    } else {
-      for (int i = 0; i < state.numOfBatches; i++) {
-        if (state.numActQueries[i] == 0) continue;
-
-        // create the GAS using the current order of points and the launchRadius of the current batch.
-        // TODO: does it make sense to have per-batch |gsrRatio|?
-        createGeometry (state, i, state.launchRadius[i]/state.gsrRatio); // batch_id ignored if not partition.
-
-        if (state.qGasSortMode) {
-          gasSortSearch(state, i);
-          if (state.gsrRatio != 1)
-            createGeometry (state, i, state.launchRadius[i]);
-        }
-
-        search(state, i);
-      }
-    }
+    searchBatches(state);
+    if (state.repair) repairBatches(state);
 
     CUDA_SYNC_CHECK();
+    if (state.doublePrec) recheckDouble(state);
     Timing::stopTiming(true);
 
+    if (state.params.numShells) reportShells(state);
+    if (state.params.histBins) reportHistogram(state);
+    if (state.params.aggAttrs) reportAggregates(state);
+    if (state.sph) reportSph(state);
+    if (!state.graphMode.empty()) reportGraph(state);
+    if (state.params.nnDists) reportNearest(state);
+
+    if (state.knnEps > 0)
+      fprintf(stdout, "\tKNN is (1+eps)-approximate with eps = %f: each Kth distance is at most %f times the exact one\n",
+          state.knnEps, 1.0f + state.knnEps);
+
     if(state.sanCheck) sanityCheck(state);
 
     cleanupState(state);
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <sutil/vec_math.h>
+
+#include <cmath>
+
+// The distance metric is a compile-time policy, just like K, so that each
+// metric gets its own straight-line distance code in the IS programs: cmake
+// -DMETRIC=1 (see CMakeLists.txt). Per-axis weights don't need a policy of
+// their own; see -ms in |parseArgs|.
+#define METRIC_L2   0 // Euclidean
+#define METRIC_L1   1 // Manhattan
+#define METRIC_LINF 2 // Chebyshev
+
+#ifndef METRIC
+#define METRIC METRIC_L2
+#endif
+
+// a key of the distance of a difference vector that orders pairs like the
+// distance does but is cheaper to get: the squared distance for L2 and the
+// distance itself otherwise. compare it with |metricKey(radius)|.
+SUTIL_INLINE SUTIL_HOSTDEVICE float metricKey(const float3& d)
+{
+#if METRIC == METRIC_L1
+  return fabsf(d.x) + fabsf(d.y) + fabsf(d.z);
+#elif METRIC == METRIC_LINF
+  return fmaxf(fabsf(d.x), fmaxf(fabsf(d.y), fabsf(d.z)));
+#else
+  return dot(d, d);
+#endif
+}
+
+SUTIL_INLINE SUTIL_HOSTDEVICE float metricKey(float radius)
+{
+#if METRIC == METRIC_L2
+  return radius * radius;
+#else
+  return radius;
+#endif
+}
+
+// fold more coordinates (of N-D data) into a key.
+SUTIL_INLINE SUTIL_HOSTDEVICE float metricKey(float key, const float4& d)
+{
+#if METRIC == METRIC_L1
+  return key + fabsf(d.x) + fabsf(d.y) + fabsf(d.z) + fabsf(d.w);
+#elif METRIC == METRIC_LINF
+  return fmaxf(key, fmaxf(fmaxf(fabsf(d.x), fabsf(d.y)), fmaxf(fabsf(d.z), fabsf(d.w))));
+#else
+  return key + dot(d, d);
+#endif
+}
+
+SUTIL_INLINE SUTIL_HOSTDEVICE float metricDist(float key)
+{
+#if METRIC == METRIC_L2
+  return sqrtf(key);
+#else
+  return key;
+#endif
+}
+
+// the same in double, for rechecks on the host.
+inline double metricKey(double dx, double dy, double dz)
+{
+#if METRIC == METRIC_L1
+  return fabs(dx) + fabs(dy) + fabs(dz);
+#elif METRIC == METRIC_LINF
+  return fmax(fabs(dx), fmax(fabs(dy), fabs(dz)));
+#else
+  return dx * dx + dy * dy + dz * dz;
+#endif
+}
+
+inline double metricKey(double radius)
+{
+#if METRIC == METRIC_L2
+  return radius * radius;
+#else
+  return radius;
+#endif
+}
+
+// the volume of a 3D ball of |radius|: a sphere, an octahedron or a cube.
+inline double metricBallVolume(double radius)
+{
+#if METRIC == METRIC_L1
+  return 4.0 / 3.0 * radius * radius * radius;
+#elif METRIC == METRIC_LINF
+  return 8.0 * radius * radius * radius;
+#else
+  return 4.0 / 3.0 * M_PI * radius * radius * radius;
+#endif
+}
+
+inline const char* metricName()
+{
+#if METRIC == METRIC_L1
+  return "L1";
+#elif METRIC == METRIC_LINF
+  return "Linf";
+#else
+  return "L2";
+#endif
+}
+
+// the squared Euclidean distance from |p| to the segment [a, b], whatever the
+// metric; see capsule queries (-cq).
+SUTIL_INLINE SUTIL_HOSTDEVICE float segmentDist2(const float3& p, const float3& a, const float3& b)
+{
+  float3 ab = b - a;
+  float len2 = dot(ab, ab);
+  float t = (len2 > 0) ? clamp(dot(p - a, ab) / len2, 0.0f, 1.0f) : 0.0f;
+  float3 d = p - (a + t * ab);
+  return dot(d, d);
+}
@@ -45,11 +45,13 @@
 #include <cstdlib>
 #include <queue>
 #include <unordered_set>
+#include <vector>
 
 #include "optixNSearch.h"
 #include "state.h"
 #include "func.h"
 #include "grid.h"
+#include "metric.h"
 
 template <typename T>
 struct Record
@@ -80,6 +82,14 @@ void filterRemoteQueries ( RTNNState& state ) {
   thrust::device_ptr<float3> tQueries;
   allocThrustDevicePtr(&tQueries, count, &state.d_pointers);
   copyIfInRange(state.params.queries, state.numQueries, thrust::device_pointer_cast(state.params.queries), tQueries, tMin, tMax);
+  if (state.trackIds) {
+    thrust::device_ptr<unsigned int> tIds;
+    allocThrustDevicePtr(&tIds, count, &state.d_pointers);
+    copyIfInRange(state.d_queryIds, state.numQueries, thrust::device_pointer_cast(state.params.queries), tIds, tMin, tMax);
+    state.d_pointers.erase(state.d_pointers.find(state.d_queryIds));
+    CUDA_CHECK( cudaFree( state.d_queryIds ) );
+    state.d_queryIds = thrust::raw_pointer_cast(tIds);
+  }
   fprintf(stdout, "Filter queries: %u (%.3f)\n", state.numQueries - count, (1 - (float)count/state.numQueries)*100);
 
   if (count == 0) {
@@ -101,6 +111,7 @@ void filterRemoteQueries ( RTNNState& state ) {
 
   state.params.queries = thrust::raw_pointer_cast(tQueries);
   state.numQueries = count;
+  Timing::setQueryCount(state.numQueries);
   // Just for sanity check purpose. TODO: Really only needed when there's no
   // partition and no query sorting, both of which will update state.h_queries
   // using the queries from the device.
@@ -114,15 +125,51 @@ void filterRemoteQueries ( RTNNState& state ) {
   state.Max = fmaxf(state.qMax, state.pMax);
 }
 
-void uploadData ( RTNNState& state ) {
-  Timing::startTiming("upload points and/or queries");
-    // Allocate device memory for points/queries
+// repack the coordinates of |nd| beyond the first three into
+// params.ndChunks zero-padded float4s per particle, in original order, and
+// upload them; see |ndKey|.
+static float4* uploadNDTail ( RTNNState& state, float3** nd, unsigned int N ) {
+    unsigned int numChunks = state.params.ndChunks;
+    std::vector<float4> tail((size_t)N * numChunks, make_float4(0, 0, 0, 0));
+    for (unsigned int i = 0; i < N; i++) {
+      float* row = reinterpret_cast<float*>(&tail[(size_t)i * numChunks]);
+      for (int c = 1; c < state.dim / 3; c++) {
+        row[(c - 1) * 3] = nd[c][i].x;
+        row[(c - 1) * 3 + 1] = nd[c][i].y;
+        row[(c - 1) * 3 + 2] = nd[c][i].z;
+      }
+    }
+
+    thrust::device_ptr<float4> d_tail_ptr;
+    float4* d_tail = allocThrustDevicePtr(&d_tail_ptr, tail.size(), &state.d_pointers);
+    thrust::copy(tail.begin(), tail.end(), d_tail_ptr);
+    return d_tail;
+}
+
+void uploadPoints ( RTNNState& state ) {
+    // Allocate device memory for points
     thrust::device_ptr<float3> d_points_ptr;
     state.params.points = allocThrustDevicePtr(&d_points_ptr, state.numPoints, &state.d_pointers);
 
     thrust::copy(state.h_points, state.h_points + state.numPoints, d_points_ptr);
     computeMinMax(state.numPoints, state.params.points, state.pMin, state.pMax);
 
+    if (state.trackIds) {
+      thrust::device_ptr<unsigned int> d_ids_ptr;
+      state.d_pointIds = allocThrustDevicePtr(&d_ids_ptr, state.numPoints, &state.d_pointers);
+      genSeqDevice(d_ids_ptr, state.numPoints);
+    }
+
+    if (state.dim > 3) {
+      state.params.ndChunks = state.dim / 4; // ceil((dim - 3) / 4)
+      state.params.ndPoints = uploadNDTail(state, state.h_ndpoints, state.numPoints);
+      state.params.pointIds = state.d_pointIds;
+    }
+}
+
+void uploadQueries ( RTNNState& state ) {
+    state.numOrigQueries = state.numQueries;
+
     if (state.samepq) {
       // by default, params.queries and params.points point to the same device
       // memory. later if we decide to reorder the queries, we will allocate new
@@ -139,6 +186,20 @@ void uploadData ( RTNNState& state ) {
       computeMinMax(state.numQueries, state.params.queries, state.qMin, state.qMax);
     }
 
+    if (state.trackIds) {
+      if (state.samepq) state.d_queryIds = state.d_pointIds;
+      else {
+        thrust::device_ptr<unsigned int> d_ids_ptr;
+        state.d_queryIds = allocThrustDevicePtr(&d_ids_ptr, state.numQueries, &state.d_pointers);
+        genSeqDevice(d_ids_ptr, state.numQueries);
+      }
+    }
+
+    if (state.dim > 3) {
+      if (state.h_ndqueries == state.h_ndpoints) state.params.ndQueries = state.params.ndPoints;
+      else state.params.ndQueries = uploadNDTail(state, state.h_ndqueries, state.numQueries);
+    }
+
     Timing::startTiming("filter queries");
       // filter out queries that are theorerically impossible to reach any search
       // points given the search radius, then create a unified grid. why? query
@@ -155,16 +216,36 @@ void uploadData ( RTNNState& state ) {
       if (state.filterQueries) filterRemoteQueries(state);
 
       // reduce the search radius since it's meaningless to have a radius
-      // greater than the scene diagonal.
+      // greater than the scene diagonal. the 3D diagonal says nothing about
+      // N-D distances though.
       state.gRadius = state.radius;
-      float3 O = state.Min - state.Max;
-      float dist = sqrtf(dot(O, O));
-      state.radius = std::min(state.radius, dist);
+      float dist = metricDist(metricKey(state.Min - state.Max));
+      if (state.dim == 3) state.radius = std::min(state.radius, dist);
       fprintf(stdout, "\tGiven radius: %f\n", state.gRadius);
       fprintf(stdout, "\tActual radius: %f\n", state.radius);
     Timing::stopTiming(true);
+}
 
+void uploadData ( RTNNState& state ) {
+  Timing::startTiming("upload points and/or queries");
+    uploadPoints(state);
+    uploadQueries(state);
   Timing::stopTiming(true);
+
+  detectDim(state);
+}
+
+// 2D search needs all points and queries in one plane (z = const): grids
+// then have a single layer of cells and partitions are sized by inscribed
+// squares rather than cubes.
+void detectDim ( RTNNState& state ) {
+  bool planar = (state.pMin.z == state.pMax.z) && (state.qMin.z == state.qMax.z) && (state.pMin.z == state.qMin.z);
+  if (state.searchDim == 0) state.searchDim = planar ? 2 : 3;
+  else if (state.searchDim == 2 && !planar) {
+    fprintf(stderr, "-sd 2 needs all points and queries to have the same z\n");
+    exit(1);
+  }
+  fprintf(stdout, "\tSearch dimension: %d\n", state.searchDim);
 }
 
 static void buildGas(
@@ -598,6 +679,7 @@ void launchSubframe( unsigned int* output_buffer, RTNNState& state, int batch_id
     state.params.handle = state.gas_handle[batch_id];
     state.params.queries = state.d_actQs[batch_id];
     state.params.frame_buffer = output_buffer;
+    state.params.numRays = numQueries;
 
     fprintf(stdout, "\tLaunch %u (%.4f%%) queries\n", numQueries, (float)numQueries/(float)state.numQueries*100.0);
     fprintf(stdout, "\tSearch radius: %f\n", state.params.radius);
@@ -619,7 +701,7 @@ void launchSubframe( unsigned int* output_buffer, RTNNState& state, int batch_id
         reinterpret_cast<CUdeviceptr>( state.d_params ),
         sizeof( Params ),
         &state.sbt,
-        numQueries, // launch width
+        launchWidth(state, numQueries), // launch width
         1,          // launch height
         1           // launch depth
     ) );
@@ -659,6 +741,8 @@ void cleanupState( RTNNState& state )
     delete state.launchRadius;
     delete state.h_res;
     delete state.d_actQs;
+    delete state.d_actQIds;
+    delete[] state.h_pointIds;
     delete state.h_actQs;
     delete state.d_aabb;
     delete state.d_temp_buffer_gas;
@@ -666,6 +750,15 @@ void cleanupState( RTNNState& state )
     delete state.d_r2q_map;
     //delete state.h_points;
 
+    // the large-K KNN scratch outlives batches; see |allocKnnScratch|
+    for (int i = 0; i < state.maxBatchCount; i++) {
+      CUDA_CHECK( cudaFree( state.d_knnKeys[i] ) );
+      CUDA_CHECK( cudaFree( state.d_knnIds[i] ) );
+    }
+    delete[] state.d_knnKeys;
+    delete[] state.d_knnIds;
+    delete[] state.knnScratchRows;
+
     CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.sbt.raygenRecord       ) ) );
     CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.sbt.missRecordBase     ) ) );
     CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.sbt.hitgroupRecordBase ) ) );
@@ -673,9 +766,73 @@ void cleanupState( RTNNState& state )
     for (auto it = state.d_pointers.begin(); it != state.d_pointers.end(); it++) {
       CUDA_CHECK( cudaFree( *it ) );
     }
+    for (auto it = state.d_indexPointers.begin(); it != state.d_indexPointers.end(); it++) {
+      CUDA_CHECK( cudaFree( *it ) );
+    }
     if (state.deferFree) freeGridPointers(state);
 }
 
+// free everything a search allocates (queries, batches, GASes, results) but
+// keep the context, the pipelines, the streams and whatever is in
+// |d_indexPointers|, so that another set of queries can be searched against
+// the same points.
+void resetBatches( RTNNState& state )
+{
+    for (int i = 0; i < state.maxBatchCount; i++) {
+      if (state.h_res[i] != nullptr) CUDA_CHECK( cudaFreeHost(state.h_res[i] ) );
+      if (state.d_gas_output_buffer[i] != 0) CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.d_gas_output_buffer[i] ) ) );
+      // without partitioning h_actQs[0] is simply h_queries, which we don't own
+      if (state.h_actQs[i] != state.h_queries) delete[] state.h_actQs[i];
+
+      state.h_res[i] = nullptr;
+      state.d_gas_output_buffer[i] = 0;
+      state.h_actQs[i] = nullptr;
+      state.d_actQs[i] = nullptr;
+      state.d_actQIds[i] = nullptr;
+      state.d_r2q_map[i] = nullptr;
+      state.d_aabb[i] = nullptr;
+      state.numActQueries[i] = 0;
+    }
+
+    for (auto it = state.d_pointers.begin(); it != state.d_pointers.end(); it++) {
+      CUDA_CHECK( cudaFree( *it ) );
+    }
+    state.d_pointers.clear();
+    if (state.deferFree) freeGridPointers(state);
+    state.d_gridPointers.clear();
+    state.d_CellParticleCounts_ptr_p = nullptr;
+    state.d_CellOffsets_ptr_p = nullptr;
+
+    state.params.d_r2q_map = nullptr;
+    state.d_queryIds = state.samepq ? state.d_pointIds : nullptr;
+}
+
+// the raygen program depends on |searchMode|, so switching between radius
+// and knn search requires a new set of program groups, pipelines and SBT.
+void rebuildPipeline( RTNNState& state )
+{
+    for (int i = 0; i < state.maxBatchCount; i++) {
+      OPTIX_CHECK( optixPipelineDestroy     ( state.pipeline[i]           ) );
+    }
+    OPTIX_CHECK( optixProgramGroupDestroy ( state.raygen_prog_group       ) );
+    OPTIX_CHECK( optixProgramGroupDestroy ( state.radiance_metal_sphere_prog_group ) );
+    OPTIX_CHECK( optixProgramGroupDestroy ( state.radiance_miss_prog_group         ) );
+    OPTIX_CHECK( optixModuleDestroy       ( state.geometry_module         ) );
+    OPTIX_CHECK( optixModuleDestroy       ( state.camera_module           ) );
+
+    CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.sbt.raygenRecord       ) ) );
+    CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.sbt.missRecordBase     ) ) );
+    CUDA_CHECK( cudaFree( reinterpret_cast<void*>( state.sbt.hitgroupRecordBase ) ) );
+
+    Timing::startTiming("create pipeline");
+      createPipeline ( state );
+    Timing::stopTiming(true);
+
+    Timing::startTiming("create SBT");
+      createSBT      ( state );
+    Timing::stopTiming(true);
+}
+
 void setupOptiX( RTNNState& state ) {
   Timing::startTiming("create context");
     createContext  ( state );
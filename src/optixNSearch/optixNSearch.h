@@ -52,6 +52,54 @@ enum SearchType
     NOTEST = 2 // test against nothing
 };
 
+// radius shells use payload registers 2-7 for their counts.
+#define MAX_SHELLS 6
+
+// a pair-distance histogram is accumulated per ray in local memory.
+#define MAX_HIST_BINS 64
+
+// neighbor aggregates use payload registers 2-5 for the attributes and 6 for
+// the weight sum.
+#define MAX_AGG_ATTRS 4
+
+// KNN builds with K above LARGE_K don't keep the queue in registers (it would
+// spill anyway) but in a scratch row of KNN_SCRATCH slots per launch thread in
+// global memory, which is cut back to the K nearest whenever it fills up.
+#define LARGE_K 64
+#define KNN_SCRATCH (K + (K / 4 > 32 ? K / 4 : 32))
+
+enum AggOp
+{
+    AGG_SUM  = 0,
+    AGG_MEAN = 1,
+    AGG_MIN  = 2,
+    AGG_MAX  = 3
+};
+
+enum AggKernel
+{
+    AGG_FLAT     = 0, // every neighbor weighs 1
+    AGG_GAUSS    = 1, // exp(-d^2 / (2 sigma^2))
+    AGG_TRIANGLE = 2, // 1 - d / r
+    AGG_EPAN     = 3  // 1 - (d / r)^2
+};
+
+// which neighbors a radius search keeps when a query has more than |limit|.
+enum TruncPolicy
+{
+    TRUNC_FIRST   = 0, // the first found, in traversal order; the ray ends once the row is full
+    TRUNC_CLOSEST = 1, // the closest, kept in a bounded max-heap per row
+    TRUNC_RANDOM  = 2  // a uniform random sample, by reservoir sampling
+};
+
+// the two launches of an SPH step; see Params.
+enum SphPass
+{
+    SPH_OFF     = 0,
+    SPH_DENSITY = 1,
+    SPH_FORCE   = 2
+};
+
 struct Params
 {
     unsigned int*    frame_buffer;
@@ -60,8 +108,104 @@ struct Params
     float            radius;
     unsigned int*    d_r2q_map;
     unsigned int     limit; // 1 for the initial run to sort indices; knn for future runs.
+    unsigned int     numRays; // of the launch, which may have fewer threads; see |knnIds|
     SearchType       mode;
 
+    // truncation of a plain radius search; see TruncPolicy. TRUNC_CLOSEST
+    // keeps the keys of each row's heap in |rowKeys| (laid out like
+    // |frame_buffer|), and TRUNC_RANDOM seeds each ray from |truncSeed|.
+    TruncPolicy      truncPolicy;
+    unsigned int     truncSeed;
+    float*           rowKeys;
+
+    // multi-radius search (radius mode only): a neighbor falls in the first
+    // shell whose radius exceeds its distance, compared as metric keys (the
+    // squares for L2; see metric.h). with
+    // |shellCounts| a query's row holds the number of neighbors in each
+    // shell; otherwise shell s owns |shellLimit[s]| slots of the row from
+    // |shellBase[s]| on. numShells is 0 for a plain radius search.
+    unsigned int     numShells;
+    bool             shellCounts;
+    float            shellRadii2[MAX_SHELLS];
+    unsigned int     shellLimit[MAX_SHELLS];
+    unsigned int     shellBase[MAX_SHELLS];
+
+    // pair-distance histogram (radius mode only): instead of storing
+    // neighbors, each pair with a distance in (0, histRadius) adds the
+    // product of its weights (1 without weights) to bin
+    // floor(dist / histRadius * histBins) of |hist|. weights are indexed by
+    // original ids, hence the id maps. histBins is 0 for a normal search.
+    unsigned int     histBins;
+    float            histRadius;
+    double*          hist;
+    float*           pointWeights;
+    float*           queryWeights;
+
+    // (1+eps)-approximate KNN: once the queue is full a candidate only
+    // replaces the current Kth neighbor if it's closer by a factor of 1+eps,
+    // i.e., if its key times |knnEpsScale| (the key of 1+eps; see metric.h)
+    // is smaller. 1 for an exact search.
+    float            knnEpsScale;
+
+    // large-K KNN (K > LARGE_K): each ray appends its candidates to a row
+    // of KNN_SCRATCH keys in |rowKeys| and point positions in |knnIds| and,
+    // when the row is full, selects the K nearest in place (see |selectK|),
+    // whose farthest then bounds the rest of the search. the rows belong to
+    // launch threads, not rays: the launch has at most as many threads as
+    // the device runs at once, and each traces every launch-width-th of the
+    // |numRays| rays in turn (see |allocKnnScratch|).
+    unsigned int*    knnIds;
+
+    // 1-NN (KNN mode of a K = 1 build): the distance of each query's nearest
+    // neighbor, indexed by original query id. null in the resident modes.
+    float*           nnDists;
+
+    // neighbor aggregates (radius mode only): instead of storing neighbors,
+    // each ray reduces the |aggAttrs| attributes (|pointAttrs|, indexed by
+    // original point id) of its neighbors with |aggOp|; sums and means weigh
+    // each neighbor by |aggKernel| of its distance, which for the triangle
+    // and Epanechnikov kernels reaches 0 at |aggRadius| (the requested
+    // radius, whatever |radius| a launch uses). the query's values go to
+    // |aggOut| and its neighbor count to |aggCounts|, both indexed by
+    // original query id. aggAttrs is 0 for a normal search.
+    unsigned int     aggAttrs;
+    AggOp            aggOp;
+    AggKernel        aggKernel;
+    float            aggSigma;
+    float            aggRadius;
+    float*           pointAttrs;
+    float*           aggOut;
+    unsigned int*    aggCounts;
+
+    // SPH (radius mode, points as queries): instead of storing neighbors,
+    // each ray evaluates the cubic spline with smoothing length |sphH| (half
+    // the radius, so that its support is the radius) at its neighbors.
+    // SPH_DENSITY sums |sphMass| * W into |sphDensity|; SPH_FORCE then sums
+    // the pressure and viscosity forces, from those densities and
+    // |sphVel| (null for particles at rest), into |sphForce|. all three are
+    // indexed by original id. sphPass is SPH_OFF for a normal search.
+    SphPass          sphPass;
+    float            sphH;
+    float            sphMass;
+    float            sphRestDensity;
+    float            sphStiffness;
+    float            sphViscosity;
+    float3*          sphVel;
+    float*           sphDensity;
+    float3*          sphForce;
+
+    // N-D search: |points| and |queries| hold the first three coordinates,
+    // which the BVH filters on; the remaining ones are zero-padded to
+    // |ndChunks| float4s per particle, indexed by original id. ndChunks is 0
+    // for 3D data.
+    unsigned int     ndChunks;
+    float4*          ndPoints;
+    float4*          ndQueries;
+
+    // sorted/partitioned position -> original id, for the arrays above.
+    unsigned int*    pointIds;
+    unsigned int*    queryIds;
+
     OptixTraversableHandle handle;
 };
 
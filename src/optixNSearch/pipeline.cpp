@@ -0,0 +1,226 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <climits>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "result.h"
+#include "pipeline.h"
+
+// Pipelined mode: instead of reading all queries, then sorting, then
+// searching, then writing, the query file is streamed in chunks through four
+// stages --- parse, prepare, search, output --- so that chunk N+2 is parsed
+// while chunk N+1 is sorted and partitioned, chunk N is searched and chunk
+// N-1 is packed and written. the prepare stage works on its own copy of the
+// state (see |prepareQueries|), which the search stage adopts; only the GAS
+// builds and launches touch the searching state. points are loaded and sorted
+// once upfront.
+
+struct QueryChunk
+{
+  unsigned long long  base; // id of the first query
+  std::vector<float3> queries;
+};
+
+struct PreparedChunk
+{
+  unsigned long long  base;
+  std::vector<float3> queries;
+  std::vector<float3> sortedQs; // see |prepareQueries|
+  RTNNState           prep;
+};
+
+struct ResultChunk
+{
+  unsigned long long  base;
+  std::vector<float3> queries; // in their original order, for distances
+  SearchRows          rows;
+};
+
+static void parseStage( RTNNState& state, std::ifstream& file, BoundedQueue<QueryChunk>& out, StageStats& stats ) {
+  stats.begin();
+  unsigned long long base = 0;
+  std::string line;
+
+  while (true) {
+    QueryChunk chunk;
+    chunk.base = base;
+    chunk.queries.reserve(state.pipelineChunk);
+
+    stats.beginWork();
+    while (chunk.queries.size() < state.pipelineChunk && std::getline(file, line)) {
+      // same format as |read_pc_data|; every line is a query so that query
+      // ids are line numbers.
+      double x = 0, y = 0, z = 0;
+      sscanf(line.c_str(), "%lf,%lf,%lf", &x, &y, &z);
+      if (state.geoRadius > 0) {
+        double3 u = geoToUnit(x, y);
+        chunk.queries.push_back(make_float3(u.x, u.y, u.z));
+      }
+      else chunk.queries.push_back(make_float3(x, y, z));
+    }
+    if (chunk.queries.empty()) break;
+    stats.endWork();
+
+    base += chunk.queries.size();
+    out.push(std::move(chunk));
+  }
+
+  out.close();
+  stats.end();
+}
+
+static void prepareStage( const RTNNState& base, BoundedQueue<QueryChunk>& in, BoundedQueue<PreparedChunk>& out, StageStats& stats ) {
+  // the runtime's current device is per-thread.
+  CUDA_CHECK( cudaSetDevice( base.device_id ) );
+
+  stats.begin();
+  QueryChunk chunk;
+  while (in.pop(chunk)) {
+    stats.beginWork();
+    PreparedChunk prepared;
+    prepared.base = chunk.base;
+    prepared.queries = std::move(chunk.queries);
+    Timing::startTiming("prepare chunk");
+      // each chunk starts from |base|, so a chunk that lowers the radius to
+      // its scene diagonal doesn't carry that over to the next one.
+      prepareQueries(base, prepared.prep, prepared.queries.data(), prepared.queries.size(), prepared.sortedQs);
+      CUDA_SYNC_CHECK();
+    Timing::stopTiming(true);
+    stats.endWork();
+
+    out.push(std::move(prepared));
+  }
+
+  out.close();
+  stats.end();
+}
+
+static void searchStage( RTNNState& state, BoundedQueue<PreparedChunk>& in, BoundedQueue<ResultChunk>& out, StageStats& stats ) {
+  CUDA_CHECK( cudaSetDevice( state.device_id ) );
+
+  stats.begin();
+  PreparedChunk chunk;
+  while (in.pop(chunk)) {
+    stats.beginWork();
+    ResultChunk res;
+    res.base = chunk.base;
+    Timing::startTiming("search chunk");
+      adoptQueries(state, chunk.prep);
+      searchBatches(state);
+      CUDA_SYNC_CHECK();
+      // the rows are packed by the output stage, so the batches can be
+      // reset for the next chunk right away.
+      takeRows(state, res.rows);
+      resetBatches(state);
+    Timing::stopTiming(true);
+    stats.endWork();
+
+    // moving keeps the data where the batches pointed, but they're reset.
+    res.queries = std::move(chunk.queries);
+    out.push(std::move(res));
+  }
+
+  out.close();
+  stats.end();
+}
+
+static void outputStage( const RTNNState& state, BoundedQueue<ResultChunk>& in, StageStats& stats, unsigned long long& numQueries, unsigned long long& numNeighbors ) {
+  // pinned rows are freed here.
+  CUDA_CHECK( cudaSetDevice( state.device_id ) );
+
+  FILE* fp = nullptr;
+  if (!state.outfile.empty()) {
+    fp = fopen(state.outfile.c_str(), "w");
+    if (fp == nullptr) {
+      perror(state.outfile.c_str());
+      exit(1);
+    }
+  }
+
+  unsigned int limit = (state.searchMode == "knn") ? state.knn : UINT_MAX;
+
+  stats.begin();
+  ResultChunk chunk;
+  while (in.pop(chunk)) {
+    stats.beginWork();
+    SearchResult res;
+    res.offsets.resize(chunk.rows.numQueries + 1);
+    packRows(state, chunk.rows, res.offsets.data(), reserveIn(res), chunk.queries.data(), limit, state.outDists);
+    freeRows(chunk.rows);
+
+    unsigned int n = res.offsets.size() - 1;
+    numQueries += n;
+    numNeighbors += res.ids.size();
+
+    if (fp) writeResult(fp, res, state.outDists);
+    stats.endWork();
+  }
+
+  if (fp) fclose(fp);
+  stats.end();
+}
+
+void runPipeline( RTNNState& state ) {
+  loadIndex(state);
+
+  std::ifstream file(state.qfile);
+  if (!file.good()) {
+    std::cerr << "Could not read " << state.qfile << "\n";
+    exit(1);
+  }
+
+  // the state as |loadIndex| left it, which every chunk is prepared from.
+  const RTNNState base = state;
+
+  BoundedQueue<QueryChunk> queryQueue(state.pipelineDepth);
+  BoundedQueue<PreparedChunk> prepQueue(state.pipelineDepth);
+  BoundedQueue<ResultChunk> resQueue(state.pipelineDepth);
+  StageStats parse("parse"), prepare("prepare"), search("search"), output("output");
+  unsigned long long numQueries = 0, numNeighbors = 0;
+
+  auto start = StageStats::Clock::now();
+  {
+    // the pool joins when it goes out of scope, i.e., once all stages finish.
+    ThreadPool pool(4);
+    pool.submit([&]{ parseStage(state, file, queryQueue, parse); });
+    pool.submit([&]{
+      try
+      {
+        prepareStage(base, queryQueue, prepQueue, prepare);
+      }
+      catch( std::exception& e )
+      {
+        std::cerr << "Caught exception: " << e.what() << "\n";
+        exit(1);
+      }
+    });
+    pool.submit([&]{
+      try
+      {
+        searchStage(state, prepQueue, resQueue, search);
+      }
+      catch( std::exception& e )
+      {
+        std::cerr << "Caught exception: " << e.what() << "\n";
+        exit(1);
+      }
+    });
+    pool.submit([&]{ outputStage(state, resQueue, output, numQueries, numNeighbors); });
+  }
+  double wall = std::chrono::duration<double>(StageStats::Clock::now() - start).count();
+
+  fprintf(stdout, "Pipeline: %llu queries, %llu neighbors, %.3f s\n", numQueries, numNeighbors, wall);
+  for (StageStats* s : {&parse, &prepare, &search, &output}) {
+    fprintf(stdout, "\tstage %-7s: %u chunks, busy %.3f s of %.3f s (%.1f%%)\n",
+        s->name, s->items, s->busy, s->total, s->total > 0 ? s->busy / s->total * 100 : 0);
+  }
+
+  cleanupState(state);
+}
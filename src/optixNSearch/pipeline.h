@@ -0,0 +1,128 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Building blocks of the pipelined mode (--pipeline): stages run as tasks of
+// one thread pool and hand work to each other through bounded queues, so a
+// fast producer blocks instead of buffering the whole input.
+
+template <typename T>
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue(size_t capacity) : m_capacity(capacity), m_closed(false) {}
+
+  // blocks while the queue is full.
+  void push(T item)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_notFull.wait(lock, [this]{ return m_items.size() < m_capacity; });
+    m_items.push_back(std::move(item));
+    m_notEmpty.notify_one();
+  }
+
+  // blocks while the queue is empty; returns false once it's closed and drained.
+  bool pop(T& item)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_notEmpty.wait(lock, [this]{ return !m_items.empty() || m_closed; });
+    if (m_items.empty()) return false;
+    item = std::move(m_items.front());
+    m_items.pop_front();
+    m_notFull.notify_one();
+    return true;
+  }
+
+  // no more pushes; consumers drain what's left.
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_notEmpty.notify_all();
+  }
+
+private:
+  size_t                  m_capacity;
+  bool                    m_closed;
+  std::deque<T>           m_items;
+  std::mutex              m_mutex;
+  std::condition_variable m_notEmpty;
+  std::condition_variable m_notFull;
+};
+
+class ThreadPool
+{
+public:
+  explicit ThreadPool(unsigned int numThreads) : m_stop(false)
+  {
+    for (unsigned int i = 0; i < numThreads; i++)
+      m_threads.push_back(std::thread(&ThreadPool::worker, this));
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto& t : m_threads) t.join();
+  }
+
+  void submit(std::function<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.push_back(std::move(task));
+    }
+    m_cv.notify_one();
+  }
+
+private:
+  void worker()
+  {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this]{ return m_stop || !m_tasks.empty(); });
+        if (m_tasks.empty()) return;
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  bool                               m_stop;
+  std::vector<std::thread>           m_threads;
+  std::deque<std::function<void()>>  m_tasks;
+  std::mutex                         m_mutex;
+  std::condition_variable            m_cv;
+};
+
+// per-stage accounting: time spent working vs. the stage's lifetime, which
+// includes waiting on its input and output queues.
+struct StageStats
+{
+  typedef std::chrono::steady_clock Clock;
+
+  const char*       name;
+  unsigned int      items = 0;
+  double            busy  = 0; // s
+  double            total = 0; // s
+  Clock::time_point start;
+  Clock::time_point workStart;
+
+  explicit StageStats(const char* n) : name(n) {}
+  void begin()     { start = Clock::now(); }
+  void beginWork() { workStart = Clock::now(); }
+  void endWork()   { busy += std::chrono::duration<double>(Clock::now() - workStart).count(); items++; }
+  void end()       { total = std::chrono::duration<double>(Clock::now() - start).count(); }
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Wire format between the search server (--server) and its clients. This
+// header deliberately depends on nothing but libc so that clients don't need
+// CUDA/OptiX. All fields are in host byte order since the server only listens
+// on a Unix domain socket.
+//
+// request:  RTNNReqHeader, numQueries * 3 floats (x, y, z)
+// response: RTNNResHeader, and if status is RTNN_OK:
+//           (numQueries + 1) uint32 CSR offsets,
+//           numNeighbors uint32 original point ids,
+//           numNeighbors floats of distances if RTNN_FLAG_DISTS is set.
+// The neighbors of query i are [offsets[i], offsets[i+1]). A connection can
+// carry any number of requests, each answered in order.
+//
+// Shared-memory transport: to avoid copying queries and results through the
+// socket, a client can create a POSIX shm segment (see RTNNShmHeader) and
+// send an RTNN_REQ_ATTACH request whose numQueries is the length of the shm
+// name that follows instead of queries. The server maps the segment and
+// acknowledges with an RTNNResHeader; from then on requests go through the
+// segment and the socket only marks the attachment's lifetime (closing it
+// detaches). To post request n, the client fills slot n % numSlots (its
+// header and queries) and then increments |posted|, waking the server with
+// FUTEX_WAKE on it. The server reads the queries in place, writes the result
+// into the slot's offsets/ids/dists and the slot's RTNNResHeader, and then
+// sets the slot's |done| to n + 1 and wakes it. A result that doesn't fit in
+// slotNeighbors comes back as RTNN_ERR_CAPACITY with numNeighbors set to the
+// room it needs.
+
+#define RTNN_REQ_MAGIC 0x51525452u // "RTRQ"
+#define RTNN_RES_MAGIC 0x53525452u // "RTRS"
+
+enum RTNNReqMode
+{
+  RTNN_REQ_RADIUS = 0,
+  RTNN_REQ_KNN    = 1,
+  RTNN_REQ_ATTACH = 2  // attach a shared-memory segment; see above
+};
+
+enum RTNNReqFlag
+{
+  RTNN_FLAG_DISTS = 1
+};
+
+enum RTNNStatus
+{
+  RTNN_OK          = 0,
+  RTNN_ERR_REQUEST = 1, // malformed request
+  RTNN_ERR_KNN     = 2, // K is larger than what the server was compiled with
+  RTNN_ERR_CAPACITY = 3, // the result doesn't fit in the shm slot
+  RTNN_ERR_SHM      = 4  // the shm segment can't be attached
+};
+
+struct RTNNReqHeader
+{
+  uint32_t magic;
+  uint32_t mode;
+  uint32_t flags;
+  uint32_t numQueries;
+  uint32_t knn; // max neighbors per query; in knn mode the K nearest are returned
+  float    radius;
+};
+
+struct RTNNResHeader
+{
+  uint32_t magic;
+  uint32_t status;
+  uint32_t flags;
+  uint32_t numQueries;
+  uint64_t numNeighbors;
+};
+
+#define RTNN_SHM_MAGIC 0x4d535452u // "RTSM"
+
+// layout of the shm segment: RTNNShmHeader, numSlots RTNNShmSlots, then per
+// slot slotQueries float3 queries, per slot (slotQueries + 1) uint32 offsets,
+// per slot slotNeighbors uint32 ids and per slot slotNeighbors float dists.
+struct RTNNShmHeader
+{
+  uint32_t magic;
+  uint32_t numSlots;
+  uint32_t slotQueries;   // max queries per request
+  uint32_t slotNeighbors; // max neighbors per result
+  uint32_t posted;        // futex; number of requests posted so far
+  uint32_t pad[3];
+};
+
+struct RTNNShmSlot
+{
+  RTNNReqHeader req;
+  RTNNResHeader res;
+  uint32_t      done;     // futex; 1 + the sequence number of the last result
+  uint32_t      pad;
+};
+
+inline size_t rtnnShmQueriesOffset(const RTNNShmHeader& h) { return sizeof(RTNNShmHeader) + (size_t)h.numSlots * sizeof(RTNNShmSlot); }
+inline size_t rtnnShmOffsetsOffset(const RTNNShmHeader& h) { return rtnnShmQueriesOffset(h) + (size_t)h.numSlots * h.slotQueries * 3 * sizeof(float); }
+inline size_t rtnnShmIdsOffset(const RTNNShmHeader& h)     { return rtnnShmOffsetsOffset(h) + (size_t)h.numSlots * (h.slotQueries + 1) * sizeof(uint32_t); }
+inline size_t rtnnShmDistsOffset(const RTNNShmHeader& h)   { return rtnnShmIdsOffset(h) + (size_t)h.numSlots * h.slotNeighbors * sizeof(uint32_t); }
+inline size_t rtnnShmSize(const RTNNShmHeader& h)          { return rtnnShmDistsOffset(h) + (size_t)h.numSlots * h.slotNeighbors * sizeof(float); }
+
+inline RTNNShmSlot* rtnnShmSlot(void* base, uint32_t s)
+{ return reinterpret_cast<RTNNShmSlot*>(static_cast<char*>(base) + sizeof(RTNNShmHeader)) + s; }
+inline float* rtnnShmQueries(void* base, uint32_t s)
+{ const RTNNShmHeader& h = *static_cast<RTNNShmHeader*>(base); return reinterpret_cast<float*>(static_cast<char*>(base) + rtnnShmQueriesOffset(h)) + (size_t)s * h.slotQueries * 3; }
+inline uint32_t* rtnnShmOffsets(void* base, uint32_t s)
+{ const RTNNShmHeader& h = *static_cast<RTNNShmHeader*>(base); return reinterpret_cast<uint32_t*>(static_cast<char*>(base) + rtnnShmOffsetsOffset(h)) + (size_t)s * (h.slotQueries + 1); }
+inline uint32_t* rtnnShmIds(void* base, uint32_t s)
+{ const RTNNShmHeader& h = *static_cast<RTNNShmHeader*>(base); return reinterpret_cast<uint32_t*>(static_cast<char*>(base) + rtnnShmIdsOffset(h)) + (size_t)s * h.slotNeighbors; }
+inline float* rtnnShmDists(void* base, uint32_t s)
+{ const RTNNShmHeader& h = *static_cast<RTNNShmHeader*>(base); return reinterpret_cast<float*>(static_cast<char*>(base) + rtnnShmDistsOffset(h)) + (size_t)s * h.slotNeighbors; }
+
+// shared (not FUTEX_PRIVATE) futexes so that they work across processes.
+// waits while *addr == val, at most |timeoutMs| if it's not negative.
+inline void futexWait(uint32_t* addr, uint32_t val, int timeoutMs)
+{
+  struct timespec ts;
+  ts.tv_sec = timeoutMs / 1000;
+  ts.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, timeoutMs < 0 ? nullptr : &ts, nullptr, 0);
+}
+
+inline void futexWake(uint32_t* addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+inline bool readFull(int fd, void* buf, size_t len)
+{
+  char* p = static_cast<char*>(buf);
+  while (len > 0) {
+    ssize_t n = ::read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+inline bool writeFull(int fd, const void* buf, size_t len)
+{
+  const char* p = static_cast<const char*>(buf);
+  while (len > 0) {
+    ssize_t n = ::write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
@@ -0,0 +1,285 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <thrust/device_vector.h>
+#include <thrust/copy.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "grid.h"
+#include "metric.h"
+#include "result.h"
+
+// Region queries: all points inside each of a list of axis-aligned boxes
+// (-bq) or capsules, i.e., within a distance of a segment (-cq). They don't
+// go through OptiX: the points are sorted by the cells of a raster-ordered
+// grid, and each region walks the cells its bounding box covers, taking the
+// points of cells entirely inside it in bulk and testing only the others;
+// see |columnQuery|. Each (region, column) pair is a thread, so a large
+// region doesn't hold up its warp. Each point is visited at most once per
+// region, so there is nothing to deduplicate. The result is a CSR of
+// original point ids over the regions, or just the counts.
+
+// the points per cell the region grid aims at: few enough that testing the
+// cells on a region's boundary is cheap, enough that the columns of a large
+// region aren't mostly empty cells.
+#define REGION_CELL_POINTS 16
+
+struct Regions
+{
+  bool                capsules = false;
+  std::vector<float3> a;     // box min corners, or segment starts
+  std::vector<float3> b;     // box max corners, or segment ends
+  std::vector<float>  radii; // capsules only
+};
+
+// one minx,miny,minz,maxx,maxy,maxz row per box, or one x0,y0,z0,x1,y1,z1[,r]
+// row per capsule, whose radius defaults to -r.
+static void readRegions( RTNNState& state, Regions& regions ) {
+  regions.capsules = !state.capsuleFile.empty();
+  const std::string& file = regions.capsules ? state.capsuleFile : state.boxFile;
+  std::ifstream in(file);
+  if (!in.good()) {
+    std::cerr << "Could not read " << file << "\n";
+    exit(1);
+  }
+
+  std::string line, tok;
+  unsigned int rows = 0;
+  while (std::getline(in, line)) {
+    if (line.empty()) continue;
+    rows++;
+    std::stringstream ss(line);
+    std::vector<float> v;
+    while (std::getline(ss, tok, ',')) v.push_back(std::stof(tok));
+    if (regions.capsules) {
+      if (v.size() == 6) v.push_back(state.gRadius);
+      if (v.size() != 7 || v[6] < 0) {
+        std::cerr << file << ":" << rows << ": expected x0,y0,z0,x1,y1,z1 and an optional radius >= 0\n";
+        exit(1);
+      }
+      regions.radii.push_back(v[6]);
+    } else if (v.size() != 6 || v[0] > v[3] || v[1] > v[4] || v[2] > v[5]) {
+      std::cerr << file << ":" << rows << ": expected minx,miny,minz,maxx,maxy,maxz with min <= max\n";
+      exit(1);
+    }
+    regions.a.push_back(make_float3(v[0], v[1], v[2]));
+    regions.b.push_back(make_float3(v[3], v[4], v[5]));
+  }
+  if (rows == 0) {
+    std::cerr << file << " has no regions\n";
+    exit(1);
+  }
+}
+
+// the cell size that puts REGION_CELL_POINTS points in an average cell of the
+// points' bounding box; the regions don't have a radius to go by. an axis
+// along which the points span less than a cell gets a single cell and drops
+// out of the volume.
+static float regionCellSize( const RTNNState& state, unsigned int N ) {
+  float3 extent = state.Max - state.Min;
+  float e[3] = {extent.x, extent.y, extent.z};
+  int dim = (state.searchDim == 2) ? 2 : 3;
+  std::sort(e, e + dim);
+
+  double numCells = std::max((double)N / REGION_CELL_POINTS, 1.0);
+  float cellSize = 0;
+  for (int k = 0; k < dim; k++) {
+    double volume = 1;
+    for (int j = k; j < dim; j++) volume *= e[j];
+    cellSize = (float)pow(volume / numCells, 1.0 / (dim - k));
+    if (cellSize > 0 && e[k] >= cellSize) break;
+  }
+  // all points coincide
+  return (cellSize > 0) ? cellSize : 1.0f;
+}
+
+static bool inRegion( const Regions& regions, size_t i, float3 p ) {
+  if (regions.capsules)
+    return segmentDist2(p, regions.a[i], regions.b[i]) <= regions.radii[i] * regions.radii[i];
+  return p.x >= regions.a[i].x && p.x <= regions.b[i].x && p.y >= regions.a[i].y && p.y <= regions.b[i].y &&
+         p.z >= regions.a[i].z && p.z <= regions.b[i].z;
+}
+
+// compare the number of points of each region with a brute-force count.
+static void checkRegions( RTNNState& state, const Regions& regions, const std::vector<unsigned int>& counts ) {
+  Timing::startTiming("sanity check region queries");
+    unsigned int numWrong = 0;
+    for (size_t i = 0; i < regions.a.size(); i++) {
+      unsigned int count = 0;
+      for (unsigned int p = 0; p < state.numPoints; p++)
+        if (inRegion(regions, i, state.h_points[p])) count++;
+      if (count != counts[i]) {
+        if (numWrong++ < 10) fprintf(stdout, "\tRegion %zu: %u points, expected %u\n", i, counts[i], count);
+      }
+    }
+    fprintf(stdout, "\tSanity check %s: %u of %zu regions wrong\n", numWrong ? "failed" : "passed", numWrong, regions.a.size());
+  Timing::stopTiming(true);
+}
+
+// call after the points are uploaded (unsorted, so positions are original
+// ids); prints the totals and writes one line per region to the output file,
+// if any: the point ids, or with -bqc the count.
+void runRegionQueries( RTNNState& state ) {
+  Regions regions;
+  readRegions(state, regions);
+  unsigned int numRegions = regions.a.size();
+  unsigned int N = state.numPoints;
+  unsigned int threadsPerBlock = 64;
+
+  Timing::startTiming("total region query time");
+    Timing::startTiming("build region grid");
+      GridInfo gridInfo;
+      unsigned int numberOfCells = genGridInfo(state, N, gridInfo, regionCellSize(state, N));
+
+      thrust::device_ptr<unsigned int> d_cellIdx_ptr, d_cellCounts_ptr, d_cellOffsets_ptr, d_ids_ptr;
+      thrust::device_ptr<float3> d_sortedPoints_ptr;
+      allocThrustDevicePtr(&d_cellIdx_ptr, N, &state.d_pointers);
+      allocThrustDevicePtr(&d_ids_ptr, N, &state.d_pointers);
+      allocThrustDevicePtr(&d_sortedPoints_ptr, N, &state.d_pointers);
+      allocThrustDevicePtr(&d_cellCounts_ptr, numberOfCells, &state.d_pointers);
+      allocThrustDevicePtr(&d_cellOffsets_ptr, numberOfCells, &state.d_pointers);
+
+      // raster order, so that the cells of a column are consecutive.
+      fillByValue(d_cellCounts_ptr, numberOfCells, 0);
+      kInsertParticles(N / threadsPerBlock + 1,
+                       threadsPerBlock,
+                       gridInfo,
+                       state.params.points,
+                       thrust::raw_pointer_cast(d_cellIdx_ptr),
+                       thrust::raw_pointer_cast(d_cellCounts_ptr),
+                       nullptr,
+                       false
+                      );
+      fillByValue(d_cellOffsets_ptr, numberOfCells, 0);
+      exclusiveScan(d_cellCounts_ptr, numberOfCells, d_cellOffsets_ptr);
+
+      genSeqDevice(d_ids_ptr, N);
+      sortByKey(d_cellIdx_ptr, d_ids_ptr, N);
+      gatherByKey(d_ids_ptr, thrust::device_pointer_cast(state.params.points), d_sortedPoints_ptr, N);
+    Timing::stopTiming(true);
+
+    Timing::startTiming("region queries");
+      thrust::device_ptr<float3> d_a_ptr, d_b_ptr;
+      thrust::device_ptr<float> d_radii_ptr;
+      allocThrustDevicePtr(&d_a_ptr, numRegions, &state.d_pointers);
+      allocThrustDevicePtr(&d_b_ptr, numRegions, &state.d_pointers);
+      thrust::copy(regions.a.begin(), regions.a.end(), d_a_ptr);
+      thrust::copy(regions.b.begin(), regions.b.end(), d_b_ptr);
+      if (regions.capsules) {
+        allocThrustDevicePtr(&d_radii_ptr, numRegions, &state.d_pointers);
+        thrust::copy(regions.radii.begin(), regions.radii.end(), d_radii_ptr);
+      }
+
+      // the (region, column) pairs; see |kRegionQuery|.
+      thrust::device_ptr<unsigned int> d_numCols_ptr, d_colOffsets_ptr;
+      allocThrustDevicePtr(&d_numCols_ptr, numRegions, &state.d_pointers);
+      allocThrustDevicePtr(&d_colOffsets_ptr, numRegions, &state.d_pointers);
+      kRegionColumns(numRegions / threadsPerBlock + 1,
+                     threadsPerBlock,
+                     gridInfo,
+                     thrust::raw_pointer_cast(d_a_ptr),
+                     thrust::raw_pointer_cast(d_b_ptr),
+                     thrust::raw_pointer_cast(d_radii_ptr),
+                     numRegions,
+                     thrust::raw_pointer_cast(d_numCols_ptr)
+                    );
+      exclusiveScan(d_numCols_ptr, numRegions, d_colOffsets_ptr);
+      unsigned int numPairs = d_colOffsets_ptr[numRegions - 1] + d_numCols_ptr[numRegions - 1];
+
+      thrust::device_ptr<unsigned int> d_pairCounts_ptr, d_pairOffsets_ptr, d_rowCounts_ptr, d_out_ptr;
+      allocThrustDevicePtr(&d_pairCounts_ptr, numPairs, &state.d_pointers);
+      allocThrustDevicePtr(&d_rowCounts_ptr, numRegions, &state.d_pointers);
+      fillByValue(d_rowCounts_ptr, numRegions, 0);
+      unsigned int numOfBlocks = numPairs / threadsPerBlock + 1;
+      kRegionQuery(numOfBlocks,
+                   threadsPerBlock,
+                   gridInfo,
+                   thrust::raw_pointer_cast(d_cellOffsets_ptr),
+                   thrust::raw_pointer_cast(d_cellCounts_ptr),
+                   thrust::raw_pointer_cast(d_sortedPoints_ptr),
+                   thrust::raw_pointer_cast(d_ids_ptr),
+                   thrust::raw_pointer_cast(d_a_ptr),
+                   thrust::raw_pointer_cast(d_b_ptr),
+                   thrust::raw_pointer_cast(d_radii_ptr),
+                   numRegions,
+                   thrust::raw_pointer_cast(d_colOffsets_ptr),
+                   numPairs,
+                   thrust::raw_pointer_cast(d_pairCounts_ptr),
+                   thrust::raw_pointer_cast(d_rowCounts_ptr),
+                   nullptr,
+                   nullptr
+                  );
+
+      SearchResult res;
+      std::vector<unsigned int> counts(numRegions);
+      thrust::copy(d_rowCounts_ptr, d_rowCounts_ptr + numRegions, counts.begin());
+      if (!state.regionCounts) {
+        // the same walk again, now writing the ids of each pair where the
+        // scan of the pair counts says; pairs are in region order, so that is
+        // the CSR.
+        res.offsets.resize(numRegions + 1);
+        res.offsets[0] = 0;
+        for (unsigned int i = 0; i < numRegions; i++) res.offsets[i + 1] = res.offsets[i] + counts[i];
+        res.ids.resize(res.offsets[numRegions]);
+
+        allocThrustDevicePtr(&d_pairOffsets_ptr, numPairs, &state.d_pointers);
+        exclusiveScan(d_pairCounts_ptr, numPairs, d_pairOffsets_ptr);
+        allocThrustDevicePtr(&d_out_ptr, res.ids.size(), &state.d_pointers);
+        kRegionQuery(numOfBlocks,
+                     threadsPerBlock,
+                     gridInfo,
+                     thrust::raw_pointer_cast(d_cellOffsets_ptr),
+                     thrust::raw_pointer_cast(d_cellCounts_ptr),
+                     thrust::raw_pointer_cast(d_sortedPoints_ptr),
+                     thrust::raw_pointer_cast(d_ids_ptr),
+                     thrust::raw_pointer_cast(d_a_ptr),
+                     thrust::raw_pointer_cast(d_b_ptr),
+                     thrust::raw_pointer_cast(d_radii_ptr),
+                     numRegions,
+                     thrust::raw_pointer_cast(d_colOffsets_ptr),
+                     numPairs,
+                     nullptr,
+                     nullptr,
+                     thrust::raw_pointer_cast(d_pairOffsets_ptr),
+                     thrust::raw_pointer_cast(d_out_ptr)
+                    );
+        thrust::copy(d_out_ptr, d_out_ptr + res.ids.size(), res.ids.begin());
+      }
+      CUDA_SYNC_CHECK();
+    Timing::stopTiming(true);
+  Timing::stopTiming(true);
+
+  unsigned long long total = 0;
+  unsigned int numEmpty = 0;
+  for (unsigned int i = 0; i < numRegions; i++) {
+    total += counts[i];
+    if (counts[i] == 0) numEmpty++;
+  }
+  const char* kind = regions.capsules ? "capsules" : "boxes";
+  fprintf(stdout, "\t%u %s: %llu points, %.3f per region; %u %s are empty\n",
+      numRegions, kind, total, (double)total / numRegions, numEmpty, kind);
+
+  if (state.sanCheck) checkRegions(state, regions, counts);
+
+  if (!state.outfile.empty()) {
+    FILE* fp = fopen(state.outfile.c_str(), "w");
+    if (fp == nullptr) {
+      perror(state.outfile.c_str());
+      exit(1);
+    }
+    if (state.regionCounts) {
+      for (unsigned int i = 0; i < numRegions; i++) fprintf(fp, "%u\n", counts[i]);
+    }
+    else writeResult(fp, res, false);
+    fclose(fp);
+  }
+}
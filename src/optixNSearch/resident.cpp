@@ -0,0 +1,167 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "result.h"
+
+// Searching many sets of queries against the same points (the server and the
+// pipelined mode): the points are loaded once by |loadIndex| and each set of
+// queries goes through |searchQueries|, which leaves the points untouched.
+
+// make the points resident: upload and sort them once, and fix crRatio and
+// the max number of batches. the queries to come are unknown, so crRatio is
+// estimated as if each point were queried once with the radius given on the
+// command line, which should thus be the typical radius. with a snapshot
+// (-li) the sorted points, their ids and crRatio are taken from it instead.
+void loadIndex( RTNNState& state ) {
+  bool restore = (state.indexMap != nullptr);
+
+  Timing::startTiming("load index");
+    if (restore) restoreIndex(state);
+    else {
+      Timing::startTiming("upload points");
+        uploadPoints(state);
+      Timing::stopTiming(true);
+    }
+
+    state.Min = state.pMin;
+    state.Max = state.pMax;
+    state.numQueries = state.numPoints;
+    initBatches(state);
+
+    setupOptiX(state);
+
+    if (!restore) sortIndex(state);
+
+    // the points and their ids outlive requests
+    state.d_pointers.erase(state.params.points);
+    state.d_indexPointers.insert(state.params.points);
+    state.d_pointers.erase(state.d_pointIds);
+    state.d_indexPointers.insert(state.d_pointIds);
+
+    if (!state.indexOut.empty()) saveIndex(state);
+  Timing::stopTiming(true);
+}
+
+// (re)sort the resident points with the current pointSortMode. the sort is
+// in place, and the point ids are permuted along.
+void sortIndex( RTNNState& state ) {
+  // a previous search may have left the query count and the scene bounds of
+  // its queries; the sort needs those of the points.
+  state.Min = state.pMin;
+  state.Max = state.pMax;
+  state.numQueries = state.numPoints;
+
+  // there is no query partitioning whose cell arrays a point sort could
+  // reuse, so sort points as if partitioning were off.
+  bool partition = state.partition;
+  state.partition = false;
+  sortParticles(state, POINT_TYPE, state.pointSortMode);
+  state.partition = partition;
+  freeGridPointers(state);
+  state.d_gridPointers.clear();
+}
+
+// the query side of a search: upload, sort and partition |queries| into the
+// batches of |state|. 1D sorting sorts the host queries too, but we need them
+// in the original order to compute distances, so it sorts |sortedQs| instead,
+// which must live as long as the batches.
+static void prepareQueries( RTNNState& state, float3* queries, unsigned int numQueries, std::vector<float3>& sortedQs ) {
+  state.numQueries = numQueries;
+
+  if (state.querySortMode == 3) {
+    sortedQs.assign(queries, queries + numQueries);
+    state.h_queries = sortedQs.data();
+  } else state.h_queries = queries;
+
+  Timing::startTiming("upload queries");
+    uploadQueries(state);
+  Timing::stopTiming(true);
+
+  sortParticles(state, QUERY, state.querySortMode);
+}
+
+// prepare queries (see |prepareQueries|) while other queries are searched
+// with the state, as the pipelined mode does: |prep| becomes a copy of
+// |base|, the state as |loadIndex| left it, which shares the resident points,
+// the context and the pipelines but gets its own batch arrays and device
+// allocations. |adoptQueries| then hands them to the searching state.
+void prepareQueries( const RTNNState& base, RTNNState& prep, float3* queries, unsigned int numQueries, std::vector<float3>& sortedQs ) {
+  prep = base;
+  prep.d_pointers.clear();
+  prep.d_gridPointers.clear();
+  prep.numActQueries = new unsigned int[base.maxBatchCount]();
+  prep.launchRadius = new float[base.maxBatchCount]();
+  prep.d_actQs = new float3*[base.maxBatchCount]();
+  prep.d_actQIds = new unsigned int*[base.maxBatchCount]();
+  prep.h_actQs = new float3*[base.maxBatchCount]();
+
+  prepareQueries(prep, queries, numQueries, sortedQs);
+
+  // the partitioning grid is only reused by a later point sort, which the
+  // resident modes never do.
+  freeGridPointers(prep);
+  prep.d_gridPointers.clear();
+  prep.d_CellParticleCounts_ptr_p = nullptr;
+  prep.d_CellOffsets_ptr_p = nullptr;
+}
+
+// move the queries and batches that |prepareQueries| made in |prep| into
+// |state|, which must have been reset (see |resetBatches|).
+void adoptQueries( RTNNState& state, RTNNState& prep ) {
+  state.numQueries = prep.numQueries;
+  state.numOrigQueries = prep.numOrigQueries;
+  state.h_queries = prep.h_queries;
+  state.params.queries = prep.params.queries;
+  state.d_queryIds = prep.d_queryIds;
+  state.qMin = prep.qMin;
+  state.qMax = prep.qMax;
+  state.Min = prep.Min;
+  state.Max = prep.Max;
+  state.gRadius = prep.gRadius;
+  state.radius = prep.radius;
+  state.params.radius = prep.params.radius;
+  state.numFltQs = prep.numFltQs;
+  state.h_fltQs = prep.h_fltQs;
+
+  state.numOfBatches = prep.numOfBatches;
+  for (int i = 0; i < state.maxBatchCount; i++) {
+    state.numActQueries[i] = prep.numActQueries[i];
+    state.launchRadius[i] = prep.launchRadius[i];
+    state.d_actQs[i] = prep.d_actQs[i];
+    state.d_actQIds[i] = prep.d_actQIds[i];
+    state.h_actQs[i] = prep.h_actQs[i];
+  }
+  state.d_pointers.insert(prep.d_pointers.begin(), prep.d_pointers.end());
+
+  delete[] prep.numActQueries;
+  delete[] prep.launchRadius;
+  delete[] prep.d_actQs;
+  delete[] prep.d_actQIds;
+  delete[] prep.h_actQs;
+  prep.d_pointers.clear();
+}
+
+// search |numQueries| |queries| against the resident points with the current
+// searchMode, radius and knn. |queries| aren't modified; the result is in
+// their order. see |packResults| for the rest of the parameters.
+bool searchQueries( RTNNState& state, float3* queries, unsigned int numQueries, unsigned int limit, bool withDists, unsigned int* offsets, const ResultReserve& reserve ) {
+  std::vector<float3> sortedQs;
+  prepareQueries(state, queries, numQueries, sortedQs);
+  searchBatches(state);
+  CUDA_SYNC_CHECK();
+
+  bool fits = packResults(state, offsets, reserve, queries, limit, withDists);
+
+  resetBatches(state);
+  return fits;
+}
+
+void searchQueries( RTNNState& state, float3* queries, unsigned int numQueries, unsigned int limit, bool withDists, SearchResult& res ) {
+  res.offsets.resize(numQueries + 1);
+  searchQueries(state, queries, numQueries, limit, withDists, res.offsets.data(), reserveIn(res));
+}
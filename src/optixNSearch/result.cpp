@@ -0,0 +1,362 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <thrust/device_vector.h>
+#include <thrust/copy.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "result.h"
+#include "metric.h"
+
+// the host copy of the original point ids, copied lazily since sorting the
+// points invalidates it.
+static void fetchPointIds(RTNNState& state) {
+  if (state.trackIds && state.h_pointIds == nullptr) {
+    state.h_pointIds = new unsigned int[state.numPoints];
+    thrust::copy(thrust::device_pointer_cast(state.d_pointIds),
+        thrust::device_pointer_cast(state.d_pointIds) + state.numPoints, state.h_pointIds);
+  }
+}
+
+// the original point id of sorted point |i|.
+static unsigned int origPointId(const RTNNState& state, unsigned int i) {
+  unsigned int id = state.trackIds ? state.h_pointIds[i] : i;
+  return state.idMap.empty() ? id : state.idMap[id];
+}
+
+// the original query id of each result row of each batch.
+static std::vector<std::vector<unsigned int>> rowQueryIds(RTNNState& state) {
+  std::vector<std::vector<unsigned int>> rowQIds(state.numOfBatches);
+  for (int b = 0; b < state.numOfBatches; b++) {
+    unsigned int numActQs = state.numActQueries[b];
+    if (numActQs == 0) continue;
+    rowQIds[b].resize(numActQs);
+    if (state.trackIds)
+      thrust::copy(thrust::device_pointer_cast(state.d_actQIds[b]),
+          thrust::device_pointer_cast(state.d_actQIds[b]) + numActQs, rowQIds[b].begin());
+    else
+      std::iota(rowQIds[b].begin(), rowQIds[b].end(), 0);
+  }
+  return rowQIds;
+}
+
+// the rows of the last search, still owned by |state|.
+static void viewRows(RTNNState& state, SearchRows& rows) {
+  fetchPointIds(state);
+  rows.numQueries = state.numOrigQueries;
+  rows.knn = state.knn;
+  rows.rowQIds = rowQueryIds(state);
+  rows.res.assign(state.numOfBatches, nullptr);
+  for (int b = 0; b < state.numOfBatches; b++) rows.res[b] = static_cast<unsigned int*>(state.h_res[b]);
+}
+
+// detach the rows of the last search from |state|, so that its batches can be
+// reset before the rows are packed (|packRows|) and freed (|freeRows|).
+void takeRows(RTNNState& state, SearchRows& rows) {
+  viewRows(state, rows);
+  for (int b = 0; b < state.numOfBatches; b++) state.h_res[b] = nullptr;
+}
+
+void freeRows(SearchRows& rows) {
+  for (unsigned int* res : rows.res)
+    if (res != nullptr) CUDA_CHECK( cudaFreeHost(res) );
+  rows.res.clear();
+}
+
+// turn |rows|, which are in sorted/partitioned query order, padded with
+// UINT_MAX and refer to sorted point positions, into a compact CSR in
+// original query order with original point ids. |offsets| has room for
+// numQueries + 1 entries; ids (and distances) go wherever |reserve| says, and
+// if it refuses only the offsets are written and false is returned. at most
+// |limit| neighbors are kept per query; if a query has more, the |limit|
+// nearest ones are kept. |queries| are the queries in their original order
+// and are only needed for distances, i.e., if |withDists| or if truncating.
+// without |trackIds| this is only meaningful if queries weren't reordered. in
+// great-circle mode distances are great-circle ones. of |state| only the
+// resident points and their ids are read, which the search doesn't change.
+bool packRows(const RTNNState& state, const SearchRows& rows, unsigned int* offsets, const ResultReserve& reserve, const float3* queries, unsigned int limit, bool withDists) {
+  bool fits;
+  Timing::startTiming("pack results");
+    unsigned int numQueries = rows.numQueries;
+    unsigned int knn = rows.knn;
+    const std::vector<std::vector<unsigned int>>& rowQIds = rows.rowQIds;
+    std::fill(offsets, offsets + numQueries + 1, 0);
+
+    // pass 1: count the neighbors of each query and scan into offsets
+    for (size_t b = 0; b < rows.res.size(); b++) {
+      for (unsigned int i = 0; i < rowQIds[b].size(); i++) {
+        const unsigned int* row = rows.res[b] + (size_t)i * knn;
+        unsigned int count = 0;
+        for (unsigned int j = 0; j < knn; j++) {
+          if (row[j] != UINT_MAX) count++;
+        }
+        offsets[rowQIds[b][i] + 1] = std::min(count, limit);
+      }
+    }
+    for (unsigned int q = 0; q < numQueries; q++) offsets[q + 1] += offsets[q];
+
+    unsigned int* ids = nullptr;
+    float* dists = nullptr;
+    fits = reserve(offsets[numQueries], &ids, withDists ? &dists : nullptr);
+
+    // pass 2: fill in ids (and distances)
+    std::vector<std::pair<float, unsigned int>> cands;
+    for (size_t b = 0; fits && b < rows.res.size(); b++) {
+      for (unsigned int i = 0; i < rowQIds[b].size(); i++) {
+        const unsigned int* row = rows.res[b] + (size_t)i * knn;
+        unsigned int qId = rowQIds[b][i];
+        unsigned int start = offsets[qId];
+        unsigned int count = offsets[qId + 1] - start;
+
+        cands.clear();
+        for (unsigned int j = 0; j < knn; j++) {
+          if (row[j] == UINT_MAX) continue;
+          cands.push_back(std::make_pair(0.0f, row[j]));
+        }
+
+        bool truncate = cands.size() > count;
+        if (withDists || truncate) {
+          assert(queries != nullptr);
+          for (auto& c : cands) {
+            c.first = metricDist(metricKey(state.h_points[c.second] - queries[qId]));
+          }
+        }
+        if (truncate) std::partial_sort(cands.begin(), cands.begin() + count, cands.end());
+
+        for (unsigned int k = 0; k < count; k++) {
+          ids[start + k] = origPointId(state, cands[k].second);
+          if (withDists) dists[start + k] = (state.geoRadius > 0) ? geoDist(state, cands[k].first) : cands[k].first;
+        }
+      }
+    }
+  Timing::stopTiming(true);
+
+  return fits;
+}
+
+// |packRows| on the rows of the last search, which stay in |state|.
+bool packResults(RTNNState& state, unsigned int* offsets, const ResultReserve& reserve, const float3* queries, unsigned int limit, bool withDists) {
+  SearchRows rows;
+  viewRows(state, rows);
+  return packRows(state, rows, offsets, reserve, queries, limit, withDists);
+}
+
+// double-precision mode (see |rebaseDouble|): the float search used a radius
+// widened by dpEps, so drop the neighbors that are at least the requested
+// radius away in double. only a neighbor whose float distance is within dpEps
+// of the radius can be one, so only those are recomputed in double. rows are
+// compacted in place and stay padded with UINT_MAX.
+void recheckDouble(RTNNState& state) {
+  Timing::startTiming("recheck in double");
+    fetchPointIds(state);
+    std::vector<std::vector<unsigned int>> rowQIds = rowQueryIds(state);
+
+    float inner = state.dRadius - state.dpEps;
+    double bound = metricKey(state.dRadius);
+    unsigned long long numChecked = 0, numDropped = 0;
+    for (int b = 0; b < state.numOfBatches; b++) {
+      unsigned int* h_res = static_cast<unsigned int*>(state.h_res[b]);
+      for (unsigned int i = 0; i < rowQIds[b].size(); i++) {
+        unsigned int* row = h_res + (size_t)i * state.knn;
+        const double3& q = state.h_dqueries[rowQIds[b][i]];
+        float3 fq = rebase(q, state.origin);
+
+        unsigned int n = 0;
+        for (unsigned int j = 0; j < state.knn; j++) {
+          if (row[j] == UINT_MAX) continue;
+          const double3& p = state.h_dpoints[origPointId(state, row[j])];
+          if (metricDist(metricKey(rebase(p, state.origin) - fq)) >= inner) {
+            numChecked++;
+            if (metricKey(p.x - q.x, p.y - q.y, p.z - q.z) >= bound) {
+              numDropped++;
+              continue;
+            }
+          }
+          row[n++] = row[j];
+        }
+        std::fill(row + n, row + state.knn, UINT_MAX);
+      }
+    }
+  Timing::stopTiming(true);
+
+  fprintf(stdout, "\tRechecked %llu borderline pairs in double, dropped %llu\n", numChecked, numDropped);
+}
+
+ResultReserve reserveIn(SearchResult& res) {
+  return [&res](size_t numNeighbors, unsigned int** ids, float** dists) {
+    res.ids.resize(numNeighbors);
+    *ids = res.ids.data();
+    if (dists) {
+      res.dists.resize(numNeighbors);
+      *dists = res.dists.data();
+    } else res.dists.clear();
+    return true;
+  };
+}
+
+void packResults(RTNNState& state, SearchResult& res, const float3* queries, unsigned int limit, bool withDists) {
+  res.offsets.resize(state.numOrigQueries + 1);
+  packResults(state, res.offsets.data(), reserveIn(res), queries, limit, withDists);
+}
+
+// one line per query (in input order) listing its neighbors' point ids, each
+// followed by :distance if |withDists|.
+void writeResult(FILE* fp, const SearchResult& res, bool withDists) {
+  unsigned int n = res.offsets.size() - 1;
+  for (unsigned int q = 0; q < n; q++) {
+    for (unsigned int i = res.offsets[q]; i < res.offsets[q + 1]; i++) {
+      if (i != res.offsets[q]) fputc(',', fp);
+      if (withDists) fprintf(fp, "%u:%f", res.ids[i], res.dists[i]);
+      else fprintf(fp, "%u", res.ids[i]);
+    }
+    fputc('\n', fp);
+  }
+}
+
+// the multi-radius counterpart of |packResults|; see ShellResult. the rows
+// are laid out as described in Params.
+void packShells(RTNNState& state, ShellResult& res) {
+  Timing::startTiming("pack shells");
+    unsigned int numQueries = state.numOrigQueries;
+    unsigned int numShells = state.params.numShells;
+    res.numShells = numShells;
+    res.counts.clear();
+    res.offsets.clear();
+    res.ids.clear();
+
+    fetchPointIds(state);
+    std::vector<std::vector<unsigned int>> rowQIds = rowQueryIds(state);
+
+    if (state.params.shellCounts) {
+      res.counts.assign((size_t)numQueries * numShells, 0);
+      for (int b = 0; b < state.numOfBatches; b++) {
+        unsigned int* h_res = static_cast<unsigned int*>(state.h_res[b]);
+        for (unsigned int i = 0; i < rowQIds[b].size(); i++) {
+          std::copy(h_res + (size_t)i * state.knn, h_res + (size_t)i * state.knn + numShells,
+              res.counts.begin() + (size_t)rowQIds[b][i] * numShells);
+        }
+      }
+    } else {
+      // the row of each query, so that the CSR can be filled in query order
+      std::vector<const unsigned int*> rows(numQueries, nullptr);
+      for (int b = 0; b < state.numOfBatches; b++) {
+        unsigned int* h_res = static_cast<unsigned int*>(state.h_res[b]);
+        for (unsigned int i = 0; i < rowQIds[b].size(); i++)
+          rows[rowQIds[b][i]] = h_res + (size_t)i * state.knn;
+      }
+
+      res.offsets.reserve((size_t)numQueries * numShells + 1);
+      res.offsets.push_back(0);
+      for (unsigned int q = 0; q < numQueries; q++) {
+        for (unsigned int s = 0; s < numShells; s++) {
+          // a shell's slots are filled from the front
+          for (unsigned int j = 0; rows[q] && j < state.params.shellLimit[s]; j++) {
+            unsigned int p = rows[q][state.params.shellBase[s] + j];
+            if (p == UINT_MAX) break;
+            res.ids.push_back(origPointId(state, p));
+          }
+          res.offsets.push_back(res.ids.size());
+        }
+      }
+    }
+  Timing::stopTiming(true);
+}
+
+// KNN graph mode (-kg): the self search gives each point a list of directed
+// edges; the graph has an undirected edge between i and j if j is a neighbor
+// of i or i of j (union), or if both are (mutual). both directions of every
+// (non-self) edge are keyed by (source << 32 | target) on the device, from
+// the result rows and the id maps (|genEdges|), and merged by sorting; the
+// result is a CSR over the points in original order,
+// with each adjacency list sorted by id, and the distances if |withDists|.
+void packGraph(RTNNState& state, SearchResult& res, bool withDists) {
+  Timing::startTiming("pack graph");
+    // shards (the only users of idMap) can't build graphs
+    assert(state.idMap.empty());
+
+    // the rows go back up since -dp compacts them on the host
+    std::vector<thrust::device_ptr<unsigned int>> d_rows_ptr(state.numOfBatches);
+    std::vector<size_t> numBatchKeys(state.numOfBatches, 0);
+    size_t numKeys = 0;
+    for (int b = 0; b < state.numOfBatches; b++) {
+      size_t numSlots = (size_t)state.numActQueries[b] * state.knn;
+      if (numSlots == 0) continue;
+      allocThrustDevicePtr(&d_rows_ptr[b], numSlots);
+      thrust::copy(static_cast<unsigned int*>(state.h_res[b]), static_cast<unsigned int*>(state.h_res[b]) + numSlots, d_rows_ptr[b]);
+      numBatchKeys[b] = 2 * countEdges(thrust::raw_pointer_cast(d_rows_ptr[b]), state.numActQueries[b], state.knn,
+          state.trackIds ? state.d_actQIds[b] : nullptr, state.trackIds ? state.d_pointIds : nullptr);
+      numKeys += numBatchKeys[b];
+    }
+
+    unsigned int numNodes = state.numPoints;
+    thrust::device_ptr<unsigned long long> d_keys_ptr;
+    thrust::device_ptr<float> d_dists_ptr;
+    thrust::device_ptr<unsigned int> d_offsets_ptr, d_targets_ptr;
+    allocThrustDevicePtr(&d_keys_ptr, numKeys);
+    allocThrustDevicePtr(&d_dists_ptr, numKeys);
+    size_t numDone = 0;
+    for (int b = 0; b < state.numOfBatches; b++) {
+      if (d_rows_ptr[b].get() == nullptr) continue;
+      if (numBatchKeys[b])
+        genEdges(thrust::raw_pointer_cast(d_rows_ptr[b]), state.numActQueries[b], state.knn,
+            state.trackIds ? state.d_actQIds[b] : nullptr, state.trackIds ? state.d_pointIds : nullptr,
+            state.d_actQs[b], state.params.points,
+            thrust::raw_pointer_cast(d_keys_ptr) + numDone, thrust::raw_pointer_cast(d_dists_ptr) + numDone);
+      numDone += numBatchKeys[b];
+      CUDA_CHECK( cudaFree( thrust::raw_pointer_cast(d_rows_ptr[b]) ) );
+    }
+
+    size_t numEdges = mergeEdges(d_keys_ptr, d_dists_ptr, numKeys, state.graphMode == "mutual");
+
+    allocThrustDevicePtr(&d_offsets_ptr, numNodes + 1);
+    allocThrustDevicePtr(&d_targets_ptr, numEdges);
+    edgesToCSR(d_keys_ptr, numEdges, numNodes, d_offsets_ptr, d_targets_ptr);
+
+    res.offsets.resize(numNodes + 1);
+    res.ids.resize(numEdges);
+    thrust::copy(d_offsets_ptr, d_offsets_ptr + numNodes + 1, res.offsets.begin());
+    thrust::copy(d_targets_ptr, d_targets_ptr + numEdges, res.ids.begin());
+    if (withDists) {
+      res.dists.resize(numEdges);
+      thrust::copy(d_dists_ptr, d_dists_ptr + numEdges, res.dists.begin());
+      if (state.geoRadius > 0)
+        for (float& d : res.dists) d = geoDist(state, d);
+    } else res.dists.clear();
+
+    CUDA_CHECK( cudaFree( thrust::raw_pointer_cast(d_keys_ptr) ) );
+    CUDA_CHECK( cudaFree( thrust::raw_pointer_cast(d_dists_ptr) ) );
+    CUDA_CHECK( cudaFree( thrust::raw_pointer_cast(d_offsets_ptr) ) );
+    CUDA_CHECK( cudaFree( thrust::raw_pointer_cast(d_targets_ptr) ) );
+  Timing::stopTiming(true);
+}
+
+// one line per query (in input order): the counts of its shells separated by
+// commas, or the point ids of each shell separated by commas with shells
+// separated by semicolons. the neighbors within the s-th radius are the
+// first s+1 shells.
+void writeShells(FILE* fp, const ShellResult& res) {
+  bool counts = !res.counts.empty();
+  size_t numQueries = counts ? res.counts.size() / res.numShells : (res.offsets.size() - 1) / res.numShells;
+  for (size_t q = 0; q < numQueries; q++) {
+    for (unsigned int s = 0; s < res.numShells; s++) {
+      size_t c = q * res.numShells + s;
+      if (counts) {
+        fprintf(fp, s ? ",%u" : "%u", res.counts[c]);
+        continue;
+      }
+      if (s) fputc(';', fp);
+      for (unsigned int i = res.offsets[c]; i < res.offsets[c + 1]; i++)
+        fprintf(fp, (i != res.offsets[c]) ? ",%u" : "%u", res.ids[i]);
+    }
+    fputc('\n', fp);
+  }
+}
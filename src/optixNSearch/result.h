@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Compact search results: a CSR over the queries in their original (input)
+// order. The neighbors of query i are ids[offsets[i], offsets[i+1]), given as
+// original point ids (i.e., line numbers in the point file). |dists| is
+// either empty or parallel to |ids|.
+struct SearchResult
+{
+  std::vector<unsigned int> offsets;
+  std::vector<unsigned int> ids;
+  std::vector<float>        dists;
+};
+
+// multi-radius (shell) results over the same query order and point ids. shell
+// s holds the neighbors whose distance is in [radius[s-1], radius[s]). with
+// counts, counts[q * numShells + s] is the number of neighbors of query q in
+// shell s; otherwise the neighbors of query q in shell s are
+// ids[offsets[q * numShells + s], offsets[q * numShells + s + 1]).
+struct ShellResult
+{
+  unsigned int              numShells = 0;
+  std::vector<unsigned int> counts;
+  std::vector<unsigned int> offsets;
+  std::vector<unsigned int> ids;
+};
+
+// the raw rows of a finished search, taken out of the state (see |takeRows|)
+// so that they can be packed while the state goes on to other queries.
+// res[b] is the pinned host result of batch b, of |knn| entries per row, and
+// its row i belongs to original query rowQIds[b][i].
+struct SearchRows
+{
+  unsigned int                           numQueries = 0; // before filtering
+  unsigned int                           knn        = 0;
+  std::vector<unsigned int*>             res;
+  std::vector<std::vector<unsigned int>> rowQIds;
+};
+
+// lets the caller decide where packed neighbors go: called once the total
+// number of neighbors is known, it returns room for that many ids (and
+// distances, if asked for) or false if there's not enough.
+typedef std::function<bool(size_t, unsigned int**, float**)> ResultReserve;
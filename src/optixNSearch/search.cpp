@@ -1,11 +1,49 @@
 #include <sutil/Exception.h>
 #include <sutil/Timing.h>
 #include <thrust/device_vector.h>
+#include <thrust/copy.h>
+
+#include <algorithm>
+#include <climits>
+#include <utility>
+#include <vector>
 
 #include "optixNSearch.h"
 #include "state.h"
 #include "func.h"
 
+// the number of threads of a launch of |numQueries| rays: one per ray, except
+// for large-K KNN, whose threads each own a scratch row (see Params) and so
+// are capped at what the device runs at once. more threads would only wait
+// for a free SM, and their rows would multiply the memory of the result for
+// nothing; each thread traces its share of the rays in turn instead.
+unsigned int launchWidth(const RTNNState& state, unsigned int numQueries) {
+  if (K <= LARGE_K || state.searchMode != "knn") return numQueries;
+  return std::min(numQueries, state.residentThreads);
+}
+
+// point the launch at the scratch rows of large-K KNN (see Params) of the
+// batch's stream. batches on different streams may be in flight together,
+// so each stream has its own rows, which are kept across batches and
+// requests and only grow when a launch has more threads than they hold,
+// i.e., up to one row per resident thread.
+static void allocKnnScratch(RTNNState& state, int batch_id, unsigned int numQueries) {
+  if (K <= LARGE_K || state.searchMode != "knn") return;
+
+  unsigned int numRows = launchWidth(state, numQueries);
+  if (state.knnScratchRows[batch_id] < numRows) {
+    size_t numSlots = (size_t)numRows * KNN_SCRATCH;
+    // cudaFree waits for the stream's previous launch
+    CUDA_CHECK( cudaFree( state.d_knnKeys[batch_id] ) );
+    CUDA_CHECK( cudaFree( state.d_knnIds[batch_id] ) );
+    CUDA_CHECK( cudaMalloc( reinterpret_cast<void**>( &state.d_knnKeys[batch_id] ), numSlots * sizeof(float) ) );
+    CUDA_CHECK( cudaMalloc( reinterpret_cast<void**>( &state.d_knnIds[batch_id] ), numSlots * sizeof(unsigned int) ) );
+    state.knnScratchRows[batch_id] = numRows;
+  }
+  state.params.rowKeys = state.d_knnKeys[batch_id];
+  state.params.knnIds = state.d_knnIds[batch_id];
+}
+
 void search(RTNNState& state, int batch_id) {
   Timing::startTiming("batch search time");
     Timing::startTiming("search compute");
@@ -13,9 +51,10 @@ void search(RTNNState& state, int batch_id) {
 
       state.params.limit = state.knn;
       thrust::device_ptr<unsigned int> output_buffer;
-      allocThrustDevicePtr(&output_buffer, numQueries * state.params.limit, &state.d_pointers);
+      size_t numSlots = (size_t)numQueries * state.params.limit;
+      allocThrustDevicePtr(&output_buffer, numSlots, &state.d_pointers);
       // unused slots will become UINT_MAX
-      fillByValue(output_buffer, numQueries * state.params.limit, UINT_MAX);
+      fillByValue(output_buffer, numSlots, UINT_MAX);
 
       if (state.qGasSortMode && !state.toGather) state.params.d_r2q_map = state.d_r2q_map[batch_id];
       else state.params.d_r2q_map = nullptr; // if no GAS-sorting or has done gather, this map is null.
@@ -34,7 +73,26 @@ void search(RTNNState& state, int batch_id) {
         state.params.mode = AABBTEST;
       }
 
+      // the heaps of -tp closest
+      if (state.searchMode == "radius" && state.params.truncPolicy == TRUNC_CLOSEST) {
+        thrust::device_ptr<float> row_keys;
+        state.params.rowKeys = allocThrustDevicePtr(&row_keys, numSlots, &state.d_pointers);
+      }
+      allocKnnScratch(state, batch_id, numQueries);
+
       state.params.radius = state.launchRadius[batch_id];
+      if (state.params.histBins || state.params.aggAttrs || state.sph || state.params.ndChunks || state.params.nnDists)
+        state.params.queryIds = state.d_actQIds[batch_id];
+
+      if (state.sph) {
+        // the force pass reads the density of every neighbor, so the density
+        // pass must be complete first. SPH runs in a single batch.
+        state.params.sphPass = SPH_DENSITY;
+        launchSubframe( thrust::raw_pointer_cast(output_buffer), state, batch_id );
+        CUDA_CHECK( cudaStreamSynchronize( state.stream[batch_id] ) );
+        finishSphDensity(state);
+        state.params.sphPass = SPH_FORCE;
+      }
 
       launchSubframe( thrust::raw_pointer_cast(output_buffer), state, batch_id );
       OMIT_ON_E2EMSR( CUDA_CHECK( cudaStreamSynchronize( state.stream[batch_id] ) ) );
@@ -42,13 +100,13 @@ void search(RTNNState& state, int batch_id) {
 
     Timing::startTiming("result copy D2H");
       void* data;
-      cudaMallocHost(reinterpret_cast<void**>(&data), numQueries * state.params.limit * sizeof(unsigned int));
+      cudaMallocHost(reinterpret_cast<void**>(&data), numSlots * sizeof(unsigned int));
       state.h_res[batch_id] = data;
 
       CUDA_CHECK( cudaMemcpyAsync(
                       static_cast<void*>( data ),
                       thrust::raw_pointer_cast(output_buffer),
-                      numQueries * state.params.limit * sizeof(unsigned int),
+                      numSlots * sizeof(unsigned int),
                       cudaMemcpyDeviceToHost,
                       state.stream[batch_id]
                       ) );
@@ -105,3 +163,145 @@ void gasSortSearch(RTNNState& state, int batch_id) {
   if (state.toGather)
     gatherQueries( state, d_indices_ptr, batch_id );
 }
+
+// build the GAS of and search each batch. queries must have been sorted
+// and/or partitioned and points sorted by now.
+void searchBatches(RTNNState& state) {
+  // early free done here too
+  setupSearch(state);
+
+  if (state.interleave) {
+    for (int i = 0; i < state.numOfBatches; i++) {
+      // it's possible that certain batches have 0 query (e.g., state.partThd too low).
+      if (state.numActQueries[i] == 0) continue;
+	    // TODO: group buildGas together to allow overlapping; this would allow
+	    // us to batch-free temp storages and non-compacted gas storages. right
+	    // now free storage serializes gas building.
+      createGeometry (state, i, state.launchRadius[i]/state.gsrRatio); // batch_id ignored if not partition.
+    }
+
+    for (int i = 0; i < state.numOfBatches; i++) {
+      if (state.numActQueries[i] == 0) continue;
+      if (state.qGasSortMode) gasSortSearch(state, i);
+    }
+
+    for (int i = 0; i < state.numOfBatches; i++) {
+      if (state.numActQueries[i] == 0) continue;
+      if (state.qGasSortMode && state.gsrRatio != 1)
+        createGeometry (state, i, state.launchRadius[i]);
+    }
+
+    for (int i = 0; i < state.numOfBatches; i++) {
+      if (state.numActQueries[i] == 0) continue;
+      // TODO: when K is too big, we can't launch all rays together. split rays.
+      search(state, i);
+    }
+  } else {
+    for (int i = 0; i < state.numOfBatches; i++) {
+      if (state.numActQueries[i] == 0) continue;
+
+      // create the GAS using the current order of points and the launchRadius of the current batch.
+      // TODO: does it make sense to have per-batch |gsrRatio|?
+      createGeometry (state, i, state.launchRadius[i]/state.gsrRatio); // batch_id ignored if not partition.
+
+      if (state.qGasSortMode) {
+        gasSortSearch(state, i);
+        if (state.gsrRatio != 1)
+          createGeometry (state, i, state.launchRadius[i]);
+      }
+
+      search(state, i);
+    }
+  }
+}
+
+// certify-and-repair (-rp) for partitioned KNN: a query launched below the
+// full radius has the exact K neighbors if its row is full, since every point
+// closer than its Kth neighbor is within the launch radius and was seen. a
+// row that isn't full may be missing neighbors between the launch radius and
+// the full one, so those queries are searched again, in one extra launch at
+// the full radius on the GAS of the last batch (whose launch radius is the
+// full one), and their rows are replaced.
+void repairBatches(RTNNState& state) {
+  Timing::startTiming("certify and repair");
+    CUDA_SYNC_CHECK();
+
+    int last = state.numOfBatches - 1;
+    std::vector<std::pair<int, unsigned int>> rows; // (batch, row) of each uncertified query
+    std::vector<float3> repairQs;
+    std::vector<unsigned int> repairQIds;
+    unsigned int numChecked = 0;
+    for (int b = 0; b < last; b++) {
+      unsigned int numActQs = state.numActQueries[b];
+      if (numActQs == 0 || state.launchRadius[b] >= state.radius) continue;
+      numChecked += numActQs;
+
+      unsigned int* h_res = static_cast<unsigned int*>(state.h_res[b]);
+      std::vector<float3> batchQs;
+      std::vector<unsigned int> batchQIds;
+      for (unsigned int i = 0; i < numActQs; i++) {
+        if (h_res[(size_t)i * state.knn + state.knn - 1] != UINT_MAX) continue; // rows fill from the front
+
+        if (batchQs.empty()) {
+          batchQs.resize(numActQs);
+          thrust::copy(thrust::device_pointer_cast(state.d_actQs[b]),
+              thrust::device_pointer_cast(state.d_actQs[b]) + numActQs, batchQs.begin());
+          if (state.trackIds) {
+            batchQIds.resize(numActQs);
+            thrust::copy(thrust::device_pointer_cast(state.d_actQIds[b]),
+                thrust::device_pointer_cast(state.d_actQIds[b]) + numActQs, batchQIds.begin());
+          }
+        }
+        rows.push_back(std::make_pair(b, i));
+        repairQs.push_back(batchQs[i]);
+        if (state.trackIds) repairQIds.push_back(batchQIds[i]);
+      }
+    }
+
+    unsigned int numRepaired = rows.size();
+    if (numRepaired) {
+      // borrow the last batch; its GAS is only missing if it had no queries.
+      unsigned int lastNumQs = state.numActQueries[last];
+      float3* lastQs = state.d_actQs[last];
+      unsigned int* lastQIds = state.d_actQIds[last];
+      if (lastNumQs == 0) createGeometry(state, last, state.radius);
+
+      thrust::device_ptr<float3> d_repairQs;
+      state.d_actQs[last] = allocThrustDevicePtr(&d_repairQs, numRepaired, &state.d_pointers);
+      thrust::copy(repairQs.begin(), repairQs.end(), d_repairQs);
+      if (state.trackIds) {
+        thrust::device_ptr<unsigned int> d_repairQIds;
+        state.d_actQIds[last] = allocThrustDevicePtr(&d_repairQIds, numRepaired, &state.d_pointers);
+        thrust::copy(repairQIds.begin(), repairQIds.end(), d_repairQIds);
+        state.params.queryIds = state.d_actQIds[last];
+      }
+      state.numActQueries[last] = numRepaired;
+
+      state.params.limit = state.knn;
+      state.params.d_r2q_map = nullptr;
+      state.params.mode = PRECISE;
+      state.params.radius = state.radius;
+      thrust::device_ptr<unsigned int> output_buffer;
+      allocThrustDevicePtr(&output_buffer, (size_t)numRepaired * state.knn, &state.d_pointers);
+      fillByValue(output_buffer, (size_t)numRepaired * state.knn, UINT_MAX);
+      allocKnnScratch(state, last, numRepaired);
+      launchSubframe( thrust::raw_pointer_cast(output_buffer), state, last );
+      CUDA_CHECK( cudaStreamSynchronize( state.stream[last] ) );
+
+      std::vector<unsigned int> res((size_t)numRepaired * state.knn);
+      thrust::copy(output_buffer, output_buffer + res.size(), res.begin());
+      for (unsigned int k = 0; k < numRepaired; k++) {
+        unsigned int* h_res = static_cast<unsigned int*>(state.h_res[rows[k].first]);
+        std::copy(res.begin() + (size_t)k * state.knn, res.begin() + (size_t)(k + 1) * state.knn,
+            h_res + (size_t)rows[k].second * state.knn);
+      }
+
+      state.numActQueries[last] = lastNumQs;
+      state.d_actQs[last] = lastQs;
+      state.d_actQIds[last] = lastQIds;
+    }
+  Timing::stopTiming(true);
+
+  fprintf(stdout, "\tCertified %u of %u queries launched below the full radius, repaired %u\n",
+      numChecked - numRepaired, numChecked, numRepaired);
+}
@@ -0,0 +1,438 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "result.h"
+#include "protocol.h"
+
+// refuse absurd requests instead of trying to allocate for them.
+static const uint32_t kMaxReqQueries = 1u << 28;
+// the largest K of a radius-mode request (-smk); set before any connection.
+static unsigned int maxReqKnn;
+
+// a request waiting for the engine. where its queries come from and where
+// its result goes depend on the transport (socket or shared memory).
+struct PendingReq
+{
+  RTNNReqHeader                         hdr;
+  float3*                               queries;
+  unsigned int*                         offsets;  // numQueries + 1
+  ResultReserve                         reserve;  // room for the neighbors
+  std::function<void(int, size_t)>      complete; // called with the status and the number of neighbors
+  std::chrono::steady_clock::time_point arrival;
+};
+
+// the GPU side (state, pipelines, streams) is single-tenant, so all requests
+// are served by one engine thread. small requests are dominated by the fixed
+// per-search costs (sorting, partitioning, GAS builds, launches), so the
+// engine coalesces compatible requests (same mode, radius and K) that arrive
+// within |coalesceDelay| us of the oldest one into one search, up to
+// |coalesceQueries| queries, and scatters the results back.
+static std::mutex                  queueMutex;
+static std::condition_variable     queueCv; // wakes the engine
+static std::condition_variable     doneCv;  // wakes the socket connections
+static std::deque<PendingReq*>     pending;
+
+// the result of a search is sized by numQueries * knn, so a radius-mode K
+// is capped by -smk and the product must fit in 32 bits.
+static bool fitsResult( unsigned long long numQueries, unsigned int knn ) {
+  return numQueries * knn <= UINT_MAX;
+}
+
+static int checkRequest( const RTNNReqHeader& req, unsigned int maxKnn ) {
+  if (req.magic != RTNN_REQ_MAGIC || req.numQueries == 0 || req.numQueries > kMaxReqQueries) return RTNN_ERR_REQUEST;
+  if (req.mode != RTNN_REQ_RADIUS && req.mode != RTNN_REQ_KNN) return RTNN_ERR_REQUEST;
+  if (req.knn == 0 || !(req.radius > 0)) return RTNN_ERR_REQUEST;
+  if (req.mode == RTNN_REQ_KNN && req.knn > K) return RTNN_ERR_KNN;
+  if (req.mode == RTNN_REQ_RADIUS && req.knn > maxKnn) return RTNN_ERR_REQUEST;
+  if (!fitsResult(req.numQueries, (req.mode == RTNN_REQ_KNN) ? K : req.knn)) return RTNN_ERR_REQUEST;
+  return RTNN_OK;
+}
+
+// search one request against the resident points. |queries| are in the
+// client's order; the result is in the same order.
+static int serveRequest( RTNNState& state, const RTNNReqHeader& req, float3* queries, int numOfBatches, unsigned int* offsets, const ResultReserve& reserve ) {
+  std::string searchMode = (req.mode == RTNN_REQ_KNN) ? "knn" : "radius";
+  if (searchMode != state.searchMode) {
+    state.searchMode = searchMode;
+    rebuildPipeline(state);
+  }
+
+  state.knn = (req.mode == RTNN_REQ_KNN) ? K : req.knn;
+  state.radius = req.radius;
+  state.params.radius = req.radius;
+  state.numOfBatches = numOfBatches;
+
+  bool fits;
+  Timing::startTiming("serve request");
+    fits = searchQueries(state, queries, req.numQueries,
+        (req.mode == RTNN_REQ_KNN) ? req.knn : UINT_MAX,
+        req.flags & RTNN_FLAG_DISTS, offsets, reserve);
+  Timing::stopTiming(true);
+
+  return fits ? RTNN_OK : RTNN_ERR_CAPACITY;
+}
+
+static bool sendResult( int fd, const RTNNResHeader& hdr, const SearchResult& res ) {
+  if (!writeFull(fd, &hdr, sizeof(hdr))) return false;
+  if (hdr.status != RTNN_OK) return true;
+
+  if (!writeFull(fd, res.offsets.data(), res.offsets.size() * sizeof(unsigned int))) return false;
+  if (!writeFull(fd, res.ids.data(), res.ids.size() * sizeof(unsigned int))) return false;
+  if (hdr.flags & RTNN_FLAG_DISTS)
+    if (!writeFull(fd, res.dists.data(), res.dists.size() * sizeof(float))) return false;
+  return true;
+}
+
+static bool canMerge( const RTNNReqHeader& a, const RTNNReqHeader& b ) {
+  return a.mode == b.mode && a.knn == b.knn && a.radius == b.radius;
+}
+
+// serve a group of compatible requests as one search and give each its slice
+// of the result.
+static void serveGroup( RTNNState& state, std::vector<PendingReq*>& group, int numOfBatches ) {
+  if (group.size() == 1) {
+    PendingReq* req = group[0];
+    int status = serveRequest(state, req->hdr, req->queries, numOfBatches, req->offsets, req->reserve);
+    req->complete(status, req->offsets[req->hdr.numQueries]);
+    return;
+  }
+
+  RTNNReqHeader hdr = group[0]->hdr;
+  hdr.numQueries = 0;
+  hdr.flags = 0;
+  for (auto req : group) {
+    hdr.numQueries += req->hdr.numQueries;
+    hdr.flags |= req->hdr.flags;
+  }
+
+  std::vector<float3> queries;
+  queries.reserve(hdr.numQueries);
+  for (auto req : group)
+    queries.insert(queries.end(), req->queries, req->queries + req->hdr.numQueries);
+
+  SearchResult merged;
+  merged.offsets.resize(hdr.numQueries + 1);
+  int status = serveRequest(state, hdr, queries.data(), numOfBatches, merged.offsets.data(), reserveIn(merged));
+  fprintf(stdout, "\tCoalesced %zu requests, %u queries\n", group.size(), hdr.numQueries);
+
+  unsigned int qBase = 0;
+  for (auto req : group) {
+    unsigned int n = req->hdr.numQueries;
+    unsigned int start = merged.offsets[qBase];
+    unsigned int count = merged.offsets[qBase + n] - start;
+    for (unsigned int q = 0; q <= n; q++) req->offsets[q] = merged.offsets[qBase + q] - start;
+
+    int reqStatus = status;
+    if (status == RTNN_OK) {
+      bool withDists = req->hdr.flags & RTNN_FLAG_DISTS;
+      unsigned int* ids = nullptr;
+      float* dists = nullptr;
+      if (req->reserve(count, &ids, withDists ? &dists : nullptr)) {
+        std::copy(merged.ids.begin() + start, merged.ids.begin() + start + count, ids);
+        if (withDists) std::copy(merged.dists.begin() + start, merged.dists.begin() + start + count, dists);
+      } else reqStatus = RTNN_ERR_CAPACITY;
+    }
+    req->complete(reqStatus, count);
+    qBase += n;
+  }
+}
+
+static void engineLoop( RTNNState& state, int numOfBatches ) {
+  std::chrono::microseconds delay(state.coalesceDelay);
+  std::vector<PendingReq*> group;
+
+  while (true) {
+    group.clear();
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueCv.wait(lock, []{ return !pending.empty(); });
+
+      // wait for the oldest request's deadline unless enough compatible
+      // queries have queued up already.
+      auto deadline = pending.front()->arrival + delay;
+      while (state.coalesceQueries > 0) {
+        unsigned long long total = 0;
+        for (auto req : pending)
+          if (canMerge(req->hdr, pending.front()->hdr)) total += req->hdr.numQueries;
+        if (total >= state.coalesceQueries) break;
+        if (queueCv.wait_until(lock, deadline) == std::cv_status::timeout) break;
+      }
+
+      // take the oldest request and, in arrival order, whatever fits with it.
+      unsigned long long total = 0;
+      RTNNReqHeader head = pending.front()->hdr;
+      for (auto it = pending.begin(); it != pending.end(); ) {
+        unsigned int n = (*it)->hdr.numQueries;
+        bool fits = group.empty() ||
+            (state.coalesceQueries > 0 && total + n <= state.coalesceQueries && total + n <= kMaxReqQueries &&
+             fitsResult(total + n, (head.mode == RTNN_REQ_KNN) ? K : head.knn));
+        if (canMerge((*it)->hdr, head) && fits) {
+          group.push_back(*it);
+          total += n;
+          it = pending.erase(it);
+        } else it++;
+      }
+    }
+
+    try
+    {
+      serveGroup(state, group, numOfBatches);
+    }
+    catch( std::exception& e )
+    {
+      // a CUDA/OptiX error leaves the device state unknown; don't limp along.
+      std::cerr << "Caught exception: " << e.what() << "\n";
+      exit(1);
+    }
+  }
+}
+
+static void enqueue( PendingReq* req ) {
+  req->arrival = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    pending.push_back(req);
+  }
+  queueCv.notify_one();
+}
+
+// serve the requests a client posts to its shm segment until |fd| closes.
+// queries are read and results written in place, so nothing but the slot
+// headers crosses the socket or gets copied between the processes.
+static void serveShm( int fd, const std::string& name, int deviceId ) {
+  RTNNResHeader ack;
+  ack.magic = RTNN_RES_MAGIC;
+  ack.status = RTNN_OK;
+  ack.flags = 0;
+  ack.numQueries = 0;
+  ack.numNeighbors = 0;
+
+  void* base = MAP_FAILED;
+  struct stat st;
+  int shmFd = shm_open(name.c_str(), O_RDWR, 0);
+  if (shmFd >= 0 && fstat(shmFd, &st) == 0 && (size_t)st.st_size >= sizeof(RTNNShmHeader))
+    base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+  if (shmFd >= 0) close(shmFd);
+
+  // the geometry is copied so that a misbehaving client can't change it under us.
+  RTNNShmHeader geom;
+  if (base != MAP_FAILED) geom = *static_cast<RTNNShmHeader*>(base);
+  if (base == MAP_FAILED || geom.magic != RTNN_SHM_MAGIC || geom.numSlots == 0 ||
+      geom.slotQueries == 0 || rtnnShmSize(geom) > (size_t)st.st_size) {
+    fprintf(stderr, "can't attach shm segment %s\n", name.c_str());
+    if (base != MAP_FAILED) munmap(base, st.st_size);
+    ack.status = RTNN_ERR_SHM;
+    writeFull(fd, &ack, sizeof(ack));
+    close(fd);
+    return;
+  }
+  size_t size = st.st_size;
+
+  // pin the segment so that query uploads are DMA'd straight from it; it's
+  // only an optimization, so failing is fine.
+  CUDA_CHECK( cudaSetDevice( deviceId ) );
+  bool pinned = (cudaHostRegister(base, size, cudaHostRegisterDefault) == cudaSuccess);
+  if (!pinned) cudaGetLastError();
+
+  fprintf(stdout, "Attached shm segment %s: %u slots, %u queries, %u neighbors each\n",
+      name.c_str(), geom.numSlots, geom.slotQueries, geom.slotNeighbors);
+  fflush(stdout);
+  if (!writeFull(fd, &ack, sizeof(ack))) {
+    if (pinned) cudaHostUnregister(base);
+    munmap(base, size);
+    close(fd);
+    return;
+  }
+
+  std::atomic<bool> stop(false);
+  std::atomic<unsigned int> inflight(0);
+
+  std::thread poller([&]() {
+    RTNNShmHeader* shm = static_cast<RTNNShmHeader*>(base);
+    uint32_t served = 0;
+    while (!stop) {
+      uint32_t posted = __atomic_load_n(&shm->posted, __ATOMIC_ACQUIRE);
+      if (posted == served) {
+        futexWait(&shm->posted, served, 100); // wake up now and then to check |stop|
+        continue;
+      }
+
+      for (; served != posted; served++) {
+        uint32_t seq = served;
+        RTNNShmSlot* slot = rtnnShmSlot(base, seq % geom.numSlots);
+        auto complete = [slot, seq, &inflight](int status, size_t numNeighbors) {
+          slot->res.magic = RTNN_RES_MAGIC;
+          slot->res.status = status;
+          slot->res.flags = slot->req.flags;
+          slot->res.numQueries = slot->req.numQueries;
+          slot->res.numNeighbors = numNeighbors;
+          __atomic_store_n(&slot->done, seq + 1, __ATOMIC_RELEASE);
+          futexWake(&slot->done);
+          inflight--;
+        };
+        inflight++;
+
+        PendingReq* req = new PendingReq;
+        req->hdr = slot->req;
+        int status = checkRequest(req->hdr, maxReqKnn);
+        if (status == RTNN_OK && req->hdr.numQueries > geom.slotQueries) status = RTNN_ERR_REQUEST;
+        if (status != RTNN_OK) {
+          delete req;
+          complete(status, 0);
+          continue;
+        }
+
+        uint32_t s = seq % geom.numSlots;
+        req->queries = reinterpret_cast<float3*>(rtnnShmQueries(base, s));
+        req->offsets = rtnnShmOffsets(base, s);
+        req->reserve = [base, s, geom](size_t numNeighbors, unsigned int** ids, float** dists) {
+          if (numNeighbors > geom.slotNeighbors) return false;
+          *ids = rtnnShmIds(base, s);
+          if (dists) *dists = rtnnShmDists(base, s);
+          return true;
+        };
+        req->complete = [req, complete](int status, size_t numNeighbors) {
+          complete(status, numNeighbors);
+          delete req;
+        };
+        enqueue(req);
+      }
+    }
+  });
+
+  // the socket carries nothing more; its closing ends the attachment.
+  char c;
+  while (read(fd, &c, 1) > 0) {}
+  stop = true;
+  poller.join();
+  while (inflight > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  if (pinned) cudaHostUnregister(base);
+  munmap(base, size);
+  close(fd);
+  fprintf(stdout, "Detached shm segment %s\n", name.c_str());
+}
+
+static void handleClient( int fd, int deviceId ) {
+  RTNNReqHeader req;
+  std::vector<float3> queries;
+  SearchResult res;
+
+  while (readFull(fd, &req, sizeof(req))) {
+    if (req.magic == RTNN_REQ_MAGIC && req.mode == RTNN_REQ_ATTACH && req.numQueries > 0 && req.numQueries < 256) {
+      std::string name(req.numQueries, '\0');
+      if (!readFull(fd, &name[0], req.numQueries)) break;
+      serveShm(fd, name, deviceId);
+      return;
+    }
+
+    RTNNResHeader hdr;
+    hdr.magic = RTNN_RES_MAGIC;
+    hdr.status = checkRequest(req, maxReqKnn);
+    hdr.flags = req.flags;
+    hdr.numQueries = req.numQueries;
+    hdr.numNeighbors = 0;
+
+    if (req.magic != RTNN_REQ_MAGIC || req.numQueries == 0 || req.numQueries > kMaxReqQueries) {
+      writeFull(fd, &hdr, sizeof(hdr));
+      break; // can't tell where the next request starts
+    }
+
+    queries.resize(req.numQueries);
+    if (!readFull(fd, queries.data(), req.numQueries * sizeof(float3))) break;
+
+    if (hdr.status == RTNN_OK) {
+      bool done = false;
+      PendingReq p;
+      p.hdr = req;
+      p.queries = queries.data();
+      res.offsets.resize(req.numQueries + 1);
+      p.offsets = res.offsets.data();
+      p.reserve = reserveIn(res);
+      p.complete = [&](int status, size_t numNeighbors) {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        hdr.status = status;
+        hdr.numNeighbors = numNeighbors;
+        done = true;
+        doneCv.notify_all();
+      };
+      enqueue(&p);
+
+      std::unique_lock<std::mutex> lock(queueMutex);
+      doneCv.wait(lock, [&done]{ return done; });
+    }
+
+    if (!sendResult(fd, hdr, res)) break;
+  }
+
+  close(fd);
+}
+
+static void acceptLoop( int sock, int deviceId ) {
+  while (true) {
+    int fd = accept(sock, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      exit(1);
+    }
+    std::thread(handleClient, fd, deviceId).detach();
+  }
+}
+
+void runServer( RTNNState& state ) {
+  loadIndex(state);
+  int numOfBatches = state.numOfBatches;
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    exit(1);
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (state.serverSock.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", state.serverSock.c_str());
+    exit(1);
+  }
+  strncpy(addr.sun_path, state.serverSock.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(addr.sun_path);
+
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+    perror("bind/listen");
+    exit(1);
+  }
+  // a client hanging up mid-response shouldn't kill the server
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stdout, "Listening on %s\n", addr.sun_path);
+  fflush(stdout);
+
+  // connections are accepted on the side; the GPU work stays on this thread.
+  maxReqKnn = state.serverMaxKnn;
+  std::thread(acceptLoop, sock, state.device_id).detach();
+  engineLoop(state, numOfBatches);
+}
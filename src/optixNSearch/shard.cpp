@@ -0,0 +1,350 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+#include "result.h"
+#include "protocol.h"
+
+// Sharded server (--shards): the domain is cut into slabs along its longest
+// axis, each holding about the same number of points, and each slab is
+// served by its own worker process (a regular server, see server.cpp) that
+// holds the slab's points plus a halo of width |radius| on both sides. The
+// coordinator process owns the client-facing socket and routes each query to
+// the shard whose slab contains it, which is exact as long as the request
+// radius doesn't exceed the halo. Otherwise the query is fanned out to every
+// shard whose slab is within the request radius and the per-shard results
+// are merged: duplicates (points in several halos) are dropped and the K
+// nearest are kept. The coordinator never touches CUDA; workers are forked
+// before anyone initializes it.
+
+struct ShardMap
+{
+  int                      axis;
+  std::vector<float>       lo, hi; // slab i owns [lo[i], hi[i])
+  float                    halo;
+  std::vector<std::string> socks;
+};
+
+static float axisCoord( const float3& p, int axis ) {
+  return (axis == 0) ? p.x : ((axis == 1) ? p.y : p.z);
+}
+
+static int connectTo( const std::string& path ) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+  if (fd >= 0) close(fd);
+  return -1;
+}
+
+static void runShard( RTNNState& state, const ShardMap& map, int shard ) {
+  // don't outlive the coordinator
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+  float lo = map.lo[shard] - map.halo;
+  float hi = map.hi[shard] + map.halo;
+  std::vector<float3> points;
+  for (unsigned int i = 0; i < state.numPoints; i++) {
+    float c = axisCoord(state.h_points[i], map.axis);
+    if (c >= lo && c < hi) {
+      points.push_back(state.h_points[i]);
+      state.idMap.push_back(i);
+    }
+  }
+  fprintf(stdout, "Shard %d: %zu points (including halo)\n", shard, points.size());
+
+  // the whole cloud came with the fork; only the slab is needed from now on.
+  delete[] state.h_points;
+  state.h_points = points.data();
+  state.h_queries = state.h_points;
+  state.numPoints = state.numQueries = points.size();
+  state.serverSock = map.socks[shard];
+  state.device_id += shard % state.shardDevices;
+  state.numShards = 0;
+
+  try
+  {
+    setDevice(state);
+    Timing::reset();
+    runServer(state);
+  }
+  catch( std::exception& e )
+  {
+    std::cerr << "Caught exception: " << e.what() << "\n";
+    exit(1);
+  }
+  exit(0);
+}
+
+static bool readResult( int fd, RTNNResHeader& hdr, SearchResult& res ) {
+  if (!readFull(fd, &hdr, sizeof(hdr)) || hdr.magic != RTNN_RES_MAGIC) return false;
+  if (hdr.status != RTNN_OK) return true;
+
+  res.offsets.resize(hdr.numQueries + 1);
+  res.ids.resize(hdr.numNeighbors);
+  res.dists.resize((hdr.flags & RTNN_FLAG_DISTS) ? hdr.numNeighbors : 0);
+  return readFull(fd, res.offsets.data(), res.offsets.size() * sizeof(unsigned int)) &&
+         readFull(fd, res.ids.data(), res.ids.size() * sizeof(unsigned int)) &&
+         readFull(fd, res.dists.data(), res.dists.size() * sizeof(float));
+}
+
+// a shard connection with a response still in flight can't be reused: the
+// next request would read the stale response. close it instead; it's
+// reconnected on demand.
+static void dropShard( std::vector<int>& shardFds, int s ) {
+  if (shardFds[s] >= 0) close(shardFds[s]);
+  shardFds[s] = -1;
+}
+
+// route one request to the shards, and merge their results into |res|.
+// returns the status.
+static int routeRequest( const ShardMap& map, std::vector<int>& shardFds, const RTNNReqHeader& req, const float3* queries, SearchResult& res ) {
+  int numShards = map.lo.size();
+  bool fanOut = req.radius > map.halo;
+  bool withDists = req.flags & RTNN_FLAG_DISTS;
+
+  // which request queries each shard gets
+  std::vector<std::vector<unsigned int>> subQIds(numShards);
+  for (unsigned int q = 0; q < req.numQueries; q++) {
+    float c = axisCoord(queries[q], map.axis);
+    if (!fanOut) {
+      int owner = std::upper_bound(map.lo.begin() + 1, map.lo.end(), c) - map.lo.begin() - 1;
+      subQIds[owner].push_back(q);
+    } else {
+      for (int s = 0; s < numShards; s++)
+        if (c >= map.lo[s] - req.radius && c < map.hi[s] + req.radius) subQIds[s].push_back(q);
+    }
+  }
+
+  // send all sub-requests before reading any response so the shards work in
+  // parallel. on a failure, the shards already sent to are dropped.
+  std::vector<float3> subQs;
+  int numSent = 0;
+  for (int s = 0; s < numShards; s++) {
+    if (subQIds[s].empty()) continue;
+    if (shardFds[s] < 0) shardFds[s] = connectTo(map.socks[s]);
+    if (shardFds[s] < 0) {
+      for (int t = 0; t < numSent; t++) if (!subQIds[t].empty()) dropShard(shardFds, t);
+      return RTNN_ERR_REQUEST;
+    }
+
+    RTNNReqHeader sub = req;
+    sub.numQueries = subQIds[s].size();
+    // merging needs distances
+    if (fanOut) sub.flags |= RTNN_FLAG_DISTS;
+    subQs.resize(sub.numQueries);
+    for (unsigned int j = 0; j < sub.numQueries; j++) subQs[j] = queries[subQIds[s][j]];
+    numSent = s + 1;
+    if (!writeFull(shardFds[s], &sub, sizeof(sub)) ||
+        !writeFull(shardFds[s], subQs.data(), subQs.size() * sizeof(float3))) {
+      for (int t = 0; t < numSent; t++) if (!subQIds[t].empty()) dropShard(shardFds, t);
+      return RTNN_ERR_REQUEST;
+    }
+  }
+
+  // read every response, even after a failure, so that no connection is
+  // left with one pending.
+  int status = RTNN_OK;
+  std::vector<SearchResult> subRes(numShards);
+  for (int s = 0; s < numShards; s++) {
+    if (subQIds[s].empty()) continue;
+    RTNNResHeader hdr;
+    if (!readResult(shardFds[s], hdr, subRes[s])) {
+      dropShard(shardFds, s);
+      status = RTNN_ERR_REQUEST;
+    }
+    else if (hdr.status != RTNN_OK && status == RTNN_OK) status = hdr.status;
+  }
+  if (status != RTNN_OK) return status;
+
+  // each query's neighbors from each shard it went to, as (dist, id)
+  std::vector<std::vector<std::pair<float, unsigned int>>> cands(req.numQueries);
+  for (int s = 0; s < numShards; s++) {
+    const SearchResult& r = subRes[s];
+    for (unsigned int j = 0; j < subQIds[s].size(); j++) {
+      auto& c = cands[subQIds[s][j]];
+      for (unsigned int k = r.offsets[j]; k < r.offsets[j + 1]; k++)
+        c.push_back(std::make_pair(r.dists.empty() ? 0.0f : r.dists[k], r.ids[k]));
+    }
+  }
+
+  res.offsets.assign(req.numQueries + 1, 0);
+  res.ids.clear();
+  res.dists.clear();
+  for (unsigned int q = 0; q < req.numQueries; q++) {
+    auto& c = cands[q];
+    if (fanOut) {
+      // k-way merge of the shards' lists: nearest first, each point once.
+      // a point seen by several shards has the same distance in each, so
+      // its copies end up adjacent.
+      std::sort(c.begin(), c.end());
+      c.erase(std::unique(c.begin(), c.end()), c.end());
+      if (c.size() > req.knn) c.resize(req.knn);
+    }
+    for (auto& p : c) {
+      res.ids.push_back(p.second);
+      if (withDists) res.dists.push_back(p.first);
+    }
+    res.offsets[q + 1] = res.ids.size();
+  }
+  return RTNN_OK;
+}
+
+static void handleCoordClient( const ShardMap* map, int fd ) {
+  std::vector<int> shardFds(map->lo.size(), -1);
+  RTNNReqHeader req;
+  std::vector<float3> queries;
+  SearchResult res;
+
+  while (readFull(fd, &req, sizeof(req))) {
+    RTNNResHeader hdr;
+    hdr.magic = RTNN_RES_MAGIC;
+    hdr.status = RTNN_OK;
+    hdr.flags = req.flags;
+    hdr.numQueries = req.numQueries;
+    hdr.numNeighbors = 0;
+
+    // shared memory would have to be forwarded to every shard; not supported.
+    if (req.magic != RTNN_REQ_MAGIC || req.mode == RTNN_REQ_ATTACH || req.numQueries == 0) {
+      hdr.status = (req.mode == RTNN_REQ_ATTACH) ? RTNN_ERR_SHM : RTNN_ERR_REQUEST;
+      writeFull(fd, &hdr, sizeof(hdr));
+      break;
+    }
+
+    queries.resize(req.numQueries);
+    if (!readFull(fd, queries.data(), req.numQueries * sizeof(float3))) break;
+
+    hdr.status = routeRequest(*map, shardFds, req, queries.data(), res);
+    if (hdr.status == RTNN_OK) hdr.numNeighbors = res.ids.size();
+
+    bool ok = writeFull(fd, &hdr, sizeof(hdr));
+    if (ok && hdr.status == RTNN_OK) {
+      ok = writeFull(fd, res.offsets.data(), res.offsets.size() * sizeof(unsigned int)) &&
+           writeFull(fd, res.ids.data(), res.ids.size() * sizeof(unsigned int));
+      if (ok && (hdr.flags & RTNN_FLAG_DISTS))
+        ok = writeFull(fd, res.dists.data(), res.dists.size() * sizeof(float));
+    }
+    if (!ok) break;
+  }
+
+  for (int sfd : shardFds) if (sfd >= 0) close(sfd);
+  close(fd);
+}
+
+void runShardedServer( RTNNState& state ) {
+  int numShards = state.numShards;
+
+  // slab along the longest axis, cut at point-count quantiles
+  float3 pMin = make_float3(FLT_MAX, FLT_MAX, FLT_MAX);
+  float3 pMax = make_float3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for (unsigned int i = 0; i < state.numPoints; i++) {
+    pMin = fminf(pMin, state.h_points[i]);
+    pMax = fmaxf(pMax, state.h_points[i]);
+  }
+  float3 extent = pMax - pMin;
+
+  ShardMap map;
+  map.axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+  map.halo = state.radius;
+
+  std::vector<float> cuts;
+  {
+    std::vector<float> coords(state.numPoints);
+    for (unsigned int i = 0; i < state.numPoints; i++) coords[i] = axisCoord(state.h_points[i], map.axis);
+    for (int s = 1; s < numShards; s++) {
+      size_t k = (size_t)state.numPoints * s / numShards;
+      std::nth_element(coords.begin(), coords.begin() + k, coords.end());
+      cuts.push_back(coords[k]);
+    }
+  }
+  std::sort(cuts.begin(), cuts.end());
+
+  for (int s = 0; s < numShards; s++) {
+    map.lo.push_back(s == 0 ? -FLT_MAX : cuts[s - 1]);
+    map.hi.push_back(s == numShards - 1 ? FLT_MAX : cuts[s]);
+    map.socks.push_back(state.serverSock + ".shard" + std::to_string(s));
+    fprintf(stdout, "Shard %d: axis %d in [%f, %f), halo %f\n", s, map.axis, map.lo[s], map.hi[s], map.halo);
+  }
+
+  std::vector<pid_t> workers;
+  for (int s = 0; s < numShards; s++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(1);
+    }
+    if (pid == 0) runShard(state, map, s); // never returns
+    workers.push_back(pid);
+  }
+  // every worker has its copy now; the router only needs the cuts.
+  delete[] state.h_points;
+  state.h_points = state.h_queries = nullptr;
+
+  // wait until every shard has loaded its points and listens
+  for (int s = 0; s < numShards; s++) {
+    int fd;
+    while ((fd = connectTo(map.socks[s])) < 0) {
+      int wstatus;
+      if (waitpid(workers[s], &wstatus, WNOHANG) == workers[s]) {
+        fprintf(stderr, "shard %d exited during startup\n", s);
+        exit(1);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    close(fd);
+  }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (sock < 0 || state.serverSock.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "can't create socket %s\n", state.serverSock.c_str());
+    exit(1);
+  }
+  strncpy(addr.sun_path, state.serverSock.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(addr.sun_path);
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+    perror("bind/listen");
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stdout, "Listening on %s with %d shards\n", addr.sun_path, numShards);
+  fflush(stdout);
+
+  while (true) {
+    int fd = accept(sock, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      break;
+    }
+    std::thread(handleCoordClient, &map, fd).detach();
+  }
+
+  for (pid_t pid : workers) kill(pid, SIGTERM);
+  close(sock);
+  unlink(addr.sun_path);
+}
@@ -0,0 +1,158 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+
+// Index snapshots (-si/-li): the resident points of |loadIndex| after
+// sorting, together with their permutation (the original id of each sorted
+// point), the bounds, the tuned crRatio and the sort that produced them. Restoring maps the file and
+// uploads the two arrays as they are; nothing is parsed, reduced or sorted.
+//
+// Layout: an IndexHeader, then the sorted points and their ids, each section
+// page-aligned so that the host points can be used straight from the mapping.
+
+#define RTNN_INDEX_MAGIC   "RTNNIDX"
+#define RTNN_INDEX_VERSION 1
+#define RTNN_INDEX_ALIGN   4096
+
+struct IndexHeader
+{
+  char               magic[8];
+  unsigned int       version;
+  unsigned int       numPoints;
+  int                pointSortMode;
+  int                mcScale;
+  float              radius;   // the crRatio was tuned for this radius
+  float              crRatio;
+  float3             pMin;
+  float3             pMax;
+  unsigned long long pointsOffset;
+  unsigned long long idsOffset;
+  unsigned long long size;
+};
+
+static unsigned long long alignUp( unsigned long long x ) {
+  return (x + RTNN_INDEX_ALIGN - 1) / RTNN_INDEX_ALIGN * RTNN_INDEX_ALIGN;
+}
+
+// map the snapshot and make its (sorted) points the host points. called in
+// place of reading the point file.
+void mapIndex( RTNNState& state ) {
+  int fd = open(state.indexIn.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+    fprintf(stderr, "can't read index %s\n", state.indexIn.c_str());
+    exit(1);
+  }
+
+  // private and writable so that the host points behave like read-in ones;
+  // pages are only copied if something writes to them.
+  void* map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  const IndexHeader* hdr = static_cast<const IndexHeader*>(map);
+  if (strncmp(hdr->magic, RTNN_INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != RTNN_INDEX_VERSION || hdr->size != (unsigned long long)st.st_size) {
+    fprintf(stderr, "%s isn't an index of this version\n", state.indexIn.c_str());
+    exit(1);
+  }
+
+  state.indexMap = map;
+  state.numPoints = hdr->numPoints;
+  state.h_points = reinterpret_cast<float3*>(static_cast<char*>(map) + hdr->pointsOffset);
+
+  // the points are in the order of the sort that saved them, so that is the
+  // resident sort. jobs take it as their default, and only re-sort if they
+  // ask for another one.
+  if (hdr->pointSortMode != state.pointSortMode || hdr->mcScale != state.mcScale)
+    fprintf(stdout, "\tIndex was sorted with -ps %d -mc %d, which replace -ps %d -mc %d\n",
+        hdr->pointSortMode, hdr->mcScale, state.pointSortMode, state.mcScale);
+  state.pointSortMode = hdr->pointSortMode;
+  state.mcScale = hdr->mcScale;
+}
+
+// the device side of |loadIndex| for a mapped snapshot: upload the sorted
+// points and their ids and take the bounds and crRatio as they were.
+void restoreIndex( RTNNState& state ) {
+  const IndexHeader* hdr = static_cast<const IndexHeader*>(state.indexMap);
+  const unsigned int* h_ids = reinterpret_cast<const unsigned int*>(static_cast<const char*>(state.indexMap) + hdr->idsOffset);
+
+  Timing::startTiming("restore index");
+    thrust::device_ptr<float3> d_points_ptr;
+    state.params.points = allocThrustDevicePtr(&d_points_ptr, state.numPoints, &state.d_pointers);
+    thrust::copy(state.h_points, state.h_points + state.numPoints, d_points_ptr);
+
+    thrust::device_ptr<unsigned int> d_ids_ptr;
+    state.d_pointIds = allocThrustDevicePtr(&d_ids_ptr, state.numPoints, &state.d_pointers);
+    thrust::copy(h_ids, h_ids + state.numPoints, d_ids_ptr);
+
+    state.pMin = hdr->pMin;
+    state.pMax = hdr->pMax;
+    state.crRatio = hdr->crRatio;
+    state.autoCR = false;
+
+    if (hdr->radius != state.radius)
+      fprintf(stdout, "\tIndex was tuned for radius %f, not %f\n", hdr->radius, state.radius);
+  Timing::stopTiming(true);
+}
+
+static bool writeAt( FILE* fp, unsigned long long offset, const void* buf, size_t len ) {
+  return fseek(fp, offset, SEEK_SET) == 0 && fwrite(buf, 1, len, fp) == len;
+}
+
+// write the resident points after |loadIndex| has sorted them. the file is
+// written next to the target and renamed, so a reader never maps half an
+// index.
+void saveIndex( RTNNState& state ) {
+  Timing::startTiming("save index");
+    IndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, RTNN_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = RTNN_INDEX_VERSION;
+    hdr.numPoints = state.numPoints;
+    hdr.pointSortMode = state.pointSortMode;
+    hdr.mcScale = state.mcScale;
+    hdr.radius = state.radius;
+    hdr.crRatio = state.crRatio;
+    hdr.pMin = state.pMin;
+    hdr.pMax = state.pMax;
+    hdr.pointsOffset = alignUp(sizeof(IndexHeader));
+    hdr.idsOffset = alignUp(hdr.pointsOffset + (unsigned long long)state.numPoints * sizeof(float3));
+    hdr.size = hdr.idsOffset + (unsigned long long)state.numPoints * sizeof(unsigned int);
+
+    // the host points are in sync with the device after sorting (see
+    // |gridSort| and |oneDSort|); the ids only live on the device.
+    std::vector<unsigned int> ids(state.numPoints);
+    thrust::copy(thrust::device_pointer_cast(state.d_pointIds),
+        thrust::device_pointer_cast(state.d_pointIds) + state.numPoints, ids.begin());
+
+    std::string tmp = state.indexOut + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    bool ok = fp &&
+              writeAt(fp, 0, &hdr, sizeof(hdr)) &&
+              writeAt(fp, hdr.pointsOffset, state.h_points, state.numPoints * sizeof(float3)) &&
+              writeAt(fp, hdr.idsOffset, ids.data(), ids.size() * sizeof(unsigned int));
+    if (fp && fclose(fp) != 0) ok = false;
+    if (!ok || rename(tmp.c_str(), state.indexOut.c_str()) != 0) {
+      fprintf(stderr, "can't write index %s\n", state.indexOut.c_str());
+      unlink(tmp.c_str());
+      exit(1);
+    }
+    fprintf(stdout, "\tSaved index of %u points to %s\n", state.numPoints, state.indexOut.c_str());
+  Timing::stopTiming(true);
+}
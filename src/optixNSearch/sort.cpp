@@ -71,18 +71,41 @@ void computeMinMax(unsigned int N, float3* particles, float3& min, float3& max)
   fprintf(stdout, "\tscene boundary: (%f, %f, %f), (%f, %f, %f)\n", min.x, min.y, min.z, max.x, max.y, max.z);
 }
 
+// reorder the original ids the same way the particles are about to be
+// reordered by |d_key_ptr|. the keys are copied since a sort consumes them.
+void sortIdsByKey(RTNNState& state, thrust::device_ptr<unsigned int> d_key_ptr, unsigned int* d_ids, unsigned int N) {
+  if (d_ids == nullptr) return;
+
+  thrust::device_ptr<unsigned int> d_key_ptr_copy;
+  allocThrustDevicePtr(&d_key_ptr_copy, N, &state.d_gridPointers);
+  thrustCopyD2D(d_key_ptr_copy, d_key_ptr, N);
+  sortByKey(d_key_ptr_copy, thrust::device_pointer_cast(d_ids), N);
+
+  // the host copy of the point ids, if any, is now stale
+  if (d_ids == state.d_pointIds) {
+    delete[] state.h_pointIds;
+    state.h_pointIds = nullptr;
+  }
+}
+
 unsigned int genGridInfo(RTNNState& state, unsigned int N, GridInfo& gridInfo) {
+  return genGridInfo(state, N, gridInfo, state.radius / state.crRatio);
+}
+
+unsigned int genGridInfo(RTNNState& state, unsigned int N, GridInfo& gridInfo, float cellSize) {
   float3 sceneMin = state.Min;
   float3 sceneMax = state.Max;
 
   gridInfo.ParticleCount = N;
   gridInfo.GridMin = sceneMin;
 
-  float cellSize = state.radius / state.crRatio;
   float3 gridSize = sceneMax - sceneMin;
+  gridInfo.dim = (state.searchDim == 2) ? 2 : 3;
   gridInfo.GridDimension.x = static_cast<unsigned int>(ceilf(gridSize.x / cellSize));
   gridInfo.GridDimension.y = static_cast<unsigned int>(ceilf(gridSize.y / cellSize));
   gridInfo.GridDimension.z = static_cast<unsigned int>(ceilf(gridSize.z / cellSize));
+  // planar data: one layer of cells, and every particle maps to it.
+  if (gridInfo.dim == 2) gridInfo.GridDimension.z = 1;
 
   // Adjust grid size to multiple of cell size
   gridSize.x = gridInfo.GridDimension.x * cellSize;
@@ -91,7 +114,7 @@ unsigned int genGridInfo(RTNNState& state, unsigned int N, GridInfo& gridInfo) {
 
   gridInfo.GridDelta.x = gridInfo.GridDimension.x / gridSize.x;
   gridInfo.GridDelta.y = gridInfo.GridDimension.y / gridSize.y;
-  gridInfo.GridDelta.z = gridInfo.GridDimension.z / gridSize.z;
+  gridInfo.GridDelta.z = (gridInfo.dim == 2) ? 0 : gridInfo.GridDimension.z / gridSize.z;
 
   // morton code can only be correctly calcuated for a cubic, where each
   //   dimension is of the same size and the dimension is a power of 2. if we
@@ -105,10 +128,13 @@ unsigned int genGridInfo(RTNNState& state, unsigned int N, GridInfo& gridInfo) {
   //   scaling factor. the result becomes the size of a meta grid. the smaller
   //   the scaling factor, the more space waste (which limits the number of
   //   cells) but enforces a more global order; maybe a better strategy?
-  unsigned int shortestSide = std::min({gridInfo.GridDimension.x, gridInfo.GridDimension.y, gridInfo.GridDimension.z});
+  unsigned int shortestSide = (gridInfo.dim == 2) ?
+      std::min(gridInfo.GridDimension.x, gridInfo.GridDimension.y) :
+      std::min({gridInfo.GridDimension.x, gridInfo.GridDimension.y, gridInfo.GridDimension.z});
   // dim should at least be 1; otherwise we won't get 0 cells.
   gridInfo.meta_grid_dim = std::max((int)pow(2, floorf(log2(shortestSide)))/state.mcScale, 1);
-  gridInfo.meta_grid_size = gridInfo.meta_grid_dim * gridInfo.meta_grid_dim * gridInfo.meta_grid_dim;
+  gridInfo.meta_grid_size = gridInfo.meta_grid_dim * gridInfo.meta_grid_dim;
+  if (gridInfo.dim == 3) gridInfo.meta_grid_size *= gridInfo.meta_grid_dim;
 
   // One meta grid cell contains meta_grid_dim^3 cells. The morton curve is
   // calculated for each metagrid, and the order of metagrid is raster order.
@@ -117,7 +143,7 @@ unsigned int genGridInfo(RTNNState& state, unsigned int N, GridInfo& gridInfo) {
   // calculates one single morton curve for the entire grid.
   gridInfo.MetaGridDimension.x = static_cast<unsigned int>(ceilf(gridInfo.GridDimension.x / (float)gridInfo.meta_grid_dim));
   gridInfo.MetaGridDimension.y = static_cast<unsigned int>(ceilf(gridInfo.GridDimension.y / (float)gridInfo.meta_grid_dim));
-  gridInfo.MetaGridDimension.z = static_cast<unsigned int>(ceilf(gridInfo.GridDimension.z / (float)gridInfo.meta_grid_dim));
+  gridInfo.MetaGridDimension.z = (gridInfo.dim == 2) ? 1 : static_cast<unsigned int>(ceilf(gridInfo.GridDimension.z / (float)gridInfo.meta_grid_dim));
 
   // metagrids will slightly increase the total cells
   unsigned int numberOfCells = (gridInfo.MetaGridDimension.x * gridInfo.MetaGridDimension.y * gridInfo.MetaGridDimension.z) * gridInfo.meta_grid_size;
@@ -132,7 +158,7 @@ unsigned int genGridInfo(RTNNState& state, unsigned int N, GridInfo& gridInfo) {
   // update GridDimension so that it can be used in the kernels (otherwise raster order is incorrect)
   gridInfo.GridDimension.x = gridInfo.MetaGridDimension.x * gridInfo.meta_grid_dim;
   gridInfo.GridDimension.y = gridInfo.MetaGridDimension.y * gridInfo.meta_grid_dim;
-  gridInfo.GridDimension.z = gridInfo.MetaGridDimension.z * gridInfo.meta_grid_dim;
+  if (gridInfo.dim == 3) gridInfo.GridDimension.z = gridInfo.MetaGridDimension.z * gridInfo.meta_grid_dim;
   return numberOfCells;
 }
 
@@ -152,7 +178,7 @@ thrust::device_ptr<int> genCellMask (RTNNState& state, unsigned int* d_repQuerie
   // tightly encloses this cube, and given the way we calculate |maxWidth| we
   // know that the radius of that sphere won't be greater than state.radius, so
   // we still save time.
-  float maxWidth = maxInscribedWidth(state.radius, 3);
+  float maxWidth = maxInscribedWidth(state.radius, state.searchDim);
 
   thrust::device_ptr<int> d_cellMask;
   // no need to memset this since every single cell will be updated.
@@ -260,13 +286,14 @@ void autoBatchingRange(RTNNState& state, const thrust::host_vector<unsigned int>
   batches.push_back(numAvailBatches - 1);
 }
 
-float radiusFromMegacell(float width, int approxMode) {
-  if (approxMode == 2) return radiusEquiVolume(width, 3); // 0.62; works well for uniform density
+float radiusFromMegacell(float width, int approxMode, int dim) {
+  if (approxMode == 2) return radiusEquiVolume(width, dim); // 0.62 (0.56 in 2D); works well for uniform density
   // for a sphere to be of the same volume as the cube, its radius is width *
   // 0.62. if we use 2 in |minCircumscribedRadius|, the radius is width * 0.71.
-  // so very likely the sphere will still have more than K neighbors.
+  // so very likely the sphere will still have more than K neighbors. in 2D
+  // this is the same as no approximation.
   else if (approxMode == 1) return minCircumscribedRadius(width, 2); // 0.71
-  else return minCircumscribedRadius(width, 3); // 0.87
+  else return minCircumscribedRadius(width, dim); // 0.87 (0.71 in 2D)
 }
 
 void autoBatchingKNN(RTNNState& state, const thrust::host_vector<unsigned int>& h_rayHist, std::vector<int>& batches, int numAvailBatches) {
@@ -292,7 +319,7 @@ void autoBatchingKNN(RTNNState& state, const thrust::host_vector<unsigned int>&
   //fprintf(stdout, "tBuildGAS: %f\n", tBuildGAS);
 
   float maxWidth = kGetWidthFromIter(numAvailBatches - 1, cellSize);
-  float maxRadius = std::min(state.radius, radiusFromMegacell(maxWidth, state.approxMode));
+  float maxRadius = std::min(state.radius, radiusFromMegacell(maxWidth, state.approxMode, state.searchDim));
   // incrementally combine batch i with the last batch (assuming all other
   // batches are independent) and calculate the cost. choose the min cost.
   float overhead = 0;
@@ -300,11 +327,11 @@ void autoBatchingKNN(RTNNState& state, const thrust::host_vector<unsigned int>&
   int splitId = numAvailBatches - 1;
   for (int i = numAvailBatches - 2; i >= 0; i--) {
     float curWidth = kGetWidthFromIter(i, cellSize);
-    float curRadius = std::min(state.radius, radiusFromMegacell(curWidth, state.approxMode));
-    float density = state.knn / ((curWidth - cellSize) * (curWidth - cellSize) * (curWidth - cellSize));
+    float curRadius = std::min(state.radius, radiusFromMegacell(curWidth, state.approxMode, state.searchDim));
+    float density = state.knn / powf(curWidth - cellSize, state.searchDim);
 
     // TODO: assuming density doesn't change dramatically; consider non-uniform density?
-    float extraWork = h_rayHist[i] * 8 * (maxRadius * maxRadius * maxRadius - curRadius * curRadius * curRadius) * density;
+    float extraWork = h_rayHist[i] * powf(2, state.searchDim) * (powf(maxRadius, state.searchDim) - powf(curRadius, state.searchDim)) * density;
     float extraTime = extraWork * kSearch_PerIS;
     overhead += extraTime - tBuildGAS;
     //fprintf(stdout, "i: %d, density: %f, extraWork: %f, extraTime: %f, overhead: %f\n", i, density, extraWork, extraTime, overhead);
@@ -365,8 +392,15 @@ void genBatches(RTNNState& state,
 
     // see comments in how maxWidth is calculated in |genCellMask|.
     float partThd = kGetWidthFromIter(maxMask, cellSize); // partThd depends on the max mask.
-    if (state.searchMode == "knn")
-      state.launchRadius[batchId] = radiusFromMegacell(partThd, state.approxMode);
+    if (state.searchMode == "knn") {
+      state.launchRadius[batchId] = radiusFromMegacell(partThd, state.approxMode, state.searchDim);
+      // -ke: rows that stay short are repaired (see |repairBatches|), and a
+      // full row holds K points within the launch radius, so the exact Kth
+      // neighbor is too and the (1+eps) bound holds within it. the bound
+      // tolerates a Kth neighbor 1+eps farther away, so the megacell's
+      // radius can shrink by as much at little risk of short rows.
+      if (state.knnEps > 0 && state.repair) state.launchRadius[batchId] /= 1 + state.knnEps;
+    }
     else
       state.launchRadius[batchId] = partThd / 2;
     if (batchId == (state.numOfBatches - 1)) state.launchRadius[batchId] = state.radius;
@@ -381,6 +415,13 @@ void genBatches(RTNNState& state,
     copyIfIdInRange(particles, N, d_rayMask, d_actQs, lastMask + 1, maxMask);
     state.d_actQs[batchId] = thrust::raw_pointer_cast(d_actQs);
 
+    if (state.trackIds) {
+      thrust::device_ptr<unsigned int> d_actQIds;
+      allocThrustDevicePtr(&d_actQIds, numActQs, &state.d_pointers);
+      copyIfIdInRange(state.d_queryIds, N, d_rayMask, d_actQIds, lastMask + 1, maxMask);
+      state.d_actQIds[batchId] = thrust::raw_pointer_cast(d_actQIds);
+    }
+
     // Copy the active queries to host (for sanity check).
     if (state.sanCheck) {
       state.h_actQs[batchId] = new float3[numActQs];
@@ -486,6 +527,7 @@ void sortGenBatch(RTNNState& state,
       thrustCopyD2D(d_posInSortedPoints_ptr_copy, d_posInSortedPoints_ptr, N);
 
       sortByKey(d_posInSortedPoints_ptr_copy, d_rayMask, N);
+      sortIdsByKey(state, d_posInSortedPoints_ptr, state.d_queryIds, N);
       sortByKey(d_posInSortedPoints_ptr, thrust::device_pointer_cast(particles), N);
     }
 
@@ -610,6 +652,7 @@ void gridSort(RTNNState& state, unsigned int N, float3* particles, float3* h_par
                          thrust::raw_pointer_cast(d_posInSortedPoints_ptr)
                         );
     // in-place sort; no new device memory is allocated
+    sortIdsByKey(state, d_posInSortedPoints_ptr, (type == POINT_TYPE) ? state.d_pointIds : state.d_queryIds, N);
     sortByKey(d_posInSortedPoints_ptr, thrust::device_pointer_cast(particles), N);
   }
 
@@ -627,7 +670,7 @@ void gridSort(RTNNState& state, unsigned int N, float3* particles, float3* h_par
   thrust::copy(d_particles_ptr, d_particles_ptr + N, h_particles);
 }
 
-void oneDSort ( RTNNState& state, unsigned int N, float3* particles, float3* h_particles ) {
+void oneDSort ( RTNNState& state, unsigned int N, float3* particles, float3* h_particles, unsigned int* d_ids ) {
   // sort points/queries based on coordinates (x/y/z)
 
   // TODO: do this whole thing on GPU.
@@ -641,6 +684,17 @@ void oneDSort ( RTNNState& state, unsigned int N, float3* particles, float3* h_p
   allocThrustDevicePtr(&d_key_ptr, state.numQueries, &state.d_pointers);
   thrust::copy(h_key.begin(), h_key.end(), d_key_ptr);
 
+  if (d_ids != nullptr) {
+    thrust::device_ptr<float> d_key_ptr_copy;
+    allocThrustDevicePtr(&d_key_ptr_copy, N, &state.d_pointers);
+    thrust::copy(h_key.begin(), h_key.end(), d_key_ptr_copy);
+    sortByKey( d_key_ptr_copy, thrust::device_pointer_cast(d_ids), N );
+    if (d_ids == state.d_pointIds) {
+      delete[] state.h_pointIds;
+      state.h_pointIds = nullptr;
+    }
+  }
+
   // actual sort
   thrust::device_ptr<float3> d_particles_ptr = thrust::device_pointer_cast(particles);
   sortByKey( d_key_ptr, d_particles_ptr, N );
@@ -679,7 +733,7 @@ void sortParticles ( RTNNState& state, ParticleType type, int sortMode ) {
 
   // the semantices of sorting is: sort data in device, and copy the sorted data back to host.
   if (sortMode == 3) {
-    oneDSort(state, N, particles, h_particles);
+    oneDSort(state, N, particles, h_particles, (type == POINT_TYPE) ? state.d_pointIds : state.d_queryIds);
   } else {
     // TODO: a slight issue is if ps and qs are 0, we will still use raster
     // order to sort queries in the partitioning grid (in
@@ -832,6 +886,13 @@ void gatherQueries( RTNNState& state, thrust::device_ptr<unsigned int> d_indices
     gatherByKey(d_indices_ptr, d_orig_queries_ptr, d_reord_queries_ptr, numQueries, state.stream[batch_id]);
 
     state.d_actQs[batch_id] = thrust::raw_pointer_cast(d_reord_queries_ptr);
+
+    if (state.trackIds) {
+      thrust::device_ptr<unsigned int> d_reord_ids_ptr;
+      allocThrustDevicePtr(&d_reord_ids_ptr, numQueries, &state.d_pointers);
+      gatherByKey(d_indices_ptr, thrust::device_pointer_cast(state.d_actQIds[batch_id]), d_reord_ids_ptr, numQueries, state.stream[batch_id]);
+      state.d_actQIds[batch_id] = thrust::raw_pointer_cast(d_reord_ids_ptr);
+    }
     //assert(state.params.points != state.params.queries);
   Timing::stopTiming(true);
 
@@ -0,0 +1,92 @@
+#include <sutil/Exception.h>
+#include <sutil/Timing.h>
+
+#include <thrust/device_vector.h>
+#include <thrust/copy.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "optixNSearch.h"
+#include "state.h"
+#include "func.h"
+
+// SPH (-sph): the radius search over the particles evaluates the smoothing
+// kernel at each neighbor instead of storing the neighbors, once for the
+// densities and once more for the forces, which need the densities of all
+// neighbors; see Params and |search|. The result is the density and the force
+// of each particle.
+
+// call after the points and queries are uploaded.
+void setupSph( RTNNState& state ) {
+  Timing::startTiming("setup SPH");
+    state.params.sphH = state.radius / 2;
+    if (state.params.sphMass <= 0) state.params.sphMass = 1;
+    if (state.params.sphStiffness <= 0) state.params.sphStiffness = 1;
+    state.params.pointIds = state.d_pointIds;
+
+    state.params.sphVel = nullptr;
+    if (!state.sphVelFile.empty()) {
+      unsigned int numVels;
+      float3* h_vels = read_pc_data(state.sphVelFile.c_str(), &numVels);
+      if (numVels != state.numPoints) {
+        std::cerr << state.sphVelFile << " has " << numVels << " velocities for " << state.numPoints << " particles\n";
+        exit(1);
+      }
+      thrust::device_ptr<float3> d_vels_ptr;
+      state.params.sphVel = allocThrustDevicePtr(&d_vels_ptr, numVels, &state.d_pointers);
+      thrust::copy(h_vels, h_vels + numVels, d_vels_ptr);
+      delete[] h_vels;
+    }
+
+    thrust::device_ptr<float> d_density_ptr;
+    state.params.sphDensity = allocThrustDevicePtr(&d_density_ptr, state.numPoints, &state.d_pointers);
+    thrust::device_ptr<float3> d_force_ptr;
+    state.params.sphForce = allocThrustDevicePtr(&d_force_ptr, state.numPoints, &state.d_pointers);
+  Timing::stopTiming(true);
+}
+
+// call between the two passes: without a rest density, the average density
+// is taken, so that pressures are relative to the current state.
+void finishSphDensity( RTNNState& state ) {
+  if (state.params.sphRestDensity > 0) return;
+  state.params.sphRestDensity = sumByValue(thrust::device_pointer_cast(state.params.sphDensity), state.numPoints) / state.numPoints;
+}
+
+// print the density range and the average force magnitude, and write one
+// line per particle (in input order) to the output file, if any: the density
+// followed by the force, comma-separated.
+void reportSph( RTNNState& state ) {
+  unsigned int N = state.numPoints;
+  std::vector<float> density(N);
+  std::vector<float3> force(N);
+  thrust::copy(thrust::device_pointer_cast(state.params.sphDensity),
+      thrust::device_pointer_cast(state.params.sphDensity) + N, density.begin());
+  thrust::copy(thrust::device_pointer_cast(state.params.sphForce),
+      thrust::device_pointer_cast(state.params.sphForce) + N, force.begin());
+
+  double sumDensity = 0, sumForce = 0;
+  float minDensity = INFINITY, maxDensity = 0;
+  for (unsigned int i = 0; i < N; i++) {
+    sumDensity += density[i];
+    minDensity = std::min(minDensity, density[i]);
+    maxDensity = std::max(maxDensity, density[i]);
+    sumForce += length(force[i]);
+  }
+  fprintf(stdout, "\tSPH density: %f to %f, %f on average (rest density %f)\n",
+      minDensity, maxDensity, sumDensity / N, state.params.sphRestDensity);
+  fprintf(stdout, "\tSPH force: %f on average\n", sumForce / N);
+
+  if (!state.outfile.empty()) {
+    FILE* fp = fopen(state.outfile.c_str(), "w");
+    if (fp == nullptr) {
+      perror(state.outfile.c_str());
+      exit(1);
+    }
+    for (unsigned int i = 0; i < N; i++)
+      fprintf(fp, "%g,%g,%g,%g\n", density[i], force[i].x, force[i].y, force[i].z);
+    fclose(fp);
+  }
+}
@@ -32,6 +32,7 @@
 #include <vector_types.h>
 #include <optix_types.h>
 #include <unordered_set>
+#include <vector>
 #include "optixNSearch.h"
 
 // the SDK cmake defines NDEBUG in the Release build, but we still want to use assert
@@ -59,14 +60,16 @@ struct RTNNState
     OptixPipelineCompileOptions pipeline_compile_options  = {};
 
     cudaStream_t*               stream                    = nullptr;
-    Params                      params;
+    Params                      params                    = {};
     Params*                     d_params                  = nullptr;
 
     float3*                     h_points                  = nullptr;
     float3*                     h_queries                 = nullptr;
     float3**                    h_ndpoints                = nullptr;
     float3**                    h_ndqueries               = nullptr;
-    int                         dim;
+    double3*                    h_dpoints                 = nullptr; // original order; only with doublePrec
+    double3*                    h_dqueries                = nullptr;
+    int                         dim                       = 3; // coordinates per row, a multiple of 3; >3 fills h_ndpoints/h_ndqueries
     bool                        msr                       = true;
     bool                        sanCheck                  = false;
 
@@ -90,13 +93,54 @@ struct RTNNState
     bool                        autoNB                    = true;
     bool                        autoCR                    = true;
     int                         approxMode                = 2;
+    float                       knnEps                    = 0;     // the Kth KNN distance is within 1+knnEps of the exact one; see Params
+    bool                        repair                    = false; // re-search the partitioned KNN queries whose results aren't certified exact; see |repairBatches|
     int                         mcScale                   = 4;
+    int                         searchDim                 = 0; // 2 or 3; 0 detects it: planar points and queries are searched in 2D
+    std::vector<float>          axisScales;                      // x,y,z multipliers applied to all coordinates; empty for none
+    double                      geoRadius                 = 0;     // > 0: rows are lat,lon (degrees) on a sphere of this radius; see |geoChord|
+    float                       geoSearchRadius           = 0;     // the requested great-circle radius; |radius| is its chord
+    bool                        doublePrec                = false; // read double coordinates and search them rebased to |origin| in float
+    double3                     origin                    = {0, 0, 0};
+    double                      dRadius                   = 0;     // the requested radius; |radius| is widened by dpEps
+    float                       dpEps                     = 0;     // bound on the error of a float distance after rebasing
     float                       crStep                    = 1.01;
     bool                        deferFree                 = true;
     bool                        filterQueries             = false;
+    bool                        perfCounters              = false;
+    bool                        trackIds                  = false; // keep the original point/query ids across sorting and partitioning
+    std::string                 serverSock;
+    unsigned int                coalesceQueries           = 65536; // flush a coalesced search at this many queries; 0 disables coalescing
+    int                         coalesceDelay             = 1000;  // us a request may wait for others to coalesce with
+    unsigned int                serverMaxKnn              = 1024;  // max neighbors per query a radius-mode request may ask for
+    int                         numShards                 = 0;     // worker processes in sharded server mode; 0/1 disables sharding
+    int                         shardDevices              = 1;     // shards are spread round-robin over this many GPUs
+    std::vector<unsigned int>   idMap;                           // a shard's point ids -> ids in the full point file
+    std::string                 indexIn;                         // restore the resident points from this snapshot
+    std::string                 indexOut;                        // save the resident points to this snapshot
+    void*                       indexMap                  = nullptr; // the mapped indexIn
+    unsigned int                pipelineChunk             = 0;     // queries per chunk in pipelined mode; 0 disables it
+    unsigned int                pipelineDepth             = 2;     // chunks that can wait between two stages
+    std::string                 outfile;
+    std::string                 jobFile;
+    std::vector<float>          shellRadii;                      // ascending; empty unless searching radius shells
+    std::vector<unsigned int>   shellKs;                         // max neighbors kept per shell
+    std::string                 histWeightFile;                  // per-point weights for histograms
+    std::string                 histQWeightFile;                 // per-query weights for histograms
+    std::string                 aggFile;                         // per-point attributes to aggregate over neighbors; see agg.cpp
+    bool                        sph                       = false; // SPH density and force passes instead of a search; see sph.cpp
+    std::string                 sphVelFile;                      // per-particle velocities for SPH viscosity
+    std::string                 graphMode;                       // "union" or "mutual" to build a KNN graph of the points; see |packGraph|
+    std::string                 boxFile;                         // boxes to query instead of searching; see region.cpp
+    std::string                 capsuleFile;                     // capsules (segments and radii) to query instead of searching
+    bool                        regionCounts              = false; // only count the points of each box or capsule
+    std::vector<float>          h_pointWeights;
+    std::vector<float>          h_queryWeights;
+    bool                        outDists                  = false;
 
     unsigned int                numPoints                 = 0;
     unsigned int                numQueries                = 0;
+    unsigned int                numOrigQueries            = 0; // before filtering
     unsigned int**              d_r2q_map                 = nullptr;
     unsigned int*               numActQueries             = nullptr;
     float*                      launchRadius              = nullptr;
@@ -106,17 +150,29 @@ struct RTNNState
     void**                      d_aabb                    = nullptr;
     void**                      d_temp_buffer_gas         = nullptr;
     void**                      d_buffer_temp_output_gas_and_compacted_size = nullptr;
+    float**                     d_knnKeys                 = nullptr; // large-K KNN scratch rows of each stream; see |allocKnnScratch|
+    unsigned int**              d_knnIds                  = nullptr;
+    size_t*                     knnScratchRows            = nullptr; // how many rows each stream's scratch holds
     void*                       d_CellParticleCounts_ptr_p = nullptr;
     void*                       d_CellOffsets_ptr_p       = nullptr;
     float3*                     h_fltQs                   = nullptr;
     unsigned int                numFltQs                  = 0;
 
+    // original ids; only populated if trackIds. if samepq, d_queryIds and
+    // d_pointIds point to the same device memory just like the particles.
+    unsigned int*               d_pointIds                = nullptr;
+    unsigned int*               h_pointIds                = nullptr;
+    unsigned int*               d_queryIds                = nullptr;
+    unsigned int**              d_actQIds                 = nullptr;
+
     std::unordered_set<void*>   d_pointers;
     std::unordered_set<void*>   d_gridPointers;
+    std::unordered_set<void*>   d_indexPointers; // resident across requests in server mode
 
     int                         numOfBatches              = -1;
     int                         maxBatchCount             = 1;
     float                       totDRAMSize               = 0; // GB
+    unsigned int                residentThreads           = 0; // threads the device runs at once; see |allocKnnScratch|
     float                       gpuMemUsed                = 0; // MB
     float                       estGasSize                = -1; // MB
 
@@ -5,6 +5,20 @@
 #include <thrust/gather.h>
 #include <thrust/binary_search.h>
 #include <thrust/adjacent_difference.h>
+#include <thrust/remove.h>
+#include <thrust/transform.h>
+#include <thrust/functional.h>
+#include <thrust/reduce.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/iterator/zip_iterator.h>
+#include <thrust/for_each.h>
+#include <thrust/scan.h>
+#include <thrust/transform_reduce.h>
+
+#include <climits>
+
+#include "metric.h"
 
 // this can't be in the main cpp file since the file containing cuda kernels to
 // be compiled by nvcc needs to have .cu extensions. See here:
@@ -66,6 +80,10 @@ void gatherByKey ( thrust::device_ptr<unsigned int> d_key_ptr, thrust::device_pt
   thrust::gather(d_key_ptr, d_key_ptr + N, d_orig_val_ptr, d_new_val_ptr);
 }
 
+void gatherByKey ( thrust::device_ptr<unsigned int> d_key_ptr, thrust::device_ptr<unsigned int> d_orig_val_ptr, thrust::device_ptr<unsigned int> d_new_val_ptr, unsigned int N, cudaStream_t stream ) {
+  thrust::gather(thrust::cuda::par.on(stream), d_key_ptr, d_key_ptr + N, d_orig_val_ptr, d_new_val_ptr);
+}
+
 void genSeqDevice(thrust::device_ptr<unsigned int> d_init_val_ptr, unsigned int numPrims) {
   thrust::sequence(d_init_val_ptr, d_init_val_ptr + numPrims);
 }
@@ -90,14 +108,26 @@ void exclusiveScan(thrust::device_ptr<unsigned int> d_src_ptr, unsigned int N, t
     d_dest_ptr);
 }
 
-void fillByValue(thrust::device_ptr<unsigned int> d_src_ptr, unsigned int N, int value, cudaStream_t stream) {
+void fillByValue(thrust::device_ptr<unsigned int> d_src_ptr, size_t N, int value, cudaStream_t stream) {
   thrust::fill(thrust::cuda::par.on(stream), d_src_ptr, d_src_ptr + N, value);
 }
 
-void fillByValue(thrust::device_ptr<unsigned int> d_src_ptr, unsigned int N, int value) {
+void fillByValue(thrust::device_ptr<unsigned int> d_src_ptr, size_t N, int value) {
   thrust::fill(d_src_ptr, d_src_ptr + N, value);
 }
 
+void fillByValue(thrust::device_ptr<float> d_src_ptr, size_t N, float value) {
+  thrust::fill(d_src_ptr, d_src_ptr + N, value);
+}
+
+void fillByValue(thrust::device_ptr<double> d_src_ptr, size_t N, double value) {
+  thrust::fill(d_src_ptr, d_src_ptr + N, value);
+}
+
+double sumByValue(thrust::device_ptr<float> d_src_ptr, size_t N) {
+  return thrust::reduce(d_src_ptr, d_src_ptr + N, 0.0);
+}
+
 struct is_nonzero
 {
   __host__ __device__
@@ -183,6 +213,18 @@ void copyIfIdInRange(float3* source, unsigned int N, thrust::device_ptr<int> mas
                     mask, dest, isInRange(min, max));
 }
 
+void copyIfIdInRange(unsigned int* source, unsigned int N, thrust::device_ptr<int> mask, thrust::device_ptr<unsigned int> dest, int min, int max) {
+    thrust::copy_if(thrust::device_pointer_cast(source),
+                    thrust::device_pointer_cast(source) + N,
+                    mask, dest, isInRange(min, max));
+}
+
+void copyIfInRange(unsigned int* source, unsigned int N, thrust::device_ptr<float3> mask, thrust::device_ptr<unsigned int> dest, float3 min, float3 max) {
+    thrust::copy_if(thrust::device_pointer_cast(source),
+                    thrust::device_pointer_cast(source) + N,
+                    mask, dest, isInRange3D(min, max, true));
+}
+
 void copyIfNonZero(float3* source, unsigned int N, thrust::device_ptr<bool> mask, thrust::device_ptr<float3> dest) {
     thrust::copy_if(thrust::device_pointer_cast(source),
                     thrust::device_pointer_cast(source) + N,
@@ -241,3 +283,128 @@ unsigned int thrustGenHist(const thrust::device_ptr<int> d_value_ptr, thrust::de
 
     return num_bins;
 }
+
+struct edgeSource
+{
+  __host__ __device__
+    unsigned long long operator()(const unsigned long long v)
+    {
+      return v << 32;
+    }
+};
+
+struct edgeTarget
+{
+  __host__ __device__
+    unsigned int operator()(const unsigned long long key)
+    {
+      return (unsigned int)(key & 0xffffffffULL);
+    }
+};
+
+// a slot of a result row that holds a graph edge: a neighbor other than the
+// query itself, which a radius row also holds. sources and targets are
+// original ids, or row and point positions where the id maps are null.
+struct graphEdgeSlot
+{
+  const unsigned int* rows;
+  unsigned int        knn;
+  const unsigned int* rowQIds;
+  const unsigned int* pointIds;
+
+  __host__ __device__
+    unsigned long long source(size_t j) const
+    {
+      unsigned int i = j / knn;
+      return rowQIds ? rowQIds[i] : i;
+    }
+
+  __host__ __device__
+    unsigned long long target(size_t j) const
+    {
+      return pointIds ? pointIds[rows[j]] : rows[j];
+    }
+
+  __host__ __device__
+    size_t operator()(size_t j) const
+    {
+      return rows[j] != UINT_MAX && source(j) != target(j);
+    }
+};
+
+struct emitGraphEdge
+{
+  graphEdgeSlot       slot;
+  const size_t*       pos;
+  const float3*       rowQs;
+  const float3*       points;
+  unsigned long long* keys;
+  float*              dists;
+
+  __host__ __device__
+    void operator()(size_t j) const
+    {
+      if (!slot(j)) return;
+      unsigned long long src = slot.source(j), dst = slot.target(j);
+      float dist = metricDist(metricKey(points[slot.rows[j]] - rowQs[j / slot.knn]));
+      size_t k = 2 * pos[j];
+      keys[k] = src << 32 | dst;
+      keys[k + 1] = dst << 32 | src;
+      dists[k] = dist;
+      dists[k + 1] = dist;
+    }
+};
+
+// the number of graph edges in |numRows| result rows of |knn| slots each.
+// |d_rowQIds| and |d_pointIds| map rows and points to original ids; null
+// means the identity.
+size_t countEdges(const unsigned int* d_rows, unsigned int numRows, unsigned int knn, const unsigned int* d_rowQIds, const unsigned int* d_pointIds) {
+  graphEdgeSlot slot = { d_rows, knn, d_rowQIds, d_pointIds };
+  thrust::counting_iterator<size_t> first(0);
+  return thrust::transform_reduce(first, first + (size_t)numRows * knn, slot, (size_t)0, thrust::plus<size_t>());
+}
+
+// write both directions of the edges that |countEdges| counts, keyed as
+// |mergeEdges| expects, into |d_keys| and |d_dists|, in row order. the rows'
+// queries are |d_rowQs| and their slots index |d_points|.
+void genEdges(const unsigned int* d_rows, unsigned int numRows, unsigned int knn, const unsigned int* d_rowQIds, const unsigned int* d_pointIds, const float3* d_rowQs, const float3* d_points, unsigned long long* d_keys, float* d_dists) {
+  size_t numSlots = (size_t)numRows * knn;
+  graphEdgeSlot slot = { d_rows, knn, d_rowQIds, d_pointIds };
+  thrust::counting_iterator<size_t> first(0);
+
+  // each slot writes its keys at twice the number of edges before it
+  thrust::device_vector<size_t> d_pos(numSlots);
+  auto isEdge = thrust::make_transform_iterator(first, slot);
+  thrust::exclusive_scan(isEdge, isEdge + numSlots, d_pos.begin());
+  emitGraphEdge emit = { slot, thrust::raw_pointer_cast(d_pos.data()), d_rowQs, d_points, d_keys, d_dists };
+  thrust::for_each(first, first + numSlots, emit);
+}
+
+// sort the graph edges, keyed by (source << 32 | target), with their
+// distances, and merge the two directions of each pair: keep one copy of
+// every edge (the union), or, if |mutual|, only the edges that were found in
+// both directions. returns the number of edges left, which are sorted.
+size_t mergeEdges(thrust::device_ptr<unsigned long long> d_keys, thrust::device_ptr<float> d_dists, size_t N, bool mutual) {
+  // no edge can be mutual without two keys (and [1, N) would be reversed)
+  if (mutual && N < 2) return 0;
+  thrust::sort_by_key(d_keys, d_keys + N, d_dists);
+  if (!mutual) {
+    auto end = thrust::unique_by_key(d_keys, d_keys + N, d_dists);
+    return thrust::get<0>(end) - d_keys;
+  }
+
+  // an edge is mutual iff it appears twice; keep its second copy.
+  thrust::device_vector<bool> d_second(N, false);
+  thrust::transform(d_keys + 1, d_keys + N, d_keys, d_second.begin() + 1, thrust::equal_to<unsigned long long>());
+  auto first = thrust::make_zip_iterator(thrust::make_tuple(d_keys, d_dists));
+  auto end = thrust::remove_if(first, first + N, d_second.begin(), thrust::logical_not<bool>());
+  return end - first;
+}
+
+// turn |E| sorted edge keys into the CSR of |numNodes| nodes: numNodes + 1
+// |d_offsets| and |E| |d_targets|.
+void edgesToCSR(thrust::device_ptr<unsigned long long> d_keys, size_t E, unsigned int numNodes, thrust::device_ptr<unsigned int> d_offsets, thrust::device_ptr<unsigned int> d_targets) {
+  auto sources = thrust::make_transform_iterator(thrust::counting_iterator<unsigned long long>(0), edgeSource());
+  thrust::lower_bound(d_keys, d_keys + E, sources, sources + numNodes + 1, d_offsets);
+  thrust::transform(d_keys, d_keys + E, d_targets, edgeTarget());
+}
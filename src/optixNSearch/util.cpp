@@ -1,10 +1,15 @@
+#include <algorithm>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <cstring>
 #include <vector>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <cstdlib>
+#include <cfloat>
+#include <cmath>
 
 #include <sutil/Timing.h>
 #include <sutil/Exception.h>
@@ -14,6 +19,7 @@
 
 #include "func.h"
 #include "state.h"
+#include "metric.h"
 
 int tokenize(std::string s, std::string del, float3** ndpoints, unsigned int lineId)
 {
@@ -43,6 +49,7 @@ int tokenize(std::string s, std::string del, float3** ndpoints, unsigned int lin
   if ((dim % 3) != 0) dim = (dim/3+1)*3;
 
   if (ndpoints != nullptr) {
+    vcoords.resize(dim, 0.0f); // the last chunk is zero-padded
     for (int batch = 0; batch < dim/3; batch++) {
       float3 point = make_float3(vcoords[batch*3], vcoords[batch*3+1], vcoords[batch*3+2]);
       ndpoints[batch][lineId] = point;
@@ -134,6 +141,66 @@ float3* read_pc_data(const char* data_file, unsigned int* N) {
   return t_points;
 }
 
+double3* read_pc_data_double(const char* data_file, unsigned int* N) {
+  std::ifstream file;
+
+  file.open(data_file);
+  if( !file.good() ) {
+    std::cerr << "Could not read the frame data...\n";
+    assert(0);
+  }
+
+  char line[1024];
+  unsigned int lines = 0;
+
+  while (file.getline(line, 1024)) {
+    lines++;
+  }
+  file.clear();
+  file.seekg(0, std::ios::beg);
+  *N = lines;
+
+  double3* t_points = new double3[lines];
+
+  lines = 0;
+  while (file.getline(line, 1024)) {
+    double x, y, z;
+
+    sscanf(line, "%lf,%lf,%lf\n", &x, &y, &z);
+    t_points[lines] = make_double3(x, y, z);
+    lines++;
+  }
+
+  file.close();
+
+  return t_points;
+}
+
+// great-circle search (-gc): a lat,lon in degrees becomes a point on the
+// unit sphere, where the chord between two points grows with their
+// great-circle distance, so the 3D search finds exactly the points within a
+// great-circle radius if it searches within the matching chord. the
+// embedding has no seams, so the poles and the antimeridian need no special
+// cases.
+double3 geoToUnit(double lat, double lon) {
+  double phi = lat * M_PI / 180, lambda = lon * M_PI / 180;
+  return make_double3(cos(phi) * cos(lambda), cos(phi) * sin(lambda), sin(phi));
+}
+
+// the chord of a great-circle distance on the sphere of radius geoRadius. a
+// distance of half the circumference or more reaches every point, including
+// the antipode, which is exactly 2 away.
+float geoChord(const RTNNState& state, double dist) {
+  double theta = dist / state.geoRadius;
+  if (theta >= M_PI) return std::nextafter(2.0f, 3.0f);
+  return (float)(2 * sin(theta / 2));
+}
+
+// the great-circle distance of a chord.
+float geoDist(const RTNNState& state, float chord) {
+  return (float)(2 * asin(std::min(chord / 2.0, 1.0)) * state.geoRadius);
+}
+
 void printUsageAndExit( const char* argv0 )
 {
     std::cerr << "\e[1mUsage:\e[0m " << argv0 << " [options]\n\n";
@@ -150,7 +217,45 @@ void printUsageAndExit( const char* argv0 )
     std::cerr << "  --msr             | -m      Enable end-to-end measurement? If true, disable CUDA synchronizations for more accurate time measurement (and higher performance). Default is true.\n";
     std::cerr << "  --check           | -c      Enable sanity check? Default is false.\n";
     std::cerr << "  --deferFree       | -df     Defer free-ing intermediate device memory? Default is true.\n";
-
+    std::cerr << "  --perfcounters    | -pc     Report hardware performance counters (cycles, instructions, IPC, LLC/dTLB/branch misses) of the host for each timed phase? Linux only. Use with -m 0 so GPU waits are attributed to the phase. Default is false.\n";
+
+    std::cerr << "  --server          | -sv     Run as a resident search server listening on the given Unix domain socket path. Points (-f) are loaded and sorted once; queries come from clients (see protocol.h and optixNSearchClient). -q, -c and -fq are ignored. Default is off.\n";
+    std::cerr << "  --coalesce        | -co     In server mode, merge concurrent requests with the same mode, radius and K into one search of up to this many queries. 0 disables coalescing. Default is 65536.\n";
+    std::cerr << "  --coalescedelay   | -cod    In server mode, max time in microseconds a request waits for others to coalesce with. Default is 1000.\n";
+    std::cerr << "  --servermaxk      | -smk    In server mode, max neighbors per query a radius-mode request may ask for; larger requests are rejected. Default is 1024.\n";
+    std::cerr << "  --shards          | -sh     In server mode, split the points into this many slabs, each served by its own worker process holding the slab plus a halo of width radius. Default is 0 (no sharding).\n";
+    std::cerr << "  --sharddevices    | -shd    In sharded mode, spread the shards round-robin over this many GPUs starting from -d. Default is 1.\n";
+    std::cerr << "  --shells          | -rs     Radius mode only: comma-separated ascending radii (at most " << MAX_SHELLS << "). One search at the largest radius buckets neighbors into the shells between consecutive radii. Overrides -r. Default is off.\n";
+    std::cerr << "  --shellk          | -rsk    Comma-separated max neighbors per shell, or one value for all shells. Default is -k.\n";
+    std::cerr << "  --shellcounts     | -rsc    Only count the neighbors in each shell (uncapped) instead of returning them. Default is 0.\n";
+    std::cerr << "  --hist            | -hb     Radius mode only: instead of returning neighbors, histogram the distances of all pairs within the radius into this many bins (at most " << MAX_HIST_BINS << ") and report g(r). Default is 0 (off).\n";
+    std::cerr << "  --histweights     | -hw     File with one weight per point (in point file order) for -hb. Also used for the queries if they are the points. Default is all 1.\n";
+    std::cerr << "  --histqweights    | -hqw    File with one weight per query for -hb. Default is all 1.\n";
+    std::cerr << "  --aggregate       | -ag     Radius mode only: instead of returning neighbors, reduce their attributes, read from this file (one row per point in point file order, up to " << MAX_AGG_ATTRS << " comma-separated values), into one value per attribute per query. Default is off.\n";
+    std::cerr << "  --aggop           | -ago    Reduction for -ag: sum, mean, min or max. Default is sum.\n";
+    std::cerr << "  --aggkernel       | -agk    Weight of a neighbor in sums and means by its distance d: flat (1), gauss (exp(-d^2/(2 sigma^2))), tri (1 - d/r) or epan (1 - (d/r)^2). Default is flat.\n";
+    std::cerr << "  --aggsigma        | -ags    Sigma of the gauss kernel. Default is half the radius.\n";
+    std::cerr << "  --sph             | -sph    Radius mode only: instead of returning neighbors, compute the SPH density and the pressure and viscosity force of each point, with the cubic spline kernel whose support is the radius. Points are the particles; no -q. Default is false.\n";
+    std::cerr << "  --sphmass         | -sphm   Mass of each SPH particle. Default is 1.\n";
+    std::cerr << "  --sphrest         | -sphr   SPH rest density. Default is the average density.\n";
+    std::cerr << "  --sphstiff        | -sphk   SPH stiffness k of the equation of state p = k (rho - rest density). Default is 1.\n";
+    std::cerr << "  --sphvisc         | -sphmu  SPH dynamic viscosity. Default is 0.\n";
+    std::cerr << "  --sphvel          | -sphv   File of SPH particle velocities, one x,y,z line per point in point file order. Default is all at rest.\n";
+    std::cerr << "  --knngraph        | -kg     Build the undirected neighbor graph of the points (no -q) instead of returning neighbors: union (j is a neighbor of i or i of j) or mutual (both). The output file (-o) gets one line of adjacent point ids per point. Default is off.\n";
+    std::cerr << "  --boxes           | -bq     Instead of searching, return the points inside each box of this file (one minx,miny,minz,maxx,maxy,maxz line per box), evaluated over a grid sized by the point density. The output file (-o) gets one line of point ids per box. Default is off.\n";
+    std::cerr << "  --capsules        | -cq     Instead of searching, return the points within Euclidean distance r of each segment of this file (one x0,y0,z0,x1,y1,z1[,r] line per capsule; r defaults to -r), evaluated over the same grid as -bq. The output file (-o) gets one line of point ids per capsule. Default is off.\n";
+    std::cerr << "  --boxcounts       | -bqc    Only count the points inside each box (-bq) or capsule (-cq). Default is 0.\n";
+    std::cerr << "  --searchdim       | -sd     Search dimension: 2 (all points and queries share one z), 3, or 0 to use 2 if the data are planar and 3 otherwise. The server, pipelined and job modes are always 3D. Default is 0.\n";
+    std::cerr << "  --axisscale       | -ms     Comma-separated x,y,z multipliers applied to all coordinates before searching, e.g., 1,1,4 to make vertical offsets count 4 times as much. Turns any metric (see -DMETRIC) into its per-axis weighted form. Distances and radii are in the scaled space. Can't be combined with -sv, -pl or -j. Default is 1,1,1.\n";
+    std::cerr << "  --greatcircle     | -gc     Great-circle search on a sphere of this radius: each row is lat,lon in degrees, -r (and -rs) are great-circle distances and reported distances are too. Use 1 for angles in radians or 6371.0088 for km on the Earth. L2 builds only; can't be combined with -sv, -hb or -ms. Default is 0 (off).\n";
+    std::cerr << "  --double          | -dp     Read coordinates in double precision, e.g., UTM or ECEF. They are rebased to the center of the data and searched in float with a radius widened by the float error bound; the pairs within that bound of the radius are rechecked in double. Can't be combined with -sv, -pl, -j, -rs or -hb. Default is false.\n";
+    std::cerr << "  --jobs            | -j      Run the search configurations listed in this file (see jobs.cpp) back to back against points loaded and sorted once. Default is off.\n";
+    std::cerr << "  --saveindex       | -si     In server, pipelined or job mode, save the loaded (sorted) points to this file, which -li can restore. Default is off.\n";
+    std::cerr << "  --loadindex       | -li     In server, pipelined or job mode, restore the points from a file saved with -si instead of reading and sorting -f. Default is off.\n";
+    std::cerr << "  --pipeline        | -pl     Stream the queries in chunks of this many queries through overlapped parse, search and output stages. Points are loaded and sorted once. -c and -fq are ignored. Default is 0 (off).\n";
+    std::cerr << "  --pipelinedepth   | -pld    Max chunks waiting between two pipeline stages. Default is 2.\n";
+    std::cerr << "  --output          | -o      Write the neighbors (original point ids) of each query, one line per query, to this file. Pipelined mode, radius shells (-rs), histograms (-hb, as lo,hi,pairs,g lines) aggregates (-ag, as the values and the neighbor count), SPH (-sph, as density,fx,fy,fz), graphs (-kg, as adjacency lists) and KNN with K = 1 (as id:distance) only.\n";
+    std::cerr << "  --outdists        | -od     Write id:distance instead of id to the output file? Default is false.\n";
     std::cerr << "  --help            | -h      Print this usage message\n";
 
 
@@ -159,6 +264,10 @@ void printUsageAndExit( const char* argv0 )
     std::cerr << "  --filterQueries   | -fq     Filter remote queries that are impossible to reach any point? Default is false.\n";
     std::cerr << "  --partition       | -p      Allow query partitioning? Enable it for better performance. Default is true.\n";
     std::cerr << "  --approx          | -a      Approximate query partitioning mode for KNN search. Range search is always exact. {0: no approx, i.e., 3D circumRadius for 3D search; 1: 2D circumRadius for 3D search; 2: equiVol approx in query partitioning)} See |radiusFromMegacell| function. Default is 2.\n";
+    std::cerr << "  --knneps          | -ke     KNN mode only: return neighbors whose Kth distance is provably within (1 + eps) of the exact one, skipping queue updates that improve it by less. Implies -rp 1, or -a 0 with -sv, -pl or -j. Default is 0 (exact).\n";
+    std::cerr << "  --repair          | -rp     KNN mode only: re-search, at the full radius, the partitioned queries that found fewer than K neighbors within their partition's radius, so that the approximate partitioning (-a) gives exact results. Default is false.\n";
+    std::cerr << "  --truncate        | -tp     Radius mode only: which neighbors to keep when a query has more than -k. first (the first found, which ends the search of a query early), closest (the K closest) or random (a uniform random sample). Default is first.\n";
+    std::cerr << "  --truncseed       | -ts     Seed of -tp random. Default is 0.\n";
 
     std::cerr << "  --autobatch       | -ab     Automatically determining how to batch partitions? Default is true.\n";
     std::cerr << "  --numbatch        | -nb     Specify the number of batches when batching partitions. It's used only if -ab is false. Default nb is -1, which uses the max available batch; otherwise the numebr of batches to launch = min(avail batches, nb).\n";
@@ -180,6 +289,20 @@ void printUsageAndExit( const char* argv0 )
     exit( 0 );
 }
 
+// a truncation policy by its name on the command line or in a job file.
+bool parseTruncPolicy( const std::string& name, TruncPolicy* policy ) {
+  if (name == "first") *policy = TRUNC_FIRST;
+  else if (name == "closest") *policy = TRUNC_CLOSEST;
+  else if (name == "random") *policy = TRUNC_RANDOM;
+  else return false;
+  return true;
+}
+
+// the modes that keep the points resident and search many query sets
+static bool resident( const RTNNState& state ) {
+  return !state.serverSock.empty() || state.pipelineChunk || !state.jobFile.empty();
+}
+
 void parseArgs( RTNNState& state,  int argc, char* argv[] ) {
   for( int i = 1; i < argc; ++i )
   {
@@ -233,6 +356,269 @@ void parseArgs( RTNNState& state,  int argc, char* argv[] ) {
               printUsageAndExit( argv[0] );
           state.deferFree = (bool)(atoi(argv[++i]));
       }
+      else if( arg == "--perfcounters" || arg == "-pc" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.perfCounters = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--server" || arg == "-sv" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.serverSock = argv[++i];
+      }
+      else if( arg == "--coalesce" || arg == "-co" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.coalesceQueries = atoi(argv[++i]);
+      }
+      else if( arg == "--coalescedelay" || arg == "-cod" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.coalesceDelay = atoi(argv[++i]);
+          if (state.coalesceDelay < 0)
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--servermaxk" || arg == "-smk" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.serverMaxKnn = atoi(argv[++i]);
+          if (state.serverMaxKnn == 0)
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--shards" || arg == "-sh" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.numShards = atoi(argv[++i]);
+      }
+      else if( arg == "--sharddevices" || arg == "-shd" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.shardDevices = atoi(argv[++i]);
+          if (state.shardDevices < 1)
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--shells" || arg == "-rs" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          std::stringstream ss(argv[++i]);
+          std::string tok;
+          while (std::getline(ss, tok, ','))
+              state.shellRadii.push_back(atof(tok.c_str()));
+      }
+      else if( arg == "--shellk" || arg == "-rsk" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          std::stringstream ss(argv[++i]);
+          std::string tok;
+          while (std::getline(ss, tok, ','))
+              state.shellKs.push_back(atoi(tok.c_str()));
+      }
+      else if( arg == "--shellcounts" || arg == "-rsc" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.params.shellCounts = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--hist" || arg == "-hb" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.params.histBins = atoi(argv[++i]);
+      }
+      else if( arg == "--histweights" || arg == "-hw" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.histWeightFile = argv[++i];
+      }
+      else if( arg == "--histqweights" || arg == "-hqw" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.histQWeightFile = argv[++i];
+      }
+      else if( arg == "--aggregate" || arg == "-ag" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.aggFile = argv[++i];
+      }
+      else if( arg == "--aggop" || arg == "-ago" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          std::string op = argv[++i];
+          if (op == "sum") state.params.aggOp = AGG_SUM;
+          else if (op == "mean") state.params.aggOp = AGG_MEAN;
+          else if (op == "min") state.params.aggOp = AGG_MIN;
+          else if (op == "max") state.params.aggOp = AGG_MAX;
+          else printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--aggkernel" || arg == "-agk" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          std::string kernel = argv[++i];
+          if (kernel == "flat") state.params.aggKernel = AGG_FLAT;
+          else if (kernel == "gauss") state.params.aggKernel = AGG_GAUSS;
+          else if (kernel == "tri") state.params.aggKernel = AGG_TRIANGLE;
+          else if (kernel == "epan") state.params.aggKernel = AGG_EPAN;
+          else printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--aggsigma" || arg == "-ags" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.params.aggSigma = atof(argv[++i]);
+      }
+      else if( arg == "--sph" || arg == "-sph" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.sph = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--sphmass" || arg == "-sphm" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.params.sphMass = atof(argv[++i]);
+      }
+      else if( arg == "--sphrest" || arg == "-sphr" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.params.sphRestDensity = atof(argv[++i]);
+      }
+      else if( arg == "--sphstiff" || arg == "-sphk" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.params.sphStiffness = atof(argv[++i]);
+      }
+      else if( arg == "--sphvisc" || arg == "-sphmu" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.params.sphViscosity = atof(argv[++i]);
+      }
+      else if( arg == "--sphvel" || arg == "-sphv" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.sphVelFile = argv[++i];
+      }
+      else if( arg == "--knngraph" || arg == "-kg" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.graphMode = argv[++i];
+          if (state.graphMode != "union" && state.graphMode != "mutual")
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--boxes" || arg == "-bq" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.boxFile = argv[++i];
+      }
+      else if( arg == "--capsules" || arg == "-cq" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.capsuleFile = argv[++i];
+      }
+      else if( arg == "--boxcounts" || arg == "-bqc" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.regionCounts = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--searchdim" || arg == "-sd" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.searchDim = atoi(argv[++i]);
+          if (state.searchDim != 0 && state.searchDim != 2 && state.searchDim != 3)
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--axisscale" || arg == "-ms" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          std::stringstream ss(argv[++i]);
+          std::string tok;
+          while (std::getline(ss, tok, ','))
+              state.axisScales.push_back(atof(tok.c_str()));
+          if (state.axisScales.size() != 3)
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--greatcircle" || arg == "-gc" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.geoRadius = atof(argv[++i]);
+          if (state.geoRadius < 0)
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--double" || arg == "-dp" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.doublePrec = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--jobs" || arg == "-j" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.jobFile = argv[++i];
+      }
+      else if( arg == "--saveindex" || arg == "-si" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.indexOut = argv[++i];
+      }
+      else if( arg == "--loadindex" || arg == "-li" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.indexIn = argv[++i];
+      }
+      else if( arg == "--pipeline" || arg == "-pl" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.pipelineChunk = atoi(argv[++i]);
+      }
+      else if( arg == "--pipelinedepth" || arg == "-pld" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.pipelineDepth = atoi(argv[++i]);
+          if (state.pipelineDepth == 0)
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--output" || arg == "-o" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.outfile = argv[++i];
+      }
+      else if( arg == "--outdists" || arg == "-od" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.outDists = (bool)(atoi(argv[++i]));
+      }
       else if( arg == "--filterQueries" || arg == "-fq" )
       {
           if( i >= argc - 1 )
@@ -325,7 +711,32 @@ void parseArgs( RTNNState& state,  int argc, char* argv[] ) {
       {
           if( i >= argc - 1 )
               printUsageAndExit( argv[0] );
-          state.approxMode = (bool)(atoi(argv[++i]));
+          state.approxMode = atoi(argv[++i]);
+      }
+      else if( arg == "--knneps" || arg == "-ke" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.knnEps = atof(argv[++i]);
+          if (state.knnEps < 0)
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--repair" || arg == "-rp" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.repair = (bool)(atoi(argv[++i]));
+      }
+      else if( arg == "--truncate" || arg == "-tp" )
+      {
+          if( i >= argc - 1 || !parseTruncPolicy(argv[++i], &state.params.truncPolicy) )
+              printUsageAndExit( argv[0] );
+      }
+      else if( arg == "--truncseed" || arg == "-ts" )
+      {
+          if( i >= argc - 1 )
+              printUsageAndExit( argv[0] );
+          state.params.truncSeed = atoi(argv[++i]);
       }
       else if( arg == "--check" || arg == "-c" )
       {
@@ -380,19 +791,325 @@ void parseArgs( RTNNState& state,  int argc, char* argv[] ) {
   if (sameSortMode && state.sameData) {
     state.samepq = true;
   }
+
+  // in server mode queries come from requests, which are never the points.
+  // results are returned in the clients' order with original point ids. a
+  // request with no query in reach of the points must not end the process,
+  // so no filtering. the same goes for the query sets of jobs.
+  if (!state.serverSock.empty() || !state.jobFile.empty()) {
+    state.qfile.clear();
+    state.sameData = false;
+    state.samepq = false;
+    state.trackIds = true;
+    state.sanCheck = false;
+    state.filterQueries = false;
+  }
+
+  // in pipelined mode queries are streamed from the file later, so they are
+  // never the (resident) points either.
+  if (state.pipelineChunk) {
+    if (state.qfile.empty()) state.qfile = state.pfile;
+    state.sameData = false;
+    state.samepq = false;
+    state.trackIds = true;
+    state.sanCheck = false;
+    state.filterQueries = false;
+  }
+
+  // the queries of the resident modes are unknown upfront, so they can't be
+  // held to one plane.
+  if (resident(state)) {
+    if (state.searchDim == 2) {
+      std::cerr << "-sd 2 can't be combined with -sv, -pl or -j\n";
+      printUsageAndExit( argv[0] );
+    }
+    state.searchDim = 3;
+  }
+
+  // great-circle search runs on unit vectors within the chords of the
+  // requested radii. requests of the server carry float coordinates, too
+  // coarse for lat/lon, and histogram bins would be over chords. snapshots
+  // hold float points only (no lat/lon to convert) and don't record -gc.
+  if (state.geoRadius > 0) {
+    if (METRIC != METRIC_L2 || !state.serverSock.empty() || state.params.histBins || !state.axisScales.empty() ||
+        !state.indexIn.empty() || !state.indexOut.empty()) {
+      std::cerr << "-gc needs an L2 build and can't be combined with -sv, -hb, -ms, -si or -li\n";
+      printUsageAndExit( argv[0] );
+    }
+    state.geoSearchRadius = state.radius;
+    state.radius = geoChord(state, state.radius);
+    for (float& r : state.shellRadii) r = geoChord(state, r);
+  }
+
+  // radius shells: one search at the largest radius whose rows are split
+  // into per-shell slots (or counts). results are packed per original query,
+  // and the sanity check doesn't know about shells. a partitioned batch
+  // would be launched below the largest radius and miss the outer shells.
+  state.params.numShells = state.shellRadii.size();
+  if (state.params.numShells) {
+    bool ascending = std::is_sorted(state.shellRadii.begin(), state.shellRadii.end(), std::less_equal<float>()) &&
+                     state.shellRadii[0] > 0;
+    if (state.shellKs.size() == 1) state.shellKs.assign(state.params.numShells, state.shellKs[0]);
+    else if (state.shellKs.empty()) state.shellKs.assign(state.params.numShells, state.knn);
+
+    if (state.searchMode != "radius" || state.params.numShells > MAX_SHELLS || !ascending ||
+        state.shellKs.size() != state.params.numShells || resident(state)) {
+      std::cerr << "-rs needs radius mode, at most " << MAX_SHELLS << " ascending radii, one -rsk per radius, and can't be combined with -sv, -pl or -j\n";
+      printUsageAndExit( argv[0] );
+    }
+
+    unsigned int base = 0;
+    for (unsigned int s = 0; s < state.params.numShells; s++) {
+      state.params.shellRadii2[s] = metricKey(state.shellRadii[s]);
+      state.params.shellLimit[s] = state.shellKs[s];
+      state.params.shellBase[s] = base;
+      base += state.shellKs[s];
+    }
+    state.radius = state.shellRadii.back();
+    state.knn = state.params.shellCounts ? state.params.numShells : base;
+    state.trackIds = true;
+    state.sanCheck = false;
+    state.partition = false;
+  }
+
+  // pair-distance histograms: no neighbor is stored, so a row needs just one
+  // (unused) slot. the weights are looked up by original ids. every pair
+  // within the radius must be binned, which a partitioned batch (launched
+  // below the radius) wouldn't do.
+  if (state.params.histBins) {
+    if (state.searchMode != "radius" || state.params.histBins > MAX_HIST_BINS ||
+        state.params.numShells || resident(state)) {
+      std::cerr << "-hb needs radius mode, at most " << MAX_HIST_BINS << " bins, and can't be combined with -rs, -sv, -pl or -j\n";
+      printUsageAndExit( argv[0] );
+    }
+    state.params.histRadius = state.radius;
+    state.knn = 1;
+    state.sanCheck = false;
+    state.partition = false;
+    if (!state.histWeightFile.empty() || !state.histQWeightFile.empty()) state.trackIds = true;
+  }
+
+  // neighbor aggregates: like histograms no neighbor is stored, and the
+  // attributes and the outputs are indexed by original ids. every neighbor
+  // within the radius must be reduced, so no partitioning either.
+  if (!state.aggFile.empty()) {
+    if (state.searchMode != "radius" || state.params.numShells || state.params.histBins || resident(state)) {
+      std::cerr << "-ag needs radius mode and can't be combined with -rs, -hb, -sv, -pl or -j\n";
+      printUsageAndExit( argv[0] );
+    }
+    state.params.aggRadius = state.radius;
+    state.knn = 1;
+    state.trackIds = true;
+    state.sanCheck = false;
+    state.partition = false;
+  }
+
+  // SPH: the particles are both the points and the queries, and the force
+  // pass needs the densities of all particles, so there is a single batch.
+  // the kernel is radial in Euclidean space.
+  if (state.sph) {
+    if (state.searchMode != "radius" || !state.sameData || METRIC != METRIC_L2 || state.params.numShells ||
+        state.params.histBins || !state.aggFile.empty() || resident(state) || state.geoRadius > 0 || !state.axisScales.empty()) {
+      std::cerr << "-sph needs radius mode, an L2 build and no -q, and can't be combined with -rs, -hb, -ag, -sv, -pl, -j, -gc or -ms\n";
+      printUsageAndExit( argv[0] );
+    }
+    state.knn = 1;
+    state.trackIds = true;
+    state.sanCheck = false;
+    state.partition = false;
+    state.filterQueries = false;
+  }
+
+  // eps-approximate KNN: the bound needs every query to find K neighbors
+  // within its launch radius. certify-and-repair re-searches the queries that
+  // don't, so the partitions can use any megacell radius, shrunk by 1+eps
+  // (see |genBatches|). the resident modes can't repair, so they fall back to
+  // the circumscribed radius of a megacell, which guarantees K neighbors; see
+  // |radiusFromMegacell|.
+  if (state.knnEps > 0) {
+    if (state.searchMode != "knn") {
+      std::cerr << "-ke needs KNN mode\n";
+      printUsageAndExit( argv[0] );
+    }
+    if (resident(state)) state.approxMode = 0;
+    else state.repair = true;
+  }
+  state.params.knnEpsScale = metricKey(1.0f + state.knnEps);
+
+  // truncation policies only apply to the rows of a plain radius search.
+  if (state.params.truncPolicy != TRUNC_FIRST &&
+      (state.searchMode != "radius" || state.params.numShells || state.params.histBins || !state.aggFile.empty() || state.sph)) {
+    std::cerr << "-tp needs radius mode and can't be combined with -rs, -hb, -ag or -sph\n";
+    printUsageAndExit( argv[0] );
+  }
+  // closest and random choose among all the neighbors within the radius, but
+  // a partitioned batch is launched below it (in AABBTEST mode).
+  if (state.params.truncPolicy != TRUNC_FIRST) state.partition = false;
+
+  // certify-and-repair works on the batches of the main search.
+  if (state.repair && (state.searchMode != "knn" || resident(state))) {
+    std::cerr << "-rp needs KNN mode and can't be combined with -sv, -pl or -j\n";
+    printUsageAndExit( argv[0] );
+  }
+
+  // 1-NN builds also return the distance of each query's nearest neighbor,
+  // which the ray writes by original query id.
+  if (K == 1 && state.searchMode == "knn" && !resident(state)) state.trackIds = true;
+
+  // KNN graph: the points are the nodes, so they must be the queries too.
+  if (!state.graphMode.empty()) {
+    if (!state.sameData || state.params.numShells || state.params.histBins || !state.aggFile.empty() ||
+        state.sph || resident(state)) {
+      std::cerr << "-kg needs no -q and can't be combined with -rs, -hb, -ag, -sph, -sv, -pl or -j\n";
+      printUsageAndExit( argv[0] );
+    }
+    state.trackIds = true;
+  }
+
+  // region queries replace the search and read the points in original order;
+  // the regions are in unscaled 3D coordinates.
+  if (!state.boxFile.empty() || !state.capsuleFile.empty()) {
+    if ((!state.boxFile.empty() && !state.capsuleFile.empty()) || resident(state) || state.params.numShells || state.params.histBins || !state.aggFile.empty() || state.sph ||
+        !state.graphMode.empty() || state.doublePrec || state.geoRadius > 0 || !state.axisScales.empty()) {
+      std::cerr << "-bq and -cq can't be combined with each other or with -sv, -pl, -j, -rs, -hb, -ag, -sph, -kg, -dp, -gc or -ms\n";
+      printUsageAndExit( argv[0] );
+    }
+    state.filterQueries = false;
+  }
+
+  // the queries of the resident modes are read elsewhere and wouldn't be
+  // scaled.
+  if (!state.axisScales.empty() && resident(state)) {
+    std::cerr << "-ms can't be combined with -sv, -pl or -j\n";
+    printUsageAndExit( argv[0] );
+  }
+
+  // double-precision input is rechecked in the rows of a batch search, by
+  // original ids.
+  if (state.doublePrec) {
+    if (resident(state) || state.params.numShells || state.params.histBins || !state.aggFile.empty() || state.sph) {
+      std::cerr << "-dp can't be combined with -sv, -pl, -j, -rs, -hb, -ag or -sph\n";
+      printUsageAndExit( argv[0] );
+    }
+    state.trackIds = true;
+    state.sanCheck = false;
+  }
+
+  // snapshots hold the resident points, which only the server, the pipelined
+  // and the job mode have. a sharded server's router needs the whole cloud to
+  // cut it, and each worker holds just its slab, so no snapshots there.
+  if ((!state.indexIn.empty() || !state.indexOut.empty()) && (!resident(state) || state.numShards > 1)) {
+    std::cerr << "-si/-li need -sv (without -sh), -pl or -j\n";
+    printUsageAndExit( argv[0] );
+  }
+  if (state.pipelineChunk && state.qfile.empty()) {
+    std::cerr << "-pl needs -q when points come from -li\n";
+    printUsageAndExit( argv[0] );
+  }
+}
+
+// the number of coordinates of the first row of a file, rounded up to a
+// multiple of 3 as in |tokenize|.
+static int fileDim(const char* data_file) {
+  std::ifstream file(data_file);
+  std::string line;
+  if (!std::getline(file, line) || line.empty()) return 3;
+  return tokenize(line, ",", nullptr, 0);
+}
+
+// per-axis weighted metrics: a weighted distance is the plain distance of
+// scaled coordinates, so scaling the input once keeps the kernels (and the
+// grids and partitions, which then see the scaled extents) unchanged. only
+// the first three coordinates of N-D data are scaled.
+template <typename T> static void scaleAxes(const RTNNState& state, T* p, unsigned int n) {
+  for (unsigned int i = 0; i < n; i++) {
+    p[i].x *= state.axisScales[0];
+    p[i].y *= state.axisScales[1];
+    p[i].z *= state.axisScales[2];
+  }
+}
+
+// fill the float points and queries that are searched from the double ones
+// read by -dp or -gc.
+static void toFloat(RTNNState& state) {
+  for (unsigned int i = 0; i < state.numPoints; i++)
+    state.h_points[i] = rebase(state.h_dpoints[i], state.origin);
+  if (state.h_queries != state.h_points) {
+    for (unsigned int i = 0; i < state.numQueries; i++)
+      state.h_queries[i] = rebase(state.h_dqueries[i], state.origin);
+  }
+}
+
+// double-precision input: subtract the center of the points' and queries'
+// bounding box in double, so that the floats the search runs on only span the
+// extent of the data rather than its distance from the coordinate origin. a
+// rebased coordinate is then off by at most extent * 2^-24, so a float
+// distance is off by at most 2 * 3 times that (for L1; 2 * sqrt(3) for L2)
+// plus the rounding of the distance computation itself. the radius is widened by that bound so that
+// no neighbor is missed; |recheckDouble| drops the extra ones.
+static void rebaseDouble(RTNNState& state) {
+  double3 lo = state.h_dpoints[0];
+  double3 hi = lo;
+  auto grow = [&lo, &hi](const double3* p, unsigned int n) {
+    for (unsigned int i = 0; i < n; i++) {
+      lo = make_double3(std::min(lo.x, p[i].x), std::min(lo.y, p[i].y), std::min(lo.z, p[i].z));
+      hi = make_double3(std::max(hi.x, p[i].x), std::max(hi.y, p[i].y), std::max(hi.z, p[i].z));
+    }
+  };
+  grow(state.h_dpoints, state.numPoints);
+  if (state.h_dqueries != state.h_dpoints) grow(state.h_dqueries, state.numQueries);
+  state.origin = make_double3((lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2);
+  toFloat(state);
+
+  double extent = std::max({hi.x - lo.x, hi.y - lo.y, hi.z - lo.z}) / 2;
+  state.dRadius = state.radius;
+  state.dpEps = (2 * 3 * extent + 4 * state.radius) * FLT_EPSILON;
+  state.radius += state.dpEps;
+  fprintf(stdout, "\tRebased to (%f, %f, %f); float distance error bound: %g\n",
+      state.origin.x, state.origin.y, state.origin.z, state.dpEps);
 }
 
 void readData(RTNNState& state) {
-  state.h_points = read_pc_data(state.pfile.c_str(), &state.numPoints);
+  Timing::startTiming("read points and/or queries");
+  if (!state.indexIn.empty()) mapIndex(state);
+  else if (state.doublePrec || state.geoRadius > 0) {
+    if (fileDim(state.pfile.c_str()) > 3) {
+      std::cerr << "-dp and -gc need data with at most 3 coordinates\n";
+      exit(1);
+    }
+    state.h_dpoints = read_pc_data_double(state.pfile.c_str(), &state.numPoints);
+    state.h_points = new float3[state.numPoints]; // see |toFloat|
+  }
+  else if (fileDim(state.pfile.c_str()) > 3) {
+    state.h_ndpoints = read_pc_data(state.pfile.c_str(), &state.numPoints, &state.dim);
+    state.h_points = state.h_ndpoints[0];
+  }
+  else state.h_points = read_pc_data(state.pfile.c_str(), &state.numPoints);
   state.h_queries = state.h_points;
+  state.h_ndqueries = state.h_ndpoints;
+  state.h_dqueries = state.h_dpoints;
   state.numQueries = state.numPoints;
 
-  if (!state.samepq) { // if can't share the host memory
+  if (!state.samepq && state.serverSock.empty() && !state.pipelineChunk && state.jobFile.empty()) { // if can't share the host memory
     if (!state.qfile.empty() && (state.qfile != state.pfile)) {
       // if the underlying data are different, read it
-      state.h_queries = read_pc_data(state.qfile.c_str(), &state.numQueries);
+      if (fileDim(state.qfile.c_str()) != state.dim) {
+        std::cerr << state.qfile << " and " << state.pfile << " have different dimensions\n";
+        exit(1);
+      }
+      if (state.doublePrec || state.geoRadius > 0) {
+        state.h_dqueries = read_pc_data_double(state.qfile.c_str(), &state.numQueries);
+        state.h_queries = new float3[state.numQueries];
+      }
+      else if (state.dim > 3) {
+        int dim;
+        state.h_ndqueries = read_pc_data(state.qfile.c_str(), &state.numQueries, &dim);
+        state.h_queries = state.h_ndqueries[0];
+      }
+      else state.h_queries = read_pc_data(state.qfile.c_str(), &state.numQueries);
     } else {
-      // if underlying data are the same, copy it
+      // if underlying data are the same, copy it. the coordinates beyond the
+      // first three are never reordered, so they can still be shared.
       state.h_queries = (float3*)malloc(state.numQueries * sizeof(float3));
       thrust::copy(state.h_points, state.h_points+state.numQueries, state.h_queries);
     }
@@ -402,27 +1119,87 @@ void readData(RTNNState& state) {
     fprintf(stdout, "empty query and/or points\n");
     exit(0);
   }
+
+  if (!state.axisScales.empty()) {
+    if (state.doublePrec) {
+      scaleAxes(state, state.h_dpoints, state.numPoints);
+      if (state.h_dqueries != state.h_dpoints) scaleAxes(state, state.h_dqueries, state.numQueries);
+    } else {
+      scaleAxes(state, state.h_points, state.numPoints);
+      if (state.h_queries != state.h_points) scaleAxes(state, state.h_queries, state.numQueries);
+    }
+  }
+  if (state.geoRadius > 0) {
+    for (unsigned int i = 0; i < state.numPoints; i++)
+      state.h_dpoints[i] = geoToUnit(state.h_dpoints[i].x, state.h_dpoints[i].y);
+    if (state.h_dqueries != state.h_dpoints) {
+      for (unsigned int i = 0; i < state.numQueries; i++)
+        state.h_dqueries[i] = geoToUnit(state.h_dqueries[i].x, state.h_dqueries[i].y);
+    }
+  }
+  if (state.doublePrec) rebaseDouble(state);
+  else if (state.h_dpoints) toFloat(state);
+
+  // N-D data: the BVH and grids filter on the first three coordinates, whose
+  // distance never exceeds the full one, and the intersection programs add
+  // the rest (see |ndKey|), which are looked up by original ids. query
+  // partitions are sized by the 3D density, which says nothing about how
+  // many neighbors are within reach in N-D, so there is a single batch.
+  if (state.dim > 3) {
+    if (resident(state) || state.params.numShells || state.params.histBins || !state.aggFile.empty() || state.sph ||
+        !state.graphMode.empty() || state.params.truncPolicy == TRUNC_CLOSEST || !state.boxFile.empty() ||
+        !state.capsuleFile.empty()) {
+      std::cerr << "data with more than 3 coordinates can't be combined with -sv, -pl, -j, -rs, -hb, -ag, -sph, -kg, -bq, -cq or -tp closest\n";
+      exit(1);
+    }
+    state.trackIds = true;
+    state.partition = false;
+    state.sanCheck = false;
+  }
+  Timing::setQueryCount(state.numQueries);
+  Timing::stopTiming(true);
 }
 
+// the geometry below depends on the metric (see metric.h): a "sphere"
+// ("circle") is the ball of the metric, i.e., a sphere for L2, an octahedron
+// (diamond) for L1 and a cube (square) for Linf.
+
 // this function returns the width of the inscribed cube (square) of a sphere (circle)
 float maxInscribedWidth(float radius, int dim) {
-  if (dim == 2) return radius/sqrt(2)*2;
-  else if (dim == 3) return radius/sqrt(3)*2;
-  else assert(0);
+  assert(dim == 2 || dim == 3);
+#if METRIC == METRIC_L1
+  return radius/dim*2;
+#elif METRIC == METRIC_LINF
+  return radius*2;
+#else
+  return radius/sqrt(dim)*2;
+#endif
 }
 
 // this function returns the radius of the circumsphere (circumcircle) of a cube (square)
 float minCircumscribedRadius(float width, int dim) {
-  if (dim == 2) return width/2*sqrt(2);
-  else if (dim == 3) return width/2*sqrt(3);
-  else assert(0);
+  assert(dim == 2 || dim == 3);
+#if METRIC == METRIC_L1
+  return width/2*dim;
+#elif METRIC == METRIC_LINF
+  return width/2;
+#else
+  return width/2*sqrt(dim);
+#endif
 }
 
 // this function returns the radius of a sphere (circle) with same volume of a cube (square)
 float radiusEquiVolume(float width, int dim) {
+  assert(dim == 2 || dim == 3);
+#if METRIC == METRIC_L1
+  if (dim == 2) return width*sqrt(0.5);
+  else return width*cbrt(0.75);
+#elif METRIC == METRIC_LINF
+  return width/2;
+#else
   if (dim == 2) return width*sqrt(1/M_PI);
-  else if (dim == 3) return width*cbrt(3/(4*M_PI));
-  else assert(0);
+  else return width*cbrt(3/(4*M_PI));
+#endif
 }
 
 void countFromGasSort(RTNNState& state, int& qCount, int& pCount) {
@@ -512,7 +1289,9 @@ float estGASLtdSize(RTNNState& state,
   // set numOfBatches to 1 if no partitioning or nb==1
   bool isOneBatch = (!state.partition || (!state.autoNB && state.numOfBatches == 1));
   float numOfBatches = spaceAvail / gasSize;
-  float cellSize = isOneBatch ? 0 : state.radius / (sqrt(3) * (numOfBatches - 1));
+  // the inverse of the batch count in |initBatches|
+  float halfWidth = maxInscribedWidth(state.radius, state.searchDim) / 2;
+  float cellSize = isOneBatch ? 0 : halfWidth / (numOfBatches - 1);
   fprintf(stdout, "spaceAvail for GAS: %f\n", spaceAvail/1024/1024);
   fprintf(stdout, "max numofBatches: %f\n", numOfBatches);
   fprintf(stdout, "GAS limited cellSize: %f\n", cellSize);
@@ -525,9 +1304,15 @@ float estSortLtdSize(RTNNState& state,
                 int cellArrayCount,
                 bool refine = false) {
   // could |genGridInfo| too but doesn't matter
-  float sceneVolume = (state.Max.x - state.Min.x) * (state.Max.y - state.Min.y) * (state.Max.z - state.Min.z);
   float numOfSortingCells = spaceAvail / (cellArrayCount * sizeof(unsigned int));
-  float cellSize = cbrt(sceneVolume / numOfSortingCells);
+  float cellSize;
+  if (state.searchDim == 2) {
+    float sceneArea = (state.Max.x - state.Min.x) * (state.Max.y - state.Min.y);
+    cellSize = sqrt(sceneArea / numOfSortingCells);
+  } else {
+    float sceneVolume = (state.Max.x - state.Min.x) * (state.Max.y - state.Min.y) * (state.Max.z - state.Min.z);
+    cellSize = cbrt(sceneVolume / numOfSortingCells);
+  }
 
   if (refine) {
     float curSortingSize = numOfSortingCells * (cellArrayCount * sizeof(unsigned int));
@@ -560,6 +1345,10 @@ float calcCRRatio(RTNNState& state) {
 
   // +1 to include the space for initial search which always returns 1 element
   float returnDataSize = Q * (state.knn + 1) * sizeof(unsigned int);
+  // plus the scratch rows (keys and ids) of large-K KNN: one per launch
+  // thread, which is at most one per resident thread; see |launchWidth|.
+  if (K > LARGE_K && state.searchMode == "knn")
+    returnDataSize += (float)launchWidth(state, Q) * KNN_SCRATCH * (sizeof(float) + sizeof(unsigned int));
 
   int pNArrayCount, qNArrayCount;
   int cellArrayCount;
@@ -630,7 +1419,7 @@ float calcCRRatio(RTNNState& state) {
 
     // algorithm to estimate the cellSize
     //   total gas size + total sorting structure size <= avail mem
-    //   total gas size = (state.radius / (sqrt(3) * cellSize) + 1) * gasSize; // TODO (sqrt(2) for 2D)
+    //   total gas size = (maxInscribedWidth(radius, dim) / 2 / cellSize + 1) * gasSize;
     //   total sorting structure size = sceneVolume / power(cellSize, 3) * (cellArrayCount * sizeof(unsigned int));
     //   it's a cubic equation. don't want to solve it analytically. let's do that
     //   iteratively. the initial size is the smallest cell size that can
@@ -645,6 +1434,7 @@ float calcCRRatio(RTNNState& state) {
     float curTotalSize = 0;
     float numOfBatches, numOfSortingCells;
     bool isOneBatch = (!state.partition || (!state.autoNB && state.numOfBatches == 1));
+    float halfWidth = maxInscribedWidth(state.radius, state.searchDim) / 2;
     // TODO: the strategy here is to find the smallest cell size, which could
     // lead to a high batch number (>100) and thus increase the
     // |kCalcSearchSize| cost. this is particularly an issue when -df is
@@ -652,7 +1442,7 @@ float calcCRRatio(RTNNState& state) {
     // will be huge memory space left to find a very small cell size. an
     // example is: -f data/buddha.txt -q data/kitti6m.txt -fq 0
     while (1) {
-      numOfBatches = isOneBatch ? 1.0 : state.radius / (sqrt(3) * cellSize) + 1;
+      numOfBatches = isOneBatch ? 1.0 : halfWidth / cellSize + 1;
       curGASSize = numOfBatches * gasSize;
 
       GridInfo gridInfo;
@@ -686,7 +1476,7 @@ void initBatches(RTNNState& state) {
 
   // see |genCellMask| for the logic behind this.
   float cellSize = state.radius / state.crRatio;
-  float maxWidth = maxInscribedWidth(state.radius, 3); // for 3D
+  float maxWidth = maxInscribedWidth(state.radius, state.searchDim);
   int maxIter = (int)floorf(maxWidth / (2 * cellSize) - 1);
   int maxBatchCount = maxIter + 2; // could be fewer than this.
   state.maxBatchCount = maxBatchCount;
@@ -699,11 +1489,15 @@ void initBatches(RTNNState& state) {
   state.launchRadius = new float[maxBatchCount];
   state.h_res = new void*[maxBatchCount]();
   state.d_actQs = new float3*[maxBatchCount]();
+  state.d_actQIds = new unsigned int*[maxBatchCount]();
   state.h_actQs = new float3*[maxBatchCount]();
   state.d_aabb = new void*[maxBatchCount]();
   state.d_temp_buffer_gas = new void*[maxBatchCount]();
   state.d_buffer_temp_output_gas_and_compacted_size = new void*[maxBatchCount]();
   state.pipeline = new OptixPipeline[maxBatchCount];
+  state.d_knnKeys = new float*[maxBatchCount]();
+  state.d_knnIds = new unsigned int*[maxBatchCount]();
+  state.knnScratchRows = new size_t[maxBatchCount]();
 
   for (int i = 0; i < maxBatchCount; i++)
       CUDA_CHECK( cudaStreamCreate( &state.stream[i] ) );
@@ -716,7 +1510,10 @@ bool isClose(float3 a, float3 b) {
 }
 
 bool Timing::m_dontPrintTimes = false;
-unsigned int Timing::m_startCounter = 0;
-unsigned int Timing::m_stopCounter = 0;
-std::stack<TimingHelper> Timing::m_timingStack;
-std::unordered_map<int, AverageTime> Timing::m_averageTimes;
\ No newline at end of file
+std::atomic<unsigned int> Timing::m_startCounter(0);
+std::atomic<unsigned int> Timing::m_stopCounter(0);
+thread_local std::stack<TimingHelper> Timing::m_timingStack;
+std::unordered_map<int, AverageTime> Timing::m_averageTimes;
+bool Timing::m_perfEnabled = false;
+std::atomic<unsigned int> Timing::m_numQueries(0);
+PerfCounters Timing::m_perf;
\ No newline at end of file
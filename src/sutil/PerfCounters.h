@@ -0,0 +1,151 @@
+#ifndef __PERFCOUNTERS_H__
+#define __PERFCOUNTERS_H__
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters sampled around |Timing| phases. The counters
+// are opened once for the whole process (including threads spawned later) and
+// keep running; a phase simply snapshots them at start and stop, so nested
+// phases cost two reads each and need no bookkeeping of their own. Only host
+// (CPU) events are visible to perf_event; GPU kernels show up as whatever the
+// host does while waiting for them, so run with -m 0 to attribute that wait to
+// the phase that launched the kernels.
+
+enum PerfEvent
+{
+	PERF_EV_CYCLES = 0,
+	PERF_EV_INSTRUCTIONS,
+	PERF_EV_LLC_MISSES,
+	PERF_EV_DTLB_MISSES,
+	PERF_EV_BRANCH_MISSES,
+	PERF_EV_COUNT
+};
+
+struct PerfCounterValues
+{
+	uint64_t v[PERF_EV_COUNT];
+};
+
+class PerfCounters
+{
+public:
+	PerfCounters()
+	{
+		for (int i = 0; i < PERF_EV_COUNT; i++)
+			m_fd[i] = -1;
+	}
+
+	~PerfCounters() { close(); }
+
+	// returns false if no counter could be opened, e.g., when
+	// /proc/sys/kernel/perf_event_paranoid forbids user-space counting.
+	bool open()
+	{
+#if defined(__linux__)
+		const uint32_t types[PERF_EV_COUNT] = {
+			PERF_TYPE_HARDWARE,
+			PERF_TYPE_HARDWARE,
+			PERF_TYPE_HARDWARE,
+			PERF_TYPE_HW_CACHE,
+			PERF_TYPE_HARDWARE
+		};
+		const uint64_t configs[PERF_EV_COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES, // LLC misses on all mainstream PMUs
+			PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_BRANCH_MISSES
+		};
+
+		bool any = false;
+		for (int i = 0; i < PERF_EV_COUNT; i++)
+		{
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[i];
+			attr.config = configs[i];
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.inherit = 1; // count threads created after this point too
+			// counters are multiplexed if there are more events than PMU slots;
+			// the enabled/running times let us scale the raw counts.
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			m_fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0 /*this process*/, -1 /*any cpu*/, -1 /*no group*/, 0);
+			if (m_fd[i] >= 0) any = true;
+		}
+		return any;
+#else
+		return false;
+#endif
+	}
+
+	void close()
+	{
+#if defined(__linux__)
+		for (int i = 0; i < PERF_EV_COUNT; i++)
+		{
+			if (m_fd[i] >= 0) ::close(m_fd[i]);
+			m_fd[i] = -1;
+		}
+#endif
+	}
+
+	bool isOpen(int ev) const { return m_fd[ev] >= 0; }
+
+	PerfCounterValues read() const
+	{
+		PerfCounterValues res;
+		for (int i = 0; i < PERF_EV_COUNT; i++)
+		{
+			res.v[i] = 0;
+#if defined(__linux__)
+			if (m_fd[i] < 0) continue;
+			uint64_t buf[3]; // value, time enabled, time running
+			if (::read(m_fd[i], buf, sizeof(buf)) != sizeof(buf)) continue;
+			if (buf[2] == 0) continue;
+			res.v[i] = (buf[2] < buf[1]) ? (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+#endif
+		}
+		return res;
+	}
+
+	// print the counter deltas between |start| and |stop| of a phase. misses
+	// are normalized by |numQueries| if it's known.
+	void print(const std::string& name, const PerfCounterValues& start, const PerfCounterValues& stop, unsigned int numQueries) const
+	{
+		uint64_t d[PERF_EV_COUNT];
+		for (int i = 0; i < PERF_EV_COUNT; i++)
+			d[i] = (stop.v[i] >= start.v[i]) ? stop.v[i] - start.v[i] : 0;
+
+		const char* names[PERF_EV_COUNT] = { "cycles", "instructions", "LLC misses", "dTLB misses", "branch misses" };
+
+		std::cout << "perf " << name.c_str() << ":";
+		for (int i = 0; i < PERF_EV_COUNT; i++)
+		{
+			if (!isOpen(i)) continue;
+			std::cout << " " << names[i] << " " << d[i];
+			if (i >= PERF_EV_LLC_MISSES && numQueries != 0)
+				std::cout << " (" << (double)d[i] / numQueries << "/query)";
+			std::cout << ",";
+		}
+		if (isOpen(PERF_EV_CYCLES) && isOpen(PERF_EV_INSTRUCTIONS) && d[PERF_EV_CYCLES] != 0)
+			std::cout << " IPC " << (double)d[PERF_EV_INSTRUCTIONS] / d[PERF_EV_CYCLES];
+		std::cout << "\n" << std::flush;
+	}
+
+private:
+	int m_fd[PERF_EV_COUNT];
+};
+
+#endif
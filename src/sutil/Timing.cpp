@@ -1,7 +1,10 @@
 #include "Timing.h"
 
 std::unordered_map<int, AverageTime> Timing::m_averageTimes;
-std::stack<TimingHelper> Timing::m_timingStack;
+thread_local std::stack<TimingHelper> Timing::m_timingStack;
 bool Timing::m_dontPrintTimes = false;
-unsigned int Timing::m_startCounter = 0;
-unsigned int Timing::m_stopCounter = 0;
+std::atomic<unsigned int> Timing::m_startCounter(0);
+std::atomic<unsigned int> Timing::m_stopCounter(0);
+bool Timing::m_perfEnabled = false;
+std::atomic<unsigned int> Timing::m_numQueries(0);
+PerfCounters Timing::m_perf;
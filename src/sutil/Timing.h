@@ -7,17 +7,20 @@
 #define FORCE_INLINE __attribute__((always_inline))
 #endif
 
+#include <atomic>
 #include <iostream>
 #include <stack>
 #include <unordered_map>
 
 #include <chrono>
 #include "IDFactory.h"
+#include "PerfCounters.h"
 
 struct TimingHelper
 {
 	std::chrono::time_point<std::chrono::high_resolution_clock> start;
 	std::string name;
+	PerfCounterValues counters;
 };
 
 struct AverageTime
@@ -31,10 +34,31 @@ class Timing
 {
 public:
 	static bool m_dontPrintTimes;
-	static unsigned int m_startCounter;
-	static unsigned int m_stopCounter;
-	static std::stack<TimingHelper> m_timingStack;
+	static std::atomic<unsigned int> m_startCounter;
+	static std::atomic<unsigned int> m_stopCounter;
+	// per thread, so that concurrent stages (see the pipelined mode) each
+	// time their own nested phases.
+	static thread_local std::stack<TimingHelper> m_timingStack;
 	static std::unordered_map<int, AverageTime> m_averageTimes;
+	static bool m_perfEnabled;
+	static std::atomic<unsigned int> m_numQueries;
+	static PerfCounters m_perf;
+
+	// start sampling hardware counters for every subsequent phase. returns
+	// false (and keeps timing-only output) if the counters can't be opened.
+	static bool enablePerfCounters()
+	{
+		m_perfEnabled = m_perf.open();
+		if (!m_perfEnabled)
+			std::cerr << "Hardware performance counters unavailable (check /proc/sys/kernel/perf_event_paranoid).\n";
+		return m_perfEnabled;
+	}
+
+	// the query count used to normalize per-phase misses.
+	static void setQueryCount(unsigned int numQueries)
+	{
+		m_numQueries = numQueries;
+	}
 
 	static void reset()
 	{
@@ -50,6 +74,8 @@ public:
 		TimingHelper h;
 		h.start = std::chrono::high_resolution_clock::now();
 		h.name = name;
+		if (Timing::m_perfEnabled)
+			h.counters = Timing::m_perf.read();
 		Timing::m_timingStack.push(h);
 		Timing::m_startCounter++;
 	}
@@ -66,7 +92,16 @@ public:
 			double t = elapsed_seconds.count() * 1000.0;
 
 			if (print)
-				std::cout << "time " << h.name.c_str() << ": " << t << " ms\n\n" << std::flush;
+			{
+				if (Timing::m_perfEnabled)
+				{
+					std::cout << "time " << h.name.c_str() << ": " << t << " ms\n";
+					Timing::m_perf.print(h.name, h.counters, Timing::m_perf.read(), Timing::m_numQueries);
+					std::cout << "\n" << std::flush;
+				}
+				else
+					std::cout << "time " << h.name.c_str() << ": " << t << " ms\n\n" << std::flush;
+			}
 			return t;
 	}
 		return 0;
@@ -87,7 +122,11 @@ public:
 			double t = elapsed_seconds.count() * 1000.0;
 
 			if (print && !Timing::m_dontPrintTimes)
+			{
 				std::cout << "time " << h.name.c_str() << ": " << t << " ms\n" << std::flush;
+				if (Timing::m_perfEnabled)
+					Timing::m_perf.print(h.name, h.counters, Timing::m_perf.read(), Timing::m_numQueries);
+			}
 
 			if (id >= 0)
 			{